@@ -0,0 +1,95 @@
+/*
+ The four numbers that tell whether the header keeps up with a chatty child:
+ - start() latency, against the resident size of the parent (fork() has to copy its page tables)
+ - send_command() to the first line of the reply, with /bin/cat as the echo child
+ - read() throughput, in lines/s and MB/s, for short and long lines
+ - the cost of is_alive(), which a supervisor calls in a loop
+ */
+#include "sys_process.h"
+
+#include <benchmark/benchmark.h>
+
+#include <chrono>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace
+{
+    const char *cat_argv[] = { "/bin/cat", nullptr };
+
+    // args: MB of memory the parent touches before starting the child.
+    void BM_StartVsParentRss(benchmark::State &state)
+    {
+        std::vector<char> ballast(static_cast<size_t>(state.range(0)) << 20);
+        // touch every page, so that they are resident and fork() has to map them.
+        std::memset(ballast.data(), 1, ballast.size());
+        benchmark::DoNotOptimize(ballast.data());
+
+        for (auto _ : state)
+        {
+            System::Process process("/bin/cat");
+            const auto begin = std::chrono::steady_clock::now();
+            process.start(cat_argv);
+            const auto end = std::chrono::steady_clock::now();
+            state.SetIterationTime(std::chrono::duration<double>(end - begin).count());
+            // killed and reaped by the destructor, outside of the measurement.
+        }
+    }
+    BENCHMARK(BM_StartVsParentRss)->Arg(0)->Arg(64)->Arg(512)->UseManualTime()->Unit(benchmark::kMicrosecond);
+
+    void BM_RoundTrip(benchmark::State &state)
+    {
+        System::Process process("/bin/cat");
+        process.start(cat_argv);
+        std::vector<std::string_view> lines;
+
+        for (auto _ : state)
+        {
+            process.send_command("ping");
+            if (!process.read(lines, "ping", 1000)) {
+                state.SkipWithError("cat did not echo the command");
+                break;
+            }
+        }
+    }
+    BENCHMARK(BM_RoundTrip)->Unit(benchmark::kMicrosecond);
+
+    // args: length of the lines, newline included. The child is yes(1), which writes them as fast as it can.
+    void BM_ReadThroughput(benchmark::State &state)
+    {
+        constexpr size_t lines_per_iteration = 10000;
+        const size_t length = static_cast<size_t>(state.range(0));
+        const std::string line(length - 1, 'x');
+        const char *yes_argv[] = { "/usr/bin/yes", line.c_str(), nullptr };
+
+        System::Process process("/usr/bin/yes");
+        process.start(yes_argv);
+
+        for (auto _ : state)
+        {
+            size_t count = 0;
+            process.read_each([&count](std::string_view view) {
+                benchmark::DoNotOptimize(view.data());
+                return ++count == lines_per_iteration;
+            }, 1000);
+            if (count != lines_per_iteration) {
+                state.SkipWithError("yes stopped writing");
+                break;
+            }
+        }
+        state.SetItemsProcessed(static_cast<int64_t>(state.iterations() * lines_per_iteration));
+        state.SetBytesProcessed(static_cast<int64_t>(state.iterations() * lines_per_iteration * length));
+    }
+    BENCHMARK(BM_ReadThroughput)->Arg(16)->Arg(128)->Arg(1024)->Arg(16384);
+
+    void BM_IsAlive(benchmark::State &state)
+    {
+        System::Process process("/bin/cat");
+        process.start(cat_argv);
+
+        for (auto _ : state) benchmark::DoNotOptimize(process.is_alive());
+    }
+    BENCHMARK(BM_IsAlive);
+}
@@ -9,346 +9,5664 @@
 #define sys_process_h
 
 #include <iostream>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <memory_resource> // pmr::vector, pmr::string
+#include <span>
+#include <algorithm>
+#include <climits>  // IOV_MAX
+#include <cstdint>  // SIZE_MAX
+#include <memory>
+#include <utility>
+#include <chrono>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <unordered_map>
+#include <unordered_set>
+#include <atomic>
+#include <map>
+#include <optional>
+#include <coroutine>
+#include <exception>
+#include <type_traits>
+#include <array>
+#include <deque>
+#include <list>
+#include <future>
+#include <charconv> // from_chars
+#include <bit>      // bit_width, countr_zero
+#include <cstring>  // memchr, memmove, strerror
+#include <cerrno>
+#include <stdexcept>
+#if defined(_WIN32)
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h> // CreateProcess, CreateNamedPipe, I/O completion ports
+#include <io.h>      // _write
+#ifndef STDOUT_FILENO
+#define STDOUT_FILENO 1
+#define STDERR_FILENO 2
+#endif
+#else
 #include <unistd.h>
+#include <sys/wait.h> // waitpid
+#include <sys/uio.h>  // writev
 #include <poll.h>   // poll
 #include <fcntl.h>  // fcntl
 #include <signal.h> // kill
+#include <spawn.h>  // posix_spawn
+#include <termios.h> // cfmakeraw
+#include <sched.h>  // sched_setaffinity
+#include <sys/resource.h> // setpriority
+#include <stdlib.h> // posix_openpt
+#include <sys/mman.h> // mmap, memfd_create, shm_open
+#include <sys/stat.h> // fstat
+#include <sys/file.h> // flock
+#include <sys/syscall.h> // pidfd_open
+#if defined(__linux__)
+#include <sys/epoll.h>  // epoll
+#else
+#include <sys/event.h>  // kqueue
+#endif
+
+extern char **environ;
+#endif
 
 #define MAX_TIMEOUT_MS 1000*60*5
 
-// TODO, add the logic for windows (T_T).
 namespace System
 {
-    class Process
+#if defined(_WIN32)
+    // what the POSIX code calls them, so that the portable parts read the same on both sides.
+    using pid_t = DWORD;
+    using ssize_t = std::ptrdiff_t;
+    // there's no writev(), but the sends are gathered the same way, see Process::write_some_().
+    struct iovec
+    {
+        void *iov_base;
+        size_t iov_len;
+    };
+#endif
+
+    /*
+     Reusable buffer for the output of a child process.
+     
+     Bytes read from the pipe are appended at the back, and complete lines are framed with memchr
+     and consumed from the front. Lines never wrap around, so every line is a contiguous slice of
+     the buffer and can be handed out as a std::string_view without copying it anywhere.
+     The unconsumed tail is moved back to the front only when the caller says the previous lines
+     are not needed anymore, and the storage only grows when a single read() spans more than the
+     current capacity. In the steady state there are no allocations at all.
+     */
+    class LineBuffer
+    {
+    public:
+        explicit LineBuffer(size_t capacity = 1024) : data_(capacity) {}
+        
+        // drop everything already consumed, moving the unconsumed tail to the front.
+        // This invalidates all the lines handed out so far.
+        void discard_consumed()
+        {
+            if (head_ == 0) return;
+            
+            const size_t left = tail_ - head_;
+            if (left) std::memmove(data_.data(), data_.data() + head_, left);
+            scan_ -= head_;
+            tail_ = left;
+            head_ = 0;
+        }
+        
+        // make sure there is some free space at the back, growing the buffer if there is none.
+        // returns how much of it there is.
+        size_t reserve()
+        {
+            if (tail_ == data_.size()) data_.resize(data_.size() * 2);
+            return data_.size() - tail_;
+        }
+        
+#if !defined(_WIN32)
+        // one ::read() of at most max_bytes from fd into the free space at the back.
+        // returns whatever ::read() returned.
+        ssize_t fill(int fd, size_t max_bytes = SIZE_MAX)
+        {
+            const size_t room = std::min(reserve(), max_bytes);
+            
+            ssize_t bytes_read;
+            do {
+                bytes_read = ::read(fd, data_.data() + tail_, room);
+            } while (bytes_read == -1 && errno == EINTR);
+            
+            if (bytes_read > 0) tail_ += bytes_read;
+            return bytes_read;
+        }
+#endif
+        
+        // copy bytes that were read somewhere else to the back, e.g. by an overlapped ReadFile(),
+        // which needs a buffer that doesn't move until it completes.
+        void append(const char *bytes, size_t length)
+        {
+            while (data_.size() - tail_ < length) data_.resize(data_.size() * 2);
+            std::memcpy(data_.data() + tail_, bytes, length);
+            tail_ += length;
+        }
+        
+        // frame the next complete line (without the '\n'), false if there isn't one yet.
+        // offset and length are relative to the buffer start, so that they survive a fill().
+        bool next_line(size_t &offset, size_t &length)
+        {
+            const char *nl = static_cast<const char *>(std::memchr(data_.data() + scan_, '\n', tail_ - scan_));
+            if (!nl) {
+                // remember where we stopped, so that we don't scan the same bytes again.
+                scan_ = tail_;
+                return false;
+            }
+            offset = head_;
+            length = static_cast<size_t>(nl - data_.data()) - head_;
+            head_ = scan_ = offset + length + 1;
+            return true;
+        }
+        
+        // consume whatever is left as an unterminated line, false if there is nothing.
+        bool take_partial(size_t &offset, size_t &length)
+        {
+            if (head_ == tail_) return false;
+            
+            offset = head_;
+            length = tail_ - head_;
+            head_ = scan_ = tail_;
+            return true;
+        }
+        
+        std::string_view view(size_t offset, size_t length) const
+        {
+            return { data_.data() + offset, length };
+        }
+        
+        // one past the last valid byte, the lines are all before this.
+        size_t size() const { return tail_; }
+        
+        // bytes not consumed yet, framed or not.
+        size_t unconsumed() const { return tail_ - head_; }
+        
+        // forget everything, keeping the storage.
+        void clear() { head_ = scan_ = tail_ = 0; }
+        
+    private:
+        std::vector<char> data_;
+        size_t head_ = 0; // first byte not yet consumed
+        size_t scan_ = 0; // [head_, scan_) is known not to contain a '\n'
+        size_t tail_ = 0; // one past the last valid byte
+    };
+    
+    enum class LogLevel
+    {
+        debug,
+        info,
+        warning,
+        error,
+    };
+    
+    /*
+     Where the few things we have to say go (a child started, a poll failed...). There is no sink by default,
+     and then nothing is even formatted: we never write to our own stdout behind the caller's back.
+     A sink is a plain function pointer plus its context, called on the thread that logs, so it must not block:
+     see AsyncLogSink for one that hands the messages to a background thread, or stdout_sink() for the
+     old behaviour. Set it before starting processes from other threads.
+     */
+    class Log
+    {
+    public:
+        using Sink = void (*)(void *context, LogLevel level, std::string_view message);
+        
+        static void set_sink(Sink sink, void *context = nullptr)
+        {
+            context_.store(context, std::memory_order_relaxed);
+            sink_.store(sink, std::memory_order_release);
+        }
+        
+        // unset the sink, if it's still sink with context (and not one set after it).
+        static void clear_sink(Sink sink, void *context)
+        {
+            if (context_.load(std::memory_order_relaxed) != context) return;
+            Sink expected = sink;
+            sink_.compare_exchange_strong(expected, nullptr, std::memory_order_acq_rel);
+        }
+        
+        static bool enabled() { return sink_.load(std::memory_order_relaxed) != nullptr; }
+        
+        // the parts are string views or integers, concatenated in a buffer on the stack (and cut at 256 chars).
+        template <typename... Parts>
+        static void write(LogLevel level, const Parts &...parts)
+        {
+            const Sink sink = sink_.load(std::memory_order_acquire);
+            if (!sink) return;
+            
+            char buffer[256];
+            char *out = buffer;
+            char *const end = buffer + sizeof(buffer);
+            const auto append = [&out, end](const auto &part) {
+                if constexpr (std::is_integral_v<std::decay_t<decltype(part)>>) {
+                    const auto result = std::to_chars(out, end, part);
+                    if (result.ec == std::errc()) out = result.ptr;
+                } else {
+                    const std::string_view text(part);
+                    const size_t length = std::min<size_t>(text.size(), static_cast<size_t>(end - out));
+                    std::memcpy(out, text.data(), length);
+                    out += length;
+                }
+            };
+            (append(parts), ...);
+            sink(context_.load(std::memory_order_relaxed), level, std::string_view(buffer, static_cast<size_t>(out - buffer)));
+        }
+        
+        // synchronous, and so blocking, one write() per message to our stdout.
+        static void stdout_sink(void *, LogLevel, std::string_view message)
+        {
+#if defined(_WIN32)
+            char line[257];
+            const size_t length = std::min(message.size(), sizeof(line) - 1);
+            std::memcpy(line, message.data(), length);
+            line[length] = '\n';
+            DWORD written;
+            WriteFile(GetStdHandle(STD_OUTPUT_HANDLE), line, static_cast<DWORD>(length + 1), &written, nullptr);
+#else
+            const iovec iov[2] { { const_cast<char *>(message.data()), message.size() },
+                                 { const_cast<char *>("\n"), 1 } };
+            ssize_t written;
+            do {
+                written = ::writev(STDOUT_FILENO, iov, 2);
+            } while (written == -1 && errno == EINTR);
+#endif
+        }
+        
+    private:
+        static inline std::atomic<Sink> sink_ { nullptr };
+        static inline std::atomic<void *> context_ { nullptr };
+    };
+    
+    /*
+     A Log sink that never blocks the thread that logs: the messages are copied into a bounded lock-free
+     ring (a Vyukov MPMC queue, for any number of logging threads) and written to fd by a background thread.
+     When the ring is full the message is dropped and counted, rather than waiting for a slow terminal.
+     
+         System::AsyncLogSink logger(STDERR_FILENO);
+         System::Log::set_sink(&System::AsyncLogSink::sink, &logger);
+     
+     The destructor writes out what's left, and unsets the sink if it was this one.
+     */
+    class AsyncLogSink
+    {
+    public:
+        static constexpr size_t message_size = 256;
+        
+        // capacity is rounded up to a power of two, so that a position maps to its slot with a mask.
+        explicit AsyncLogSink(int fd = STDOUT_FILENO, size_t capacity = 1024)
+            : fd_(fd), slots_(std::bit_ceil(std::max<size_t>(capacity, 2))), mask_(slots_.size() - 1)
+        {
+            for (size_t i = 0; i < slots_.size(); i++) slots_[i].sequence.store(i, std::memory_order_relaxed);
+            writer_ = std::thread([this] { write_loop_(); });
+        }
+        ~AsyncLogSink()
+        {
+            Log::clear_sink(&AsyncLogSink::sink, this);
+            stopping_.store(true, std::memory_order_release);
+            pending_.fetch_add(1, std::memory_order_release);
+            pending_.notify_one();
+            writer_.join();
+        }
+        AsyncLogSink(const AsyncLogSink &) = delete;
+        AsyncLogSink& operator=(const AsyncLogSink &) = delete;
+        
+        // the Log::Sink, with the AsyncLogSink as its context.
+        static void sink(void *context, LogLevel level, std::string_view message)
+        {
+            static_cast<AsyncLogSink *>(context)->push(level, message);
+        }
+        
+        // false if the ring was full and the message dropped.
+        bool push(LogLevel level, std::string_view message)
+        {
+            size_t position = enqueue_position_.load(std::memory_order_relaxed);
+            Slot *slot;
+            for (;;)
+            {
+                slot = &slots_[position & mask_];
+                const size_t sequence = slot->sequence.load(std::memory_order_acquire);
+                const intptr_t difference = static_cast<intptr_t>(sequence) - static_cast<intptr_t>(position);
+                if (difference == 0) {
+                    if (enqueue_position_.compare_exchange_weak(position, position + 1, std::memory_order_relaxed))
+                        break;
+                } else if (difference < 0) {
+                    dropped_.fetch_add(1, std::memory_order_relaxed);
+                    return false;
+                } else {
+                    position = enqueue_position_.load(std::memory_order_relaxed);
+                }
+            }
+            slot->level = level;
+            slot->length = std::min(message.size(), message_size);
+            std::memcpy(slot->text, message.data(), slot->length);
+            slot->sequence.store(position + 1, std::memory_order_release);
+            
+            // only the first message of a batch wakes the writer up.
+            if (pending_.fetch_add(1, std::memory_order_release) == 0) pending_.notify_one();
+            return true;
+        }
+        
+        uint64_t dropped() const { return dropped_.load(std::memory_order_relaxed); }
+        
+    private:
+        struct Slot
+        {
+            std::atomic<size_t> sequence { 0 };
+            LogLevel level = LogLevel::info;
+            size_t length = 0;
+            char text[message_size];
+        };
+        
+        void write_loop_()
+        {
+            std::vector<char> batch;
+            unsigned unpublished_rounds = 0;
+            for (;;)
+            {
+                pending_.wait(0, std::memory_order_acquire);
+                const bool stopping = stopping_.load(std::memory_order_acquire);
+                
+                batch.clear();
+                for (;;)
+                {   // single consumer: no CAS on the dequeue side.
+                    Slot &slot = slots_[dequeue_position_ & mask_];
+                    if (slot.sequence.load(std::memory_order_acquire) != dequeue_position_ + 1) break;
+                    batch.insert(batch.end(), slot.text, slot.text + slot.length);
+                    batch.push_back('\n');
+                    slot.sequence.store(dequeue_position_ + mask_ + 1, std::memory_order_release);
+                    dequeue_position_++;
+                    pending_.fetch_sub(1, std::memory_order_relaxed);
+                }
+                if (batch.empty() && !stopping)
+                {   // the messages pending are behind a slot claimed but not published yet, and its
+                    // producer may have been preempted in between: let it run rather than spin on the slot,
+                    // yielding first, then sleeping longer and longer (up to 1 ms).
+                    if (unpublished_rounds < 16) std::this_thread::yield();
+                    else std::this_thread::sleep_for(std::chrono::microseconds(std::min(1u << (unpublished_rounds - 16), 1000u)));
+                    unpublished_rounds = std::min(unpublished_rounds + 1, 32u);
+                    continue;
+                }
+                unpublished_rounds = 0;
+                // one write() for everything that piled up meanwhile.
+                for (size_t done = 0; done < batch.size();) {
+#if defined(_WIN32)
+                    const ssize_t written = _write(fd_, batch.data() + done, static_cast<unsigned>(batch.size() - done));
+#else
+                    const ssize_t written = ::write(fd_, batch.data() + done, batch.size() - done);
+#endif
+                    if (written == -1 && errno == EINTR) continue;
+                    if (written <= 0) break;
+                    done += static_cast<size_t>(written);
+                }
+                if (stopping) return;
+            }
+        }
+        
+        int fd_;
+        std::vector<Slot> slots_;
+        size_t mask_ = 0;
+        alignas(64) std::atomic<size_t> enqueue_position_ { 0 };
+        alignas(64) size_t dequeue_position_ = 0;
+        std::atomic<uint32_t> pending_ { 0 };
+        std::atomic<bool> stopping_ { false };
+        std::atomic<uint64_t> dropped_ { 0 };
+        std::thread writer_;
+    };
+    
+    // how the timeout given to Process::read()/read_each() is accounted for.
+    enum class TimeoutMode
+    {
+        idle,       // restarts every time some output arrives: we only give up once the child went quiet.
+        deadline,   // the whole read has to complete within the timeout, however much output arrives.
+    };
+    
+    // how the last Process::read()/read_each() ended.
+    enum class ReadStatus
+    {
+        matched,            // found the expected line, or the callback asked to stop.
+        idle_timeout,       // TimeoutMode::idle, the child didn't write anything for the whole timeout.
+        deadline_expired,   // TimeoutMode::deadline, we ran out of time.
+        eof,                // the child closed its output.
+    };
+    
+    // what Process::send_commands() does when the lines don't fit in the write queue.
+    enum class Backpressure
+    {
+        block,  // wait for the child to make room, reading its output meanwhile.
+        fail,   // send nothing and return false.
+    };
+    
+    // A command plus the prefix of the line that ends its reply, see Process::pipeline().
+    // e.g. { "isready", "readyok" }, { "go depth 10", "bestmove" }, { "ucinewgame", "" } when there's no reply.
+    struct PipelinedRequest
+    {
+        std::string_view command;
+        std::string_view terminator;
+    };
+    
+    /*
+     Several line prefixes to stop a read() at, e.g. "bestmove", "readyok" or an error, telling which one
+     it was. Built at compile time when the patterns are literals:
+         static constexpr System::PrefixMatcher terminators { "bestmove", "readyok", "error" };
+     The first byte of the line selects the candidates from a 256 entry table of bit masks, so most lines
+     are rejected with a single load, and only the candidates are compared. When several patterns match,
+     the first one given wins. An empty pattern matches every line.
+     */
+    template <size_t N>
+    class PrefixMatcher
+    {
+        static_assert(N > 0 && N <= 64, "PrefixMatcher takes between 1 and 64 patterns");
+        
+    public:
+        static constexpr size_t npos = static_cast<size_t>(-1);
+        
+        template <typename... Patterns>
+        constexpr explicit PrefixMatcher(const Patterns &...patterns) : patterns_ { std::string_view(patterns)... }
+        {
+            // fewer would leave empty patterns behind, and an empty pattern matches every line.
+            static_assert(sizeof...(Patterns) == N, "PrefixMatcher<N> takes exactly N patterns");
+            for (size_t i = 0; i < N; i++) {
+                const uint64_t bit = uint64_t(1) << i;
+                if (patterns_[i].empty()) {
+                    for (uint64_t &candidates : first_byte_) candidates |= bit;
+                } else {
+                    first_byte_[static_cast<unsigned char>(patterns_[i][0])] |= bit;
+                }
+            }
+        }
+        
+        // the index of the pattern line starts with, npos if none.
+        constexpr size_t match(std::string_view line) const
+        {
+            if (line.empty()) return npos;
+            uint64_t candidates = first_byte_[static_cast<unsigned char>(line[0])];
+            while (candidates) {
+                const size_t i = static_cast<size_t>(std::countr_zero(candidates));
+                if (line.starts_with(patterns_[i])) return i;
+                candidates &= candidates - 1;
+            }
+            return npos;
+        }
+        
+        constexpr std::string_view pattern(size_t i) const { return patterns_[i]; }
+        static constexpr size_t size() { return N; }
+        
+    private:
+        std::array<std::string_view, N> patterns_;
+        std::array<uint64_t, 256> first_byte_ {};
+    };
+    
+    template <typename... Patterns>
+    PrefixMatcher(const Patterns &...) -> PrefixMatcher<sizeof...(Patterns)>;
+    
+    // where the standard error of a child goes.
+    enum class StderrMode
+    {
+        inherit,    // same as ours, e.g. the terminal or journald.
+        discard,    // /dev/null, the child never blocks on it and we never see it.
+        capture,    // a third pipe, polled together with the output, see Process::set_stderr_callback().
+    };
+    
+    // Where and how a child runs, see ProcessOptions::placement. Everything but nice is Linux only,
+    // and ignored on the other platforms, but for Windows, where the cpus (up to 64) apply too,
+    // and the nice value picks the priority class.
+    // The cpus, the NUMA node and the SCHED_OTHER/FIFO/RR policies are in place when the child execs.
+    // SCHED_BATCH/IDLE (which posix_spawn doesn't apply), the nice value and the cgroup can only be set
+    // once the child exists, so it runs with ours until start() gets to them, typically a few microseconds.
+    // If any of them fails, start() kills the child and throws.
+    struct Placement
+    {
+        // the CPUs the child may run on, empty to inherit ours.
+        std::vector<int> cpus {};
+        // bind the memory of the child to this NUMA node, -1 for the default policy (first touch).
+        int numa_node = -1;
+        // the nice value of the child, e.g. 5 to stay behind our own threads.
+        std::optional<int> nice {};
+        // SCHED_OTHER, SCHED_BATCH (throughput, longer slices), SCHED_IDLE...
+        std::optional<int> scheduling_policy {};
+        // a cgroup v2 directory (e.g. "/sys/fs/cgroup/engines") to move the child into.
+        std::string cgroup {};
+        // for ProcessPool: give every child its own slice of cpus (or of our CPUs if empty), grouped by NUMA node,
+        // and bind its memory to the node of its slice, unless numa_node says otherwise.
+        bool spread = false;
+    };
+    
+    // The CPUs and NUMA nodes of the machine, from sched_getaffinity() and /sys (GetProcessAffinityMask()
+    // and GetNumaNodeProcessorMask() on Windows, for the first 64 CPUs).
+    class CpuTopology
+    {
+    public:
+        // the CPUs we are allowed to run on, in order.
+        static std::vector<int> allowed_cpus()
+        {
+            std::vector<int> cpus;
+#if defined(__linux__)
+            cpu_set_t set;
+            CPU_ZERO(&set);
+            if (sched_getaffinity(0, sizeof(set), &set) == 0) {
+                for (int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+                    if (CPU_ISSET(cpu, &set)) cpus.push_back(cpu);
+            }
+#elif defined(_WIN32)
+            DWORD_PTR process_mask, system_mask;
+            if (GetProcessAffinityMask(GetCurrentProcess(), &process_mask, &system_mask)) {
+                for (int cpu = 0; cpu < static_cast<int>(8 * sizeof(DWORD_PTR)); cpu++)
+                    if (process_mask & (DWORD_PTR(1) << cpu)) cpus.push_back(cpu);
+            }
+#endif
+            if (cpus.empty()) {
+                const unsigned count = std::max(1u, std::thread::hardware_concurrency());
+                for (unsigned cpu = 0; cpu < count; cpu++) cpus.push_back(static_cast<int>(cpu));
+            }
+            return cpus;
+        }
+        
+        // the NUMA node of cpu, 0 if we can't tell (or there's just the one node).
+        static int node_of(int cpu)
+        {
+#if defined(__linux__)
+            for (int node = 0; node < 1024; node++) {
+                const std::vector<int> cpus = cpus_of_node(node);
+                if (cpus.empty() && access(node_path_(node).c_str(), F_OK) != 0) break;
+                if (std::find(cpus.begin(), cpus.end(), cpu) != cpus.end()) return node;
+            }
+#elif defined(_WIN32)
+            UCHAR node;
+            if (cpu >= 0 && cpu < 64 && GetNumaProcessorNode(static_cast<UCHAR>(cpu), &node) && node != 0xff)
+                return node;
+#endif
+            (void)cpu;
+            return 0;
+        }
+        
+        // the CPUs of a NUMA node, from its cpulist ("0-7,16-23"), empty if there is no such node.
+        static std::vector<int> cpus_of_node(int node)
+        {
+            std::vector<int> cpus;
+#if defined(_WIN32)
+            ULONGLONG mask;
+            if (node < 0 || node > 0xff || !GetNumaNodeProcessorMask(static_cast<UCHAR>(node), &mask)) return cpus;
+            for (int cpu = 0; cpu < 64; cpu++)
+                if (mask & (ULONGLONG(1) << cpu)) cpus.push_back(cpu);
+            return cpus;
+#else
+            const int fd = open((node_path_(node) + "/cpulist").c_str(), O_RDONLY | O_CLOEXEC);
+            if (fd == -1) return cpus;
+            char text[4096];
+            const ssize_t length = ::read(fd, text, sizeof(text));
+            close(fd);
+            if (length <= 0) return cpus;
+            
+            const char *at = text;
+            const char *end = text + length;
+            while (at < end) {
+                int first = 0, last = 0;
+                auto result = std::from_chars(at, end, first);
+                if (result.ec != std::errc()) break;
+                last = first;
+                at = result.ptr;
+                if (at < end && *at == '-') {
+                    result = std::from_chars(at + 1, end, last);
+                    if (result.ec != std::errc()) break;
+                    at = result.ptr;
+                }
+                for (int cpu = first; cpu <= last; cpu++) cpus.push_back(cpu);
+                if (at < end && *at == ',') at++;
+                else break;
+            }
+            return cpus;
+#endif
+        }
+        
+        // cpus, stably sorted by NUMA node: consecutive slices of it stay on one node as much as possible.
+        static std::vector<int> by_node(std::vector<int> cpus)
+        {
+            std::vector<std::pair<int, int>> nodes;
+            for (int cpu : cpus) nodes.emplace_back(node_of(cpu), cpu);
+            std::stable_sort(nodes.begin(), nodes.end(), [](const auto &a, const auto &b) { return a.first < b.first; });
+            for (size_t i = 0; i < cpus.size(); i++) cpus[i] = nodes[i].second;
+            return cpus;
+        }
+        
+    private:
+        static std::string node_path_(int node) { return "/sys/devices/system/node/node" + std::to_string(node); }
+    };
+    
+    // Tuning knobs for a Process, for children that write a lot of output.
+    struct ProcessOptions
+    {
+        // capacity of the two pipes, 0 to keep the system default (64 KiB on Linux).
+        // Only supported on Linux (F_SETPIPE_SZ), ignored elsewhere or if the kernel refuses it.
+        size_t pipe_size = 0;
+        // initial size of the read buffer, and so the most a single read() syscall can fetch.
+        size_t read_chunk_size = 64 * 1024;
+        // see Process::set_write_queue()
+        size_t write_queue_limit = 1 << 20;
+        Backpressure backpressure = Backpressure::block;
+        // how much unread output a send may buffer while it waits for the child to make room in its input:
+        // past this the child floods us faster than it reads, and the send throws instead of taking all the memory.
+        // A read() throws too when what it keeps until its expected line (with the line spans) grows past it.
+        size_t max_buffered_output = 16 << 20;
+        StderrMode stderr_mode = StderrMode::inherit;
+        // bytes of shared memory in each direction for bulk payloads, 0 for none, see SharedChannel.
+        size_t shared_memory_size = 0;
+        // give the child a pseudo-terminal as its standard output instead of a pipe. A stdio that sees a pipe
+        // buffers the output in blocks of a few KiB, and we get the lines in late bursts; on a terminal it
+        // flushes every line. The terminal is raw (no echo, no '\n' -> "\r\n"), so read() frames the same lines.
+        bool pseudo_terminal = false;
+        // CPUs, NUMA node, priority and cgroup of the child.
+        Placement placement {};
+    };
+    
+    // What the pipes of a Process actually went through, to see whether the chunks are large enough.
+    struct IoStats
+    {
+        uint64_t bytes_read = 0;
+        uint64_t read_calls = 0;
+        uint64_t bytes_written = 0;
+        uint64_t write_calls = 0;
+        
+        double bytes_per_read() const { return read_calls ? double(bytes_read) / read_calls : 0.0; }
+        double bytes_per_write() const { return write_calls ? double(bytes_written) / write_calls : 0.0; }
+    };
+    
+    /*
+     A log-linear histogram of latencies, in the spirit of HdrHistogram: the values (in microseconds)
+     are bucketed by their highest set bit, and each power of two is split in sub_buckets linear steps.
+     So the relative error is at most 1 / sub_buckets (12.5%) from one microsecond to hours, with
+     a fixed array of counters, and record() is a handful of instructions with no allocation.
+     */
+    class LatencyHistogram
+    {
+    public:
+        static constexpr unsigned sub_bucket_bits = 3;
+        static constexpr unsigned sub_buckets = 1u << sub_bucket_bits;
+        
+        void record(std::chrono::nanoseconds latency)
+        {
+            const uint64_t us = static_cast<uint64_t>(std::max<int64_t>(latency.count(), 0)) / 1000;
+            counts_[index_(us)]++;
+            count_++;
+            sum_us_ += us;
+            max_us_ = std::max(max_us_, us);
+        }
+        
+        uint64_t count() const { return count_; }
+        std::chrono::microseconds max() const { return std::chrono::microseconds(max_us_); }
+        std::chrono::microseconds mean() const
+        {
+            return std::chrono::microseconds(count_ ? sum_us_ / count_ : 0);
+        }
+        
+        // the upper bound of the bucket holding the q-th quantile (0.5 for the median, 0.99...), 0 if empty.
+        std::chrono::microseconds percentile(double q) const
+        {
+            if (count_ == 0) return std::chrono::microseconds(0);
+            const uint64_t rank = static_cast<uint64_t>(std::clamp(q, 0.0, 1.0) * double(count_ - 1)) + 1;
+            uint64_t seen = 0;
+            for (size_t i = 0; i < counts_.size(); i++) {
+                seen += counts_[i];
+                if (seen >= rank) return std::chrono::microseconds(std::min(upper_bound_(i), max_us_));
+            }
+            return max();
+        }
+        
+    private:
+        // below sub_buckets every value has its own bucket, above that each power of two gets sub_buckets.
+        static size_t index_(uint64_t value)
+        {
+            if (value < sub_buckets) return static_cast<size_t>(value);
+            const unsigned magnitude = static_cast<unsigned>(std::bit_width(value)) - 1;
+            const uint64_t sub = (value >> (magnitude - sub_bucket_bits)) & (sub_buckets - 1);
+            return (magnitude - sub_bucket_bits + 1) * sub_buckets + static_cast<size_t>(sub);
+        }
+        
+        static uint64_t upper_bound_(size_t index)
+        {
+            if (index < sub_buckets) return index;
+            const unsigned magnitude = static_cast<unsigned>(index / sub_buckets) + sub_bucket_bits - 1;
+            const uint64_t sub = index % sub_buckets;
+            const uint64_t step = uint64_t(1) << (magnitude - sub_bucket_bits);
+            return (uint64_t(1) << magnitude) + (sub + 1) * step - 1;
+        }
+        
+        std::array<uint64_t, (64 - sub_bucket_bits + 1) * sub_buckets> counts_ {};
+        uint64_t count_ = 0;
+        uint64_t sum_us_ = 0;
+        uint64_t max_us_ = 0;
+    };
+    
+    // Everything Process::metrics() knows, copied out at once.
+    struct ProcessMetrics
+    {
+        IoStats io {};
+        uint64_t poll_calls = 0;
+        // the polls that didn't get us any output: they timed out, only the write end or the standard error
+        // were ready, or the read that followed ended with EAGAIN.
+        uint64_t empty_polls = 0;
+        uint64_t lines_framed = 0;
+        // from the first command sent after the last reply, to the line a read() was waiting for.
+        LatencyHistogram command_latency {};
+    };
+    
+    /*
+     The hooks a Process calls on its hot paths, as a policy picked at compile time: with NoMetrics they are
+     empty inline functions and the member takes no space, so nothing is left of them in the binary.
+     Process is BasicProcess<NoMetrics>, use BasicProcess<RecordingMetrics> to get them counted instead.
+     */
+    struct NoMetrics
+    {
+        static constexpr bool enabled = false;
+        void on_poll(bool) {}
+        void on_line() {}
+        void on_send() {}
+        void on_reply() {}
+        void snapshot(ProcessMetrics &) const {}
+    };
+    
+    // Plain counters, no atomics: one thread drives the process and calls metrics(), as with the rest of it.
+    struct RecordingMetrics
+    {
+        static constexpr bool enabled = true;
+        void on_poll(bool yielded_data)
+        {
+            metrics_.poll_calls++;
+            if (!yielded_data) metrics_.empty_polls++;
+        }
+        void on_line() { metrics_.lines_framed++; }
+        // only the first send starts the clock, the ones before the reply are part of the same request.
+        void on_send()
+        {
+            if (!waiting_) sent_at_ = std::chrono::steady_clock::now();
+            waiting_ = true;
+        }
+        void on_reply()
+        {
+            if (!waiting_) return;
+            metrics_.command_latency.record(std::chrono::steady_clock::now() - sent_at_);
+            waiting_ = false;
+        }
+        void snapshot(ProcessMetrics &out) const
+        {
+            const IoStats io = out.io;
+            out = metrics_;
+            out.io = io;
+        }
+        
+    private:
+        ProcessMetrics metrics_ {};
+        std::chrono::steady_clock::time_point sent_at_ {};
+        bool waiting_ = false;
+    };
+    
+#if !defined(_WIN32)
+    /*
+      Two single-producer/single-consumer byte rings in a shared memory file, one per direction,
+      for payloads too large to be worth formatting as text and pushing through the pipes.
+      
+      The parent creates the channel (ProcessOptions::shared_memory_size), the child inherits it as
+      fd SharedChannel::child_fd, and finds its size in the environment_variable, see from_environment().
+      The payload is written in place (reserve()/commit()), and only a doorbell line goes through the pipe:
+      
+          <command> <offset> <length>\n
+      
+      which the other side parses (parse_doorbell()), reads in place (view()) and hands back (release()).
+      The payloads are released in the order they were committed, like the pipe lines they ride with.
+    */
+    class SharedChannel
+    {
+    public:
+        static constexpr int child_fd = 3;
+        static constexpr const char *environment_variable = "SYS_PROCESS_SHM";
+        
+        // parent side: a new anonymous shared memory file, with capacity bytes in each direction
+        // (rounded up to the page size).
+        explicit SharedChannel(size_t capacity)
+        {
+            const size_t page = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+            capacity_ = (std::max<size_t>(capacity, 1) + page - 1) / page * page;
+#if defined(__linux__)
+            fd_ = memfd_create("sys_process", MFD_CLOEXEC);
+#else
+            // no memfd: a named object, unlinked right away, so only the fds keep it alive.
+            static std::atomic<unsigned> counter { 0 };
+            const std::string name = "/sys_process." + std::to_string(getpid()) + "." + std::to_string(counter++);
+            fd_ = shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+            if (fd_ != -1) {
+                shm_unlink(name.c_str());
+                fcntl(fd_, F_SETFD, FD_CLOEXEC);
+            }
+#endif
+            if (fd_ == -1) throw std::runtime_error("Error: failed to create the shared memory channel");
+            // keep it clear of the fd the child gets it as, see Process::start().
+            if (fd_ <= child_fd) {
+                const int high_fd = fcntl(fd_, F_DUPFD_CLOEXEC, child_fd + 1);
+                close(fd_);
+                fd_ = high_fd;
+            }
+            if (fd_ == -1 || ftruncate(fd_, static_cast<off_t>(mapping_size_())) == -1) {
+                if (fd_ != -1) close(fd_);
+                throw std::runtime_error("Error: failed to size the shared memory channel");
+            }
+            map_(false);
+        }
+        
+        // child side: the channel set up by the parent, if it did set one up.
+        static std::optional<SharedChannel> from_environment()
+        {
+            const char *value = getenv(environment_variable);
+            if (value == nullptr) return std::nullopt;
+            size_t capacity = 0;
+            const char *end = value + strlen(value);
+            if (std::from_chars(value, end, capacity).ptr != end || capacity == 0) return std::nullopt;
+            return SharedChannel(child_fd, capacity);
+        }
+        
+        ~SharedChannel() noexcept
+        {
+            if (mapping_ != nullptr) munmap(mapping_, mapping_size_());
+            if (fd_ != -1) close(fd_);
+        }
+        SharedChannel(const SharedChannel &) = delete;
+        SharedChannel& operator=(const SharedChannel &) = delete;
+        SharedChannel(SharedChannel &&other) noexcept { *this = std::move(other); }
+        SharedChannel& operator=(SharedChannel &&other) noexcept
+        {
+            std::swap(fd_, other.fd_);
+            std::swap(capacity_, other.capacity_);
+            std::swap(mapping_, other.mapping_);
+            std::swap(outbound_, other.outbound_);
+            std::swap(inbound_, other.inbound_);
+            return *this;
+        }
+        
+        int fd() const { return fd_; }
+        size_t capacity() const { return capacity_; }
+        
+        // contiguous room for length bytes in the outbound ring, empty if the other side
+        // hasn't released enough yet. Only one reservation at a time: the next one replaces it.
+        std::span<std::byte> reserve(size_t length)
+        {
+            Ring &ring = outbound_;
+            if (length == 0 || length > capacity_) return {};
+            
+            uint64_t position = ring.header->head.load(std::memory_order_relaxed);
+            const size_t offset = position % capacity_;
+            // a payload never wraps around: skip the end of the ring instead.
+            if (offset + length > capacity_) position += capacity_ - offset;
+            if (position + length - ring.header->tail.load(std::memory_order_acquire) > capacity_) return {};
+            
+            ring.reserved = position;
+            return { ring.data + position % capacity_, length };
+        }
+        
+        // publish the (beginning of the) last reservation, returns its offset for the doorbell.
+        size_t commit(std::span<const std::byte> reserved)
+        {
+            Ring &ring = outbound_;
+            const size_t offset = ring.reserved % capacity_;
+            if (reserved.data() != ring.data + offset || offset + reserved.size() > capacity_)
+                throw std::runtime_error("Error: committing a span that wasn't reserved");
+            ring.header->head.store(ring.reserved + reserved.size(), std::memory_order_release);
+            return offset;
+        }
+        
+        // a payload committed by the other side, as announced by its doorbell.
+        std::span<const std::byte> view(size_t offset, size_t length) const
+        {
+            if (offset > capacity_ || length > capacity_ - offset)
+                throw std::runtime_error("Error: doorbell out of the shared memory bounds");
+            // pairs with the release in commit(), the doorbell itself went through the kernel anyway.
+            (void)inbound_.header->head.load(std::memory_order_acquire);
+            return { inbound_.data + offset, length };
+        }
+        
+        // hand a payload (and all the ones before it) back to the other side.
+        void release(size_t offset, size_t length)
+        {
+            const uint64_t tail = inbound_.header->tail.load(std::memory_order_relaxed);
+            // the distance from the tail covers the end of the ring, if the payload skipped it.
+            const uint64_t skipped = (offset + capacity_ - tail % capacity_) % capacity_;
+            inbound_.header->tail.store(tail + skipped + length, std::memory_order_release);
+        }
+        
+        // split "<command> <offset> <length>", false if the line isn't a doorbell.
+        static bool parse_doorbell(std::string_view line, std::string_view &command, size_t &offset, size_t &length)
+        {
+            while (!line.empty() && (line.back() == '\n' || line.back() == '\r')) line.remove_suffix(1);
+            const size_t length_at = line.rfind(' ');
+            if (length_at == std::string_view::npos) return false;
+            const size_t offset_at = line.rfind(' ', length_at - 1);
+            if (offset_at == std::string_view::npos || length_at == 0) return false;
+            
+            const char *end = line.data() + line.size();
+            if (std::from_chars(line.data() + length_at + 1, end, length).ptr != end) return false;
+            if (std::from_chars(line.data() + offset_at + 1, line.data() + length_at, offset).ptr != line.data() + length_at)
+                return false;
+            command = line.substr(0, offset_at);
+            return true;
+        }
+        
+        // write " <offset> <length>\n" into buffer, returns how many chars that took.
+        static size_t format_doorbell(std::span<char, 48> buffer, size_t offset, size_t length)
+        {
+            // two 20 digit numbers at most, plus the separators: 48 chars are always enough.
+            char *out = buffer.data();
+            char *end = out + buffer.size();
+            *out++ = ' ';
+            out = std::to_chars(out, end, offset).ptr;
+            if (out < end) *out++ = ' ';
+            out = std::to_chars(out, end, length).ptr;
+            if (out < end) *out++ = '\n';
+            return static_cast<size_t>(out - buffer.data());
+        }
+        
+    private:
+        // head and tail count bytes since the start, they don't wrap: position % capacity is the offset.
+        struct alignas(64) RingHeader
+        {
+            alignas(64) std::atomic<uint64_t> head;    // written by the producer only
+            alignas(64) std::atomic<uint64_t> tail;    // written by the consumer only
+        };
+        static_assert(std::atomic<uint64_t>::is_always_lock_free, "shared memory needs lock-free atomics");
+        
+        struct Ring
+        {
+            RingHeader *header = nullptr;
+            std::byte *data = nullptr;
+            uint64_t reserved = 0;
+        };
+        
+        SharedChannel(int fd, size_t capacity) : fd_(fd), capacity_(capacity) { map_(true); }
+        
+        // one page for the header of each ring, then its data: [header 0][data 0][header 1][data 1]
+        size_t ring_size_() const { return static_cast<size_t>(sysconf(_SC_PAGESIZE)) + capacity_; }
+        size_t mapping_size_() const { return 2 * ring_size_(); }
+        
+        void map_(bool child)
+        {
+            void *mapping = mmap(nullptr, mapping_size_(), PROT_READ | PROT_WRITE, MAP_SHARED, fd_, 0);
+            if (mapping == MAP_FAILED) {
+                close(fd_);
+                fd_ = -1;
+                throw std::runtime_error("Error: failed to map the shared memory channel");
+            }
+            mapping_ = static_cast<std::byte *>(mapping);
+            const size_t page = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+            Ring rings[2];
+            for (size_t i = 0; i < 2; i++) {
+                std::byte *base = mapping_ + i * ring_size_();
+                // a fresh file is all zeros, which is an empty ring: only the parent constructs the headers.
+                rings[i].header = child ? reinterpret_cast<RingHeader *>(base) : new (base) RingHeader {};
+                rings[i].data = base + page;
+            }
+            // ring 0 goes from the parent to the child, ring 1 the other way around.
+            outbound_ = rings[child ? 1 : 0];
+            inbound_ = rings[child ? 0 : 1];
+        }
+        
+        int fd_ = -1;
+        size_t capacity_ = 0;
+        std::byte *mapping_ = nullptr;
+        Ring outbound_;
+        Ring inbound_;
+    };
+#endif
+    
+    // How Process::shutdown() asks a child to go: each step only happens if the one before didn't work.
+    struct ShutdownPolicy
+    {
+        // sent first, as a line, e.g. "quit" for UCI engines. Empty to skip that step.
+        std::string quit_command = "quit";
+        std::chrono::milliseconds quit_timeout { 1000 };
+        // then SIGTERM, and SIGKILL after this much longer.
+        std::chrono::milliseconds terminate_timeout { 1000 };
+    };
+    
+    // the step of the ShutdownPolicy the child exited after.
+    enum class ShutdownStep
+    {
+        not_running,    // there was nothing to shut down.
+        quit,
+        terminate,
+        kill,
+    };
+    
+#if !defined(_WIN32)
+    // What the registry knows about one child, shared between its Process and the reaper thread.
+    struct ChildState
+    {
+        pid_t pid = 0;
+        // cleared (and notified) exactly once, right after the child was reaped.
+        std::atomic<bool> alive { true };
+        // the status from waitpid(), valid once alive is false.
+        int status = 0;
+    };
+    
+    /*
+      The process-wide registry of the children we started, and the only place that reaps them.
+      
+      A single reaper thread waits for the children to exit, then calls waitpid() on the exact pid that did,
+      so the exit status is collected once, by us, and never by a Process for somebody else's child.
+      On Linux it waits on a pidfd for each child (pidfd_open, Linux 5.3), with kqueue it waits on
+      EVFILT_PROC/NOTE_EXIT. If neither works (an older kernel) it falls back to a SIGCHLD handler writing to a
+      self-pipe, and then polls each of its children with waitpid(WNOHANG) whenever a SIGCHLD arrives.
+    */
+    class ChildRegistry
     {
     public:
-        Process(const std::string &command) : command_(command)
+        // never destroyed: the reaper thread lives as long as the program does.
+        static ChildRegistry &instance()
+        {
+            static ChildRegistry *registry = new ChildRegistry;
+            return *registry;
+        }
+        
+        std::shared_ptr<ChildState> track(pid_t pid)
+        {
+            auto state = std::make_shared<ChildState>();
+            state->pid = pid;
+            
+            std::lock_guard<std::mutex> lock(mutex_);
+            Child child { state, -1 };
+#if defined(__linux__) && defined(SYS_pidfd_open)
+            child.pidfd = static_cast<int>(syscall(SYS_pidfd_open, pid, 0));
+            if (child.pidfd != -1) {
+                fcntl(child.pidfd, F_SETFD, FD_CLOEXEC);
+                epoll_event event { .events = EPOLLIN, .data = { .fd = child.pidfd } };
+                epoll_ctl(poll_fd_, EPOLL_CTL_ADD, child.pidfd, &event);
+            }
+#elif !defined(__linux__)
+            struct kevent change;
+            EV_SET(&change, pid, EVFILT_PROC, EV_ADD | EV_ONESHOT, NOTE_EXIT, 0, nullptr);
+            // ESRCH: it already exited, the scan below gets it.
+            if (kevent(poll_fd_, &change, 1, nullptr, 0, nullptr) == 0) child.pidfd = pid;
+#endif
+            if (child.pidfd == -1) install_sigchld_handler_();
+            children_.emplace(pid, std::move(child));
+            // the child might have died before we started waiting for it, so a scan is due anyway.
+            wake_();
+            return state;
+        }
+        
+        // send sig to the child unless it was already reaped: its pid could belong to a new process by now.
+        // Runs under the same lock as the reaping, so the two can't interleave.
+        bool signal(const ChildState &state, int sig)
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (!state.alive.load(std::memory_order_relaxed)) return false;
+            return kill(state.pid, sig) == 0;
+        }
+        
+        // block until the child was reaped.
+        static void wait(const ChildState &state)
+        {
+            state.alive.wait(true, std::memory_order_acquire);
+        }
+        
+        // block until all the children were reaped, or the deadline; true if they all were.
+        bool wait_until(std::span<const ChildState * const> states, std::chrono::steady_clock::time_point deadline)
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            return reaped_cv_.wait_until(lock, deadline, [states] {
+                return std::none_of(states.begin(), states.end(), [](const ChildState *state) {
+                    return state->alive.load(std::memory_order_relaxed);
+                });
+            });
+        }
+        
+    private:
+        struct Child
+        {
+            std::shared_ptr<ChildState> state;
+            // the pidfd (Linux) or the pid watched by the kqueue, -1 if only a SIGCHLD tells us about it.
+            int pidfd;
+        };
+        
+        ChildRegistry()
+        {
+            if (pipe(wake_pipe_) == -1) throw std::runtime_error("Error: failed to create the reaper pipe");
+            for (int fd : wake_pipe_) {
+                fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+                fcntl(fd, F_SETFD, FD_CLOEXEC);
+            }
+            wake_fd_ = wake_pipe_[1];
+#if defined(__linux__)
+            poll_fd_ = epoll_create1(EPOLL_CLOEXEC);
+            epoll_event event { .events = EPOLLIN, .data = { .fd = wake_pipe_[0] } };
+            epoll_ctl(poll_fd_, EPOLL_CTL_ADD, wake_pipe_[0], &event);
+#else
+            poll_fd_ = kqueue();
+            struct kevent change;
+            EV_SET(&change, wake_pipe_[0], EVFILT_READ, EV_ADD, 0, 0, nullptr);
+            kevent(poll_fd_, &change, 1, nullptr, 0, nullptr);
+#endif
+            if (poll_fd_ == -1) throw std::runtime_error("Error: failed to create the reaper poller");
+            std::thread([this] { reap_loop_(); }).detach();
+        }
+        
+        void reap_loop_()
+        {
+            for (;;)
+            {
+                std::vector<int> exited;
+                bool woken = false;
+#if defined(__linux__)
+                epoll_event events[64];
+                const int count = epoll_wait(poll_fd_, events, 64, -1);
+                for (int i = 0; i < count; i++) {
+                    if (events[i].data.fd == wake_pipe_[0]) woken = true;
+                    else exited.push_back(events[i].data.fd);
+                }
+#else
+                struct kevent events[64];
+                const int count = kevent(poll_fd_, nullptr, 0, events, 64, nullptr);
+                for (int i = 0; i < count; i++) {
+                    if (events[i].filter == EVFILT_PROC) exited.push_back(static_cast<int>(events[i].ident));
+                    else woken = true;
+                }
+#endif
+                if (count == -1 && errno != EINTR) return;
+                
+                std::lock_guard<std::mutex> lock(mutex_);
+#if defined(__linux__)
+                for (int pidfd : exited) reap_(pid_of_pidfd_(pidfd));
+#else
+                for (int pid : exited) reap_(static_cast<pid_t>(pid));
+#endif
+                if (!woken) continue;
+                
+                char drain[64];
+                while (read(wake_pipe_[0], drain, sizeof(drain)) > 0) {}
+                // a new child, which might have exited before we watched it, or a SIGCHLD: look at all of them.
+                std::vector<pid_t> pids;
+                for (const auto &[pid, child] : children_) pids.push_back(pid);
+                for (pid_t pid : pids) reap_(pid);
+            }
+        }
+        
+        // under mutex_
+        pid_t pid_of_pidfd_(int pidfd) const
+        {
+            for (const auto &[pid, child] : children_)
+                if (child.pidfd == pidfd) return pid;
+            return 0;
+        }
+        
+        // under mutex_: reap pid if it exited, exactly this pid and never anyone else.
+        void reap_(pid_t pid)
+        {
+            auto it = children_.find(pid);
+            if (it == children_.end()) return;
+            
+            int status = 0;
+            pid_t r;
+            do {
+                r = waitpid(pid, &status, WNOHANG);
+            } while (r == -1 && errno == EINTR);
+            if (r == 0) return; // still running.
+            
+            // r == -1: someone else reaped it behind our back (ECHILD), it's gone either way.
+            Child child = std::move(it->second);
+            children_.erase(it);
+#if defined(__linux__)
+            if (child.pidfd != -1) close(child.pidfd);
+#endif
+            child.state->status = status;
+            child.state->alive.store(false, std::memory_order_release);
+            child.state->alive.notify_all();
+            reaped_cv_.notify_all();
+        }
+        
+        void wake_()
+        {
+            const char byte = 0;
+            // a full pipe is fine: a wakeup is already pending.
+            (void)!write(wake_fd_, &byte, 1);
+        }
+        
+        // The handler only wakes the reaper, then passes the signal on to the handler that was there before
+        // us, if the application had one. That handler still sees the SIGCHLDs of our children, and if it
+        // reaps with waitpid(-1) it steals them from us: reap_() then gets ECHILD and takes the child as gone,
+        // with a status of 0. An application that reaps its own children should use waitpid() on their pids.
+        void install_sigchld_handler_()
+        {
+            if (sigchld_installed_) return;
+            sigchld_installed_ = true;
+            
+            struct sigaction action {};
+            action.sa_sigaction = [](int sig, siginfo_t *info, void *context) {
+                const int saved_errno = errno;
+                const char byte = 0;
+                (void)!write(wake_fd_, &byte, 1);
+                errno = saved_errno;
+                
+                const struct sigaction &previous = previous_sigchld_;
+                if (previous.sa_flags & SA_SIGINFO) previous.sa_sigaction(sig, info, context);
+                else if (previous.sa_handler != SIG_DFL && previous.sa_handler != SIG_IGN) previous.sa_handler(sig);
+            };
+            sigemptyset(&action.sa_mask);
+            action.sa_flags = SA_RESTART | SA_SIGINFO | SA_NOCLDSTOP;
+            
+            sigaction(SIGCHLD, nullptr, &previous_sigchld_);
+            const bool chained = (previous_sigchld_.sa_flags & SA_SIGINFO)
+                || (previous_sigchld_.sa_handler != SIG_DFL && previous_sigchld_.sa_handler != SIG_IGN);
+            // a handler that wants to hear about stopped children still does.
+            if (chained && !(previous_sigchld_.sa_flags & SA_NOCLDSTOP)) action.sa_flags &= ~SA_NOCLDSTOP;
+            sigaction(SIGCHLD, &action, nullptr);
+        }
+        
+        std::mutex mutex_;
+        std::condition_variable reaped_cv_;
+        std::unordered_map<pid_t, Child> children_;
+        int poll_fd_ = -1;
+        int wake_pipe_[2] = { -1, -1 };
+        // for the signal handler, which can't get to the instance.
+        static inline int wake_fd_ = -1;
+        // the SIGCHLD handler we replaced, called after ours.
+        static inline struct sigaction previous_sigchld_ {};
+        bool sigchld_installed_ = false;
+    };
+#endif
+    
+    class ProcessReactor;
+    class Pipeline;
+    class ReadLineAwaiter;
+    class ReadUntilAwaiter;
+    class SendAwaiter;
+    
+    /*
+     A child process and the pipes to talk to it. Everything above the pipes is the same on every platform:
+     the line framing, the matching, the write queue and its backpressure, the shutdown sequence. Only the
+     few primitives at the bottom (spawning, filling a buffer, writing, waiting, signalling) are per OS.
+     
+     Metrics is the policy behind metrics(), see NoMetrics. Process is BasicProcess<NoMetrics>, and it's the only
+     one a ProcessReactor, a Pipeline, a UciEngine or the awaitables take. BasicProcessPool and
+     BasicProcessScheduler take the same parameter, and ResultCache::query() any of them.
+     
+     On Windows the children are started with CreateProcess(), and anonymous pipes can't do overlapped I/O:
+     each direction is a named pipe with a name of its own. Our end is opened with FILE_FLAG_OVERLAPPED, the
+     child's end is a plain synchronous handle it inherits, and PROC_THREAD_ATTRIBUTE_HANDLE_LIST makes sure it
+     inherits nothing else (what close-on-exec does on POSIX). There is at most one ReadFile() and one
+     WriteFile() in flight per pipe, into buffers that don't move until they complete, in an Io block on the
+     heap so that the Process itself can be moved meanwhile. read() waits for them with
+     WaitForMultipleObjects(), a ProcessReactor gets them from a completion port.
+     There's no SIGTERM: the terminate step of a shutdown is a CTRL_BREAK_EVENT to the child's process group,
+     which only reaches console children sharing our console, and otherwise the kill comes after the timeout.
+     Not ported, since they are built on POSIX fds: the shared memory channel, the pseudo-terminal,
+     mirror_output() and the awaitables (and so Pipeline). Asking for them in the options throws.
+     */
+    template <typename Metrics = NoMetrics>
+    class BasicProcess
+    {
+    public:
+        BasicProcess(const std::string &command, const ProcessOptions &options = {})
+            : command_(command), read_buffer_(std::max<size_t>(options.read_chunk_size, 1)),
+              write_queue_limit_(options.write_queue_limit), backpressure_(options.backpressure),
+              max_buffered_output_(options.max_buffered_output), stderr_mode_(options.stderr_mode), pipe_size_(options.pipe_size),
+              shared_memory_size_(options.shared_memory_size), pseudo_terminal_(options.pseudo_terminal),
+              placement_(options.placement)
+        {
+#if defined(_WIN32)
+            if (options.shared_memory_size > 0)
+                throw std::runtime_error("Error: no shared memory channel on Windows");
+            if (options.pseudo_terminal)
+                throw std::runtime_error("Error: no pseudo-terminal on Windows");
+            chunk_size_ = std::max<size_t>(options.read_chunk_size, 1);
+#else
+            // nothing else until start(): a Process that is never started doesn't cost any fds.
+            ignore_sigpipe_();
+#endif
+        }
+        ~BasicProcess() noexcept;
+        // A Process owns its child and its pipes, there can't be two of them: it's move-only.
+        // A move transfers everything (the moved-from object is left without a child, and its destructor
+        // doesn't touch anything), and follows the process in the reactor it's registered with, if any.
+        // Just not while a coroutine is suspended on one of its awaitables, which hold a reference to it.
+        BasicProcess(const BasicProcess & other)              = delete;
+        BasicProcess& operator=(const BasicProcess & other)   = delete;
+        BasicProcess(BasicProcess && other) noexcept;
+        BasicProcess& operator=(BasicProcess && other) noexcept
+        {
+            BasicProcess moved(std::move(other));
+            swap(moved);
+            // our old child, if any, goes with moved.
+            return *this;
+        }
+        
+        void swap(BasicProcess &other) noexcept;
+        
+        std::string get_command() const { return command_; }
+        // the PID of the child, 0 if it's not running.
+        pid_t pid() const { return child_pid_; }
+        // where start() puts the child, see ProcessOptions::placement.
+        const Placement &placement() const { return placement_; }
+        // the argv of the last start(), which restart() reuses.
+        const std::vector<std::string> &arguments() const { return argv_; }
+        
+        // no syscall on POSIX: the reaper thread clears the flag as soon as the child exits.
+        bool is_alive()
+        {
+            if (running_()) return true;
+            
+            // all it means is that we no longer have a child process to talk to.
+            // so reset to the starting state.
+            // (the pipes stay open until the next start()/restart(), which replaces them with fresh ones,
+            // so that whatever the child wrote before dying can still be read)
+            forked_ = false;
+            child_pid_ = 0;
+            return false;
+        }
+        
+        // stop the child: the quit command, then SIGTERM, then SIGKILL, waiting in between as the policy says.
+        // On Windows: the quit command, then CTRL_BREAK_EVENT, then TerminateProcess(), see the class comment.
+        // Whatever the child still writes meanwhile is left in the pipe.
+        ShutdownStep shutdown(const ShutdownPolicy &policy = {})
+        {
+            BasicProcess *self = this;
+            return shutdown_all(std::span<BasicProcess * const>(&self, 1), policy).front();
+        }
+        
+        // same as shutdown(), for many processes at once: every step goes to all the children still running
+        // before waiting for any of them, so the whole fleet takes as long as its slowest child, not the sum.
+        static std::vector<ShutdownStep> shutdown_all(std::span<BasicProcess * const> processes,
+                                                      const ShutdownPolicy &policy = {})
+        {
+            std::vector<ShutdownStep> steps(processes.size(), ShutdownStep::not_running);
+            // the ones that are already gone stay not_running.
+            std::vector<bool> pending(processes.size());
+            for (size_t i = 0; i < processes.size(); i++) pending[i] = processes[i]->running_();
+            
+            // after each step, whoever is gone exited because of it, and the others get the next one.
+            const auto step = [&](ShutdownStep current, std::chrono::milliseconds timeout, auto &&ask) {
+                for (size_t i = 0; i < processes.size(); i++)
+                    if (pending[i]) ask(*processes[i]);
+                wait_for_exit_(processes, pending, timeout);
+                for (size_t i = 0; i < processes.size(); i++) {
+                    if (pending[i] && !processes[i]->running_()) {
+                        steps[i] = current;
+                        pending[i] = false;
+                    }
+                }
+            };
+            
+            if (!policy.quit_command.empty()) {
+                step(ShutdownStep::quit, policy.quit_timeout, [&](BasicProcess &process) {
+                    try {
+                        process.send_command(policy.quit_command);
+                        process.flush();
+                    } catch (const std::runtime_error &) {
+                        // it can't read anymore: on to the signals.
+                    }
+                });
+            }
+            step(ShutdownStep::terminate, policy.terminate_timeout, [](BasicProcess &process) {
+                process.signal_(ShutdownStep::terminate);
+            });
+            step(ShutdownStep::kill, std::chrono::milliseconds::max(), [](BasicProcess &process) {
+                process.signal_(ShutdownStep::kill);
+            });
+            return steps;
+        }
+        
+#if defined(_WIN32)
+        // the exit code of the child once it exited, nullopt while it runs.
+        std::optional<int> exit_status() const
+        {
+            DWORD code;
+            if (!process_ || running_() || !GetExitCodeProcess(process_, &code)) return std::nullopt;
+            return static_cast<int>(code);
+        }
+#else
+        // the waitpid() status of the child once it exited (see WIFEXITED and co.), nullopt while it runs.
+        std::optional<int> exit_status() const
+        {
+            if (!child_state_ || child_state_->alive.load(std::memory_order_acquire)) return std::nullopt;
+            return child_state_->status;
+        }
+#endif
+        
+        // On Windows argv[0] is the path of the executable (with its extension, there is no search in the PATH),
+        // and the whole argv is quoted into the command line the way CommandLineToArgvW() splits it back.
+        pid_t start(const char * const argv[])
+        {
+            return start_(argv);
+        }
+        
+        // kill the child if it's still running, and start it again with the arguments of the last start(),
+        // into fresh pipes: whatever was left in the buffers and the write queue of the old child is dropped.
+        // This is the crash recovery path, so it's a SIGKILL, see the overload below to ask nicely first.
+        pid_t restart()
+        {
+            if (argv_ptrs_.empty()) throw std::runtime_error("Error: the process was never started");
+            kill_();
+            return start(argv_ptrs_.data());
+        }
+        
+        pid_t restart(const ShutdownPolicy &policy)
+        {
+            if (argv_ptrs_.empty()) throw std::runtime_error("Error: the process was never started");
+            shutdown(policy);
+            return start(argv_ptrs_.data());
+        }
+        
+        // read the process output and put it back into a provided vector of strings.
+        // If the expected string is specified, the function will scan the output
+        // for the requested string, returning true if it finds it, or false if it times out.
+        // if left empty, the function will return true on timeout.
+        // By default the timeout restarts whenever some output arrives, see TimeoutMode for a hard deadline,
+        // and last_read_status() to tell which way the read ended.
+        bool read(std::vector<std::string> &out_lines,
+                  std::string_view expected = {}, int timeout_ms = 0, TimeoutMode mode = TimeoutMode::idle)
+        {
+            return read_expected_(out_lines, expected, timeout_ms, mode);
+        }
+        
+        // same as above, but nothing is copied: the views point straight into the internal
+        // read buffer, and they stay valid only until the next call to read().
+        bool read(std::vector<std::string_view> &out_lines,
+                  std::string_view expected = {}, int timeout_ms = 0, TimeoutMode mode = TimeoutMode::idle)
+        {
+            return read_expected_(out_lines, expected, timeout_ms, mode);
+        }
+        
+        // same as above, with the lines allocated from the vector's memory resource,
+        // e.g. a std::pmr::monotonic_buffer_resource per request, released at once when the reply is handled.
+        bool read(std::pmr::vector<std::pmr::string> &out_lines,
+                  std::string_view expected = {}, int timeout_ms = 0, TimeoutMode mode = TimeoutMode::idle)
+        {
+            return read_expected_(out_lines, expected, timeout_ms, mode);
+        }
+        
+        // read until a line starts with any of the terminators, checked as the lines are framed.
+        // Returns the index of the one that matched, PrefixMatcher::npos on timeout or end of output.
+        template <size_t N>
+        size_t read(std::vector<std::string> &out_lines, const PrefixMatcher<N> &terminators,
+                    int timeout_ms = 0, TimeoutMode mode = TimeoutMode::idle)
+        {
+            return read_matching_(out_lines, terminators, timeout_ms, mode);
+        }
+        
+        template <size_t N>
+        size_t read(std::vector<std::string_view> &out_lines, const PrefixMatcher<N> &terminators,
+                    int timeout_ms = 0, TimeoutMode mode = TimeoutMode::idle)
+        {
+            return read_matching_(out_lines, terminators, timeout_ms, mode);
+        }
+        
+        template <size_t N>
+        size_t read(std::pmr::vector<std::pmr::string> &out_lines, const PrefixMatcher<N> &terminators,
+                    int timeout_ms = 0, TimeoutMode mode = TimeoutMode::idle)
+        {
+            return read_matching_(out_lines, terminators, timeout_ms, mode);
+        }
+        
+        // stream the process output instead of collecting it: on_line is called with every line as soon as
+        // it's framed (the view is only valid during the call), and it can return true to stop reading.
+        // Memory stays bounded by the chunk size plus the longest line, however much the child writes.
+        // Returns true if on_line stopped the read, false if we timed out or the child closed its output.
+        template <typename F>
+        bool read_each(F &&on_line, int timeout_ms = 0, TimeoutMode mode = TimeoutMode::idle)
+        {
+            read_buffer_.discard_consumed();
+            return read_loop_<false>([this, &on_line](size_t offset, size_t length) {
+                const std::string_view line = read_buffer_.view(offset, length);
+                if constexpr (std::is_void_v<std::invoke_result_t<F &, std::string_view>>) {
+                    on_line(line);
+                    return false;
+                } else {
+                    return static_cast<bool>(on_line(line));
+                }
+            }, timeout_ms, mode) == ReadStatus::matched;
+        }
+        
+        // how the last read()/read_each() ended, e.g. to tell a deadline from the child going quiet.
+        ReadStatus last_read_status() const { return last_read_status_; }
+        
+        // send a single line to the process, a '\n' is appended if it's missing.
+        bool send_command(std::string_view input)
+        {
+            return send_commands(std::span<const std::string_view>(&input, 1));
+        }
+        
+        // send a single line made of several parts, e.g. { "position startpos moves ", moves }, instead of
+        // concatenating them into a new string first: they're gathered by the same writev().
+        bool send_line(std::span<const std::string_view> parts)
+        {
+            static const char newline = '\n';
+            
+            write_iov_.clear();
+            for (const std::string_view part : parts)
+                if (!part.empty()) write_iov_.push_back({ const_cast<char *>(part.data()), part.size() });
+            if (write_iov_.empty() || static_cast<const char *>(write_iov_.back().iov_base)[write_iov_.back().iov_len - 1] != '\n')
+                write_iov_.push_back({ const_cast<char *>(&newline), 1 });
+            return send_iov_();
+        }
+        
+        // send a batch of lines with a single writev(), each one terminated with a '\n' if it's missing.
+        // Nothing is copied: the iovecs point straight into the caller's strings.
+        // We don't ask waitpid() whether the child is still there before writing: if it died the read end
+        // of the pipe is closed and the write fails with EPIPE instead, which is when we find out.
+        //
+        // The pipes are non-blocking: whatever the pipe doesn't take right away goes to a bounded write
+        // queue, which is flushed opportunistically by read()/read_each(), by the reactor, or by flush().
+        // When the batch doesn't fit in the queue, see set_write_queue(): with Backpressure::block we wait,
+        // reading the child's output into the read buffer meanwhile, so that a child stuck writing to us
+        // can never deadlock against us stuck writing to it (that may invalidate the views of the last read()).
+        // With Backpressure::fail nothing is sent and we return false.
+        bool send_commands(std::span<const std::string_view> inputs)
+        {
+            write_iov_.clear();
+            for (const std::string_view input : inputs) append_line_iov_(input);
+            
+            return send_iov_();
+        }
+        
+        // with StderrMode::capture, called with every line the child writes to its standard error.
+        // The lines are framed separately from the output, in their own buffer, and dropped if no callback is set.
+        // They are drained by read()/read_each(), by the reactor, and by drain_stderr().
+        void set_stderr_callback(std::function<void(std::string_view)> on_line)
+        {
+            on_stderr_line_ = std::move(on_line);
+        }
+        
+        // read whatever is waiting on the standard error without blocking, and hand it to the callback.
+        void drain_stderr()
+        {
+            if (stderr_mode_ != StderrMode::capture || err_eof_) return;
+            
+            size_t offset, length;
+            for (;;)
+            {
+                while (err_buffer_.next_line(offset, length))
+                    if (length != 0 && on_stderr_line_) on_stderr_line_(err_buffer_.view(offset, length));
+                err_buffer_.discard_consumed();
+                
+                const ssize_t bytes_read = fill_stderr_();
+                if (bytes_read == 0) {
+                    if (err_buffer_.take_partial(offset, length) && on_stderr_line_)
+                        on_stderr_line_(err_buffer_.view(offset, length));
+                    err_eof_ = true;
+                    return;
+                }
+                if (bytes_read == -1) return; // nothing now, or an error we don't want to fail a read for.
+            }
+        }
+        
+        // counters of the actual syscalls done on the pipes, see IoStats.
+        const IoStats &io_stats() const { return io_stats_; }
+        
+        // everything we counted so far: io_stats(), and with RecordingMetrics the polls, the lines
+        // framed and the command latencies too (otherwise those stay at 0), see ProcessMetrics.
+        ProcessMetrics metrics() const
+        {
+            ProcessMetrics snapshot;
+            snapshot.io = io_stats_;
+            metrics_.snapshot(snapshot);
+            return snapshot;
+        }
+        
+        // how many bytes can wait in the write queue, and what to do when a send doesn't fit in it.
+        void set_write_queue(size_t max_bytes, Backpressure policy = Backpressure::block)
+        {
+            write_queue_limit_ = max_bytes;
+            backpressure_ = policy;
+        }
+        
+        // bytes sent, but still waiting in the write queue for the child to make room in the pipe.
+        size_t queued_bytes() const
+        {
+            size_t bytes = write_queue_.size() - write_queue_head_;
+#if defined(_WIN32)
+            // and what the WriteFile() in flight hasn't written yet.
+            if (io_ && io_->input.pending) bytes += io_->input.buffer.size();
+#endif
+            return bytes;
+        }
+        
+        // send what is still queued, and close our end of the child's input: it reads EOF, which is how
+        // filters (sort, pgn-extract...) know they've got everything. Nothing can be sent anymore until restart().
+        // If the child doesn't take the queue within timeout_ms (-1 to wait for as long as it takes), the rest
+        // is dropped, the input closed all the same, and we return false. With set_nonblocking(false) a write
+        // that the pipe doesn't take blocks on its own, and the timeout can't cut it short.
+        bool close_input(int timeout_ms = -1)
+        {
+            if (!input_open_()) return true;
+            const auto deadline = timeout_ms < 0 ? std::chrono::steady_clock::time_point::max()
+                                                 : std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout_ms);
+            bool flushed = true;
+            while (!flush()) {
+                if (std::chrono::steady_clock::now() >= deadline) {
+                    flushed = false;
+                    write_queue_.clear();
+                    write_queue_head_ = 0;
+                    break;
+                }
+                wait_writable_(deadline);
+            }
+            close_input_channel_();
+            return flushed;
+        }
+        
+        // push as much of the write queue into the pipe as it takes, without blocking.
+        // true once the queue is empty.
+        bool flush()
+        {
+#if defined(_WIN32)
+            // collect the WriteFile() in flight if it completed, and start the next one.
+            if (!io_) return true;
+            for (;;)
+            {
+                if (!finish_write_(!nonblocking_)) return false;
+                if (write_queue_head_ == write_queue_.size()) break;
+                io_->input.buffer.assign(write_queue_.begin() + static_cast<std::ptrdiff_t>(write_queue_head_), write_queue_.end());
+                write_queue_.clear();
+                write_queue_head_ = 0;
+                start_write_();
+            }
+#else
+            while (queued_bytes() > 0)
+            {
+                const ssize_t written = ::write(out_pipe_[1], write_queue_.data() + write_queue_head_, queued_bytes());
+                io_stats_.write_calls++;
+                if (written == -1)
+                {
+                    if (errno == EINTR) continue;
+                    if (errno == EAGAIN || errno == EWOULDBLOCK) return false;
+                    if (errno == EPIPE)
+                        throw std::runtime_error("Error: the process is not running");
+                    throw std::runtime_error("Error: could not send command to the process");
+                }
+                io_stats_.bytes_written += static_cast<uint64_t>(written);
+                write_queue_head_ += written;
+            }
+#endif
+            write_queue_.clear();
+            write_queue_head_ = 0;
+            return true;
+        }
+        
+        /*
+         Pipelined round-trips: write all the commands back to back (a single writev, like send_commands),
+         then route the reply lines to the requests in FIFO order. on_reply(index, line) gets every line
+         from the moment request `index` becomes the oldest pending one, up to and including the line that
+         starts with its terminator. Requests with an empty terminator don't expect any reply.
+         The child answers the commands in order anyway, so instead of paying one full round-trip per
+         command we pay one for the whole batch.
+         Returns how many requests got their full reply before the timeout (or EOF), 0 if the batch
+         didn't fit in the write queue with Backpressure::fail.
+         */
+        template <typename F>
+        size_t pipeline(std::span<const PipelinedRequest> requests, F &&on_reply,
+                        int timeout_ms = 0, TimeoutMode mode = TimeoutMode::idle)
+        {
+            write_iov_.clear();
+            for (const PipelinedRequest &request : requests) append_line_iov_(request.command);
+            if (!send_iov_()) return 0;
+            
+            size_t current = 0;
+            const auto skip_silent = [&] {
+                while (current < requests.size() && requests[current].terminator.empty()) current++;
+            };
+            skip_silent();
+            if (current == requests.size()) return current;
+            
+            read_each([&](std::string_view line) {
+                on_reply(current, line);
+                if (line.starts_with(requests[current].terminator)) {
+                    current++;
+                    skip_silent();
+                }
+                return current == requests.size();
+            }, timeout_ms, mode);
+            return current;
+        }
+        
+        // our ends of the pipes are made non-blocking by start(), which is what the write queue and the
+        // ProcessReactor need. With false a send waits until the pipe took everything, as the original
+        // implementation did, and read() leaves the write queue alone: for one thread writing while another
+        // one reads, as UciEngine does.
+        void set_nonblocking(bool enabled = true)
+        {
+#if !defined(_WIN32)
+            for (int fd : { in_pipe_[0], out_pipe_[1] })
+            {
+                if (fd == -1) continue; // not connected to us, see Pipeline.
+                const int flags = fcntl(fd, F_GETFL);
+                if (flags == -1 || fcntl(fd, F_SETFL, enabled ? flags | O_NONBLOCK : flags & ~O_NONBLOCK) == -1)
+                    throw std::runtime_error("Error: fcntl() failed on the process pipe");
+            }
+#endif
+            nonblocking_ = enabled;
+        }
+        
+        // read everything that is available right now and call on_line for every complete line
+        // (empty lines are skipped, like in read()). The views are only valid during the callback.
+        // on_line can return true to stop there: the Process isn't touched anymore after that, so the
+        // callback may as well have destroyed it. Needs a non-blocking pipe, see set_nonblocking().
+        // Returns false once the child closed its end of the pipe, after handing out whatever
+        // unterminated line was left.
+        template <typename F>
+        bool drain(F &&on_line)
+        {
+            const auto hand_out = [&on_line](std::string_view line) {
+                if constexpr (std::is_void_v<std::invoke_result_t<F &, std::string_view>>) {
+                    on_line(line);
+                    return false;
+                } else {
+                    return static_cast<bool>(on_line(line));
+                }
+            };
+            size_t offset, length;
+            for (;;)
+            {
+                while (read_buffer_.next_line(offset, length)) {
+                    if (length == 0) continue;
+                    metrics_.on_line();
+                    if (hand_out(read_buffer_.view(offset, length))) return true;
+                }
+                // the lines are gone, so we can reuse their space.
+                read_buffer_.discard_consumed();
+                
+                const ssize_t bytes_read = fill_();
+                if (bytes_read == 0) {
+                    // if it stops on that last piece, the next drain() tells about the EOF.
+                    if (read_buffer_.take_partial(offset, length) && hand_out(read_buffer_.view(offset, length)))
+                        return true;
+                    return false;
+                }
+                if (bytes_read == -1) return true;
+            }
+        }
+        
+#if !defined(_WIN32)
+        // the shared memory set up with ProcessOptions::shared_memory_size, nullptr if there is none
+        // (or before start(): each child gets a new one).
+        // The child finds its side with SharedChannel::from_environment().
+        SharedChannel *shared_channel() { return shared_channel_.get(); }
+        
+        // publish a payload written in place, in a span from shared_channel()->reserve(),
+        // and ring the doorbell: "<command> <offset> <length>" goes through the pipe like any other line.
+        bool send_bulk(std::string_view command, std::span<const std::byte> reserved)
+        {
+            if (!shared_channel_) throw std::runtime_error("Error: the process has no shared memory channel");
+            const size_t offset = shared_channel_->commit(reserved);
+            
+            char doorbell[48];
+            const size_t doorbell_size = SharedChannel::format_doorbell(doorbell, offset, reserved.size());
+            write_iov_.clear();
+            if (!command.empty()) write_iov_.push_back({ const_cast<char *>(command.data()), command.size() });
+            write_iov_.push_back({ doorbell, doorbell_size });
+            return send_iov_();
+        }
+        
+        // same as above for a payload that isn't in the shared memory yet: one copy, straight into it.
+        // Returns false if the child hasn't released enough room yet.
+        bool copy_bulk(std::string_view command, std::span<const std::byte> payload)
+        {
+            if (!shared_channel_) throw std::runtime_error("Error: the process has no shared memory channel");
+            const std::span<std::byte> reserved = shared_channel_->reserve(payload.size());
+            if (reserved.empty()) return false;
+            std::memcpy(reserved.data(), payload.data(), payload.size());
+            return send_bulk(command, reserved);
+        }
+        
+        // the read end of the pipe connected to the child's standard error, -1 unless StderrMode::capture.
+        int stderr_fd() const { return stderr_mode_ == StderrMode::capture && !err_eof_ ? err_pipe_[0] : -1; }
+        
+        // the read end of the pipe connected to the child's standard output.
+        int read_fd() const { return in_pipe_[0]; }
+        
+        // the write end of the pipe connected to the child's standard input.
+        int write_fd() const { return out_pipe_[1]; }
+        
+        /*
+         Awaitable versions of read/send_command, for processes attached to a ProcessReactor with attach().
+         The coroutine is suspended until the reactor sees the pipe ready, so that one thread running
+         the reactor can interleave the conversations with many children.
+         The returned lines are views into the read buffer, valid until the next read on this process.
+         */
+        // the next non empty line, or nullopt once the child closed its output.
+        ReadLineAwaiter read_line() requires std::is_same_v<Metrics, NoMetrics>;
+        // skip lines until one starts with prefix (same matching as read()), nullopt on timeout or EOF.
+        ReadUntilAwaiter read_until(std::string_view prefix, int timeout_ms = 0) requires std::is_same_v<Metrics, NoMetrics>;
+        // write one line, a '\n' is appended if it's missing. command must outlive the co_await.
+        SendAwaiter send(std::string_view command) requires std::is_same_v<Metrics, NoMetrics>;
+        
+        /*
+         Copy everything the child writes to its standard output to log_fd as well (a file, a socket,
+         our own stdout...), without taking anything away from read().
+         
+         On Linux the data never goes through user space: before each read we tee(2) the bytes waiting
+         in the pipe into a private pipe, and splice(2) them from there into log_fd. Only then we read
+         exactly the bytes that were duplicated, so every byte is mirrored once and in order.
+         If log_fd doesn't support splice, and on the other platforms, every chunk is written to log_fd
+         from the read buffer right after it's read instead.
+         The caller keeps ownership of log_fd.
+         */
+        void mirror_output(int log_fd)
+        {
+            stop_mirror();
+#if defined(__linux__)
+            if (pipe2(mirror_pipe_, O_CLOEXEC) == -1)
+                mirror_pipe_[0] = mirror_pipe_[1] = -1; // we'll go through user space then.
+#endif
+            mirror_fd_ = log_fd;
+        }
+        
+        void stop_mirror()
+        {
+            close_mirror_pipe_();
+            mirror_fd_ = -1;
+        }
+#endif
+        
+    public:
+        std::string command_;
+    private:
+        friend class ProcessReactor;
+        friend class Pipeline;
+        friend class ReadLineAwaiter;
+        friend class ReadUntilAwaiter;
+        friend class SendAwaiter;
+        
+        template <typename Lines>
+        bool read_expected_(Lines &out_lines, std::string_view expected, int timeout_ms, TimeoutMode mode)
+        {
+            const ReadStatus status = read_lines_(out_lines, [expected](std::string_view line) {
+                // check if the current line starts with the expected string. If it does, stop here.
+                return !expected.empty() && line.starts_with(expected);
+            }, timeout_ms, mode);
+            
+            if (status == ReadStatus::matched) return true;
+            if (status == ReadStatus::eof) return false;
+            // If we were looking for something specific we didn't find it.
+            // otherwise we read everything there was and we timedout successfully.
+            return expected.empty() ? true : false;
+        }
+        
+        template <typename Lines, size_t N>
+        size_t read_matching_(Lines &out_lines, const PrefixMatcher<N> &terminators,
+                              int timeout_ms, TimeoutMode mode)
+        {
+            size_t matched = PrefixMatcher<N>::npos;
+            read_lines_(out_lines, [&terminators, &matched](std::string_view line) {
+                matched = terminators.match(line);
+                return matched != PrefixMatcher<N>::npos;
+            }, timeout_ms, mode);
+            return matched;
+        }
+        
+        // fill out_lines with the lines framed from the child's output, until stop(line) returns true.
+        template <typename Lines, typename F>
+        ReadStatus read_lines_(Lines &out_lines, F &&stop, int timeout_ms, TimeoutMode mode)
+        {
+            line_spans_.clear();
+            // the views handed out by the previous read are now dead, make room at the back.
+            read_buffer_.discard_consumed();
+            
+            const ReadStatus status = read_loop_<true>([this, &stop](size_t offset, size_t length) {
+                line_spans_.emplace_back(offset, length);
+                // every line is kept until the read ends. A child that floods us without ever writing the
+                // expected line would have us keep all of it, and its spans too.
+                if (read_buffer_.size() + line_spans_.size() * sizeof(line_spans_[0]) > max_buffered_output_)
+                    throw std::runtime_error("Error: the process writes more output than we can buffer before the end of the read");
+                return static_cast<bool>(stop(read_buffer_.view(offset, length)));
+            }, timeout_ms, mode);
+            // only now that the buffer won't move anymore we can turn the spans into lines.
+            if constexpr (std::is_same_v<typename Lines::value_type, std::string_view>) {
+                out_lines.clear();
+                for (const auto &[offset, length] : line_spans_)
+                    out_lines.emplace_back(read_buffer_.view(offset, length));
+            } else {
+                // the strings of the last read are assigned over instead of being freed and allocated again:
+                // once they have grown to the usual line lengths a round-trip doesn't allocate anymore.
+                // A shorter read parks the surplus in spare_lines_ rather than letting resize() free them.
+                // Not for pmr strings: they belong to the caller's arena, which may be gone by the next read
+                // (and with a monotonic one, which is the point of pmr here, freeing them costs nothing anyway).
+                const size_t count = line_spans_.size();
+                if constexpr (std::is_same_v<Lines, std::vector<std::string>>) {
+                    for (; out_lines.size() > count; out_lines.pop_back()) spare_lines_.push_back(std::move(out_lines.back()));
+                    for (; out_lines.size() < count && !spare_lines_.empty(); spare_lines_.pop_back())
+                        out_lines.push_back(std::move(spare_lines_.back()));
+                }
+                out_lines.resize(count);
+                for (size_t i = 0; i < count; i++)
+                    out_lines[i].assign(read_buffer_.view(line_spans_[i].first, line_spans_[i].second));
+            }
+            return status;
+        }
+        
+        /*
+         The loop behind read() and read_each(): poll, read a chunk, frame it and call on_span(offset, length)
+         for every non empty line, until on_span returns true, we time out or the child closes its output.
+         In TimeoutMode::deadline, every poll only waits for what is left of the budget, EINTR retries included,
+         and the framing checks it after every line: a chunk holds thousands of them, and on_span may be slow.
+         When Retain is set every line stays in the buffer until the next call (read() hands them out as
+         views at the end), up to max_buffered_output, otherwise the lines are dropped as soon as they were
+         seen, and the buffer only ever holds one chunk plus the current partial line.
+         */
+        template <bool Retain, typename F>
+        ReadStatus read_loop_(F &&on_span, int timeout_ms, TimeoutMode mode)
+        {
+            last_read_status_ = read_loop_impl_<Retain>(on_span, timeout_ms, mode);
+            if (last_read_status_ == ReadStatus::matched) metrics_.on_reply();
+            return last_read_status_;
+        }
+        
+        template <bool Retain, typename F>
+        ReadStatus read_loop_impl_(F &on_span, int timeout_ms, TimeoutMode mode)
+        {
+            using clock = std::chrono::steady_clock;
+            
+            if (timeout_ms <= 0) timeout_ms = MAX_TIMEOUT_MS;
+            const auto deadline = clock::now() + std::chrono::milliseconds(timeout_ms);
+            // TimeoutMode::idle: only output counts as activity, not a wake up for the write end or the standard error.
+            auto idle_deadline = deadline;
+            const ReadStatus timed_out = mode == TimeoutMode::deadline ? ReadStatus::deadline_expired
+                                                                       : ReadStatus::idle_timeout;
+            size_t offset, length;
+            for(;;)
+            {
+                // first hand out what is already buffered, there might be some leftovers from
+                // the previous read if it stopped at the expected line.
+                while (read_buffer_.next_line(offset, length))
+                {
+                    if (length == 0) continue;
+                    metrics_.on_line();
+                    if (on_span(offset, length)) return ReadStatus::matched;
+                    if (mode == TimeoutMode::deadline && clock::now() >= deadline) return timed_out;
+                }
+                if constexpr (!Retain) read_buffer_.discard_consumed();
+                
+                // reached EOF (pipe was closed)
+                if (read_eof_) {
+                    if (read_buffer_.take_partial(offset, length) && on_span(offset, length))
+                        return ReadStatus::matched;
+                    return ReadStatus::eof;
+                }
+                
+                // check that we have something to read. The write end only counts while there is something
+                // in the write queue, and only when it's ours to flush, see set_nonblocking().
+                // A child that keeps writing would never let the wait time out, the deadline is ours.
+                Ready ready;
+                const bool writing = nonblocking_ && queued_bytes() > 0;
+                if (!wait_(mode == TimeoutMode::deadline ? deadline : idle_deadline, writing, ready)) {
+                    // we timedout
+                    metrics_.on_poll(false);
+                    if (read_buffer_.take_partial(offset, length) && on_span(offset, length))
+                        return ReadStatus::matched;
+                    return timed_out;
+                }
+                
+                if (ready.input) flush_queue_quietly_();
+                if (ready.error) drain_stderr();
+                if (!ready.output) metrics_.on_poll(false);
+                else
+                {
+                    const ssize_t bytes_read = fill_();
+                    metrics_.on_poll(bytes_read != -1);
+                    if (bytes_read == 0) read_eof_ = true;
+                    if (bytes_read > 0) idle_deadline = clock::now() + std::chrono::milliseconds(timeout_ms);
+                    // the same bound for a line that never ends.
+                    if (read_buffer_.size() > max_buffered_output_)
+                        throw std::runtime_error("Error: the process writes more output than we can buffer before the end of the read");
+                }
+            }
+        }
+        
+        // add input to write_iov_, with a '\n' if it doesn't end with one.
+        void append_line_iov_(std::string_view input)
+        {
+            static const char newline = '\n';
+            
+            if (!input.empty())
+                write_iov_.push_back({ const_cast<char *>(input.data()), input.size() });
+            if (input.empty() || input.back() != '\n')
+                write_iov_.push_back({ const_cast<char *>(&newline), 1 });
+        }
+        
+        // send what's in write_iov_, queueing what the pipe doesn't take, see send_commands().
+        bool send_iov_()
+        {
+            if (!input_open_()) throw std::runtime_error("Error: the input of the process is not connected to us");
+            iovec *iov = write_iov_.data();
+            size_t count = write_iov_.size();
+            size_t total = 0;
+            for (size_t i = 0; i < count; i++) total += iov[i].iov_len;
+            
+            if (backpressure_ == Backpressure::fail)
+            {   // all or nothing: only start if the whole batch would fit in the queue, even if the pipe took none of it.
+                flush();
+                if (queued_bytes() + total > write_queue_limit_) return false;
+            }
+            
+            // the queue goes out first, or the lines would get out of order.
+            // The request only starts (and its latency with it) once the lines are written or queued.
+            while (!flush())
+            {
+                if (queued_bytes() + total <= write_queue_limit_) {
+                    enqueue_(iov, count);
+                    metrics_.on_send();
+                    return true;
+                }
+                wait_writable_();
+            }
+            // now what the pipe takes right away, and the rest waits in the queue, if it fits.
+            while (!write_some_(iov, count))
+            {
+                size_t left = 0;
+                for (size_t i = 0; i < count; i++) left += iov[i].iov_len;
+                if (left <= write_queue_limit_) {
+                    enqueue_(iov, count);
+                    break;
+                }
+                wait_writable_();
+            }
+            metrics_.on_send();
+            return true;
+        }
+        
+        
+        void enqueue_(const iovec *iov, size_t count)
+        {
+            if (write_queue_head_ > 0 && write_queue_head_ == write_queue_.size()) {
+                write_queue_.clear();
+                write_queue_head_ = 0;
+            }
+            for (size_t i = 0; i < count; i++) {
+                const char *data = static_cast<const char *>(iov[i].iov_base);
+                write_queue_.insert(write_queue_.end(), data, data + iov[i].iov_len);
+            }
+        }
+        
+        // block until the write end has some room, reading the child's output meanwhile:
+        // the child might be stuck writing to us, and it won't read its input until we read its output.
+        // (With set_nonblocking(false) the writes themselves wait, and we never get here.)
+        void wait_writable_(std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::time_point::max())
+        {
+            Ready ready;
+            if (!wait_(deadline, true, ready)) return;
+            metrics_.on_poll(ready.output);
+            if (ready.error) drain_stderr();
+            // keep it in the buffer for the next read, up to a point.
+            if (ready.output && fill_() == 0) read_eof_ = true;
+            if (read_buffer_.unconsumed() > max_buffered_output_)
+                throw std::runtime_error("Error: the process writes more output than we can buffer while it doesn't read its input");
+        }
+        
+        // flush() for the read paths: if the child died, the read will find out on its own.
+        void flush_queue_quietly_()
+        {
+            try {
+                flush();
+            } catch (const std::runtime_error &) {
+                write_queue_.clear();
+                write_queue_head_ = 0;
+            }
+        }
+        
+        // frame the next line without blocking: 1 if there is one, 0 if we'd have to wait, -1 at EOF.
+        // The view is valid until the next read of any kind on this process.
+        int try_next_line_(std::string_view &line)
+        {
+            size_t offset, length;
+            for (;;)
+            {
+                while (read_buffer_.next_line(offset, length)) {
+                    if (length == 0) continue;
+                    metrics_.on_line();
+                    line = read_buffer_.view(offset, length);
+                    return 1;
+                }
+                read_buffer_.discard_consumed();
+                
+                const ssize_t bytes_read = fill_();
+                if (bytes_read == 0) {
+                    if (!read_buffer_.take_partial(offset, length)) return -1;
+                    line = read_buffer_.view(offset, length);
+                    return 1;
+                }
+                if (bytes_read == -1) return 0;
+            }
+        }
+        
+        // for restart(), argv is only borrowed for the duration of start().
+        void keep_argv_(const char * const argv[])
+        {
+            if (argv == argv_ptrs_.data()) return;
+            argv_.clear();
+            for (const char * const *arg = argv; *arg != nullptr; arg++) argv_.emplace_back(*arg);
+            argv_ptrs_.clear();
+            for (const auto &arg : argv_) argv_ptrs_.push_back(arg.c_str());
+            argv_ptrs_.push_back(nullptr);
+        }
+        
+        /*
+         What the code above needs from the OS, below: filling the read buffers, writing, waiting for the pipes
+         (wait_() with Ready), and the life of the child (start_(), running_(), signal_(), kill_()).
+         fill_() and fill_stderr_() return the number of bytes read, 0 at EOF, and -1 if there's nothing now.
+         */
+        // what wait_() found ready.
+        struct Ready
+        {
+            bool output = false;
+            bool input = false;
+            bool error = false;
+        };
+        
+#if defined(_WIN32)
+        // one direction of the conversation with the child: our end of the pipe, and its operation in flight.
+        struct Channel
+        {
+            HANDLE handle = INVALID_HANDLE_VALUE;
+            HANDLE event = nullptr;
+            OVERLAPPED overlapped {};
+            bool pending = false;
+            // the child closed its end: there's never going to be anything else to read.
+            bool closed = false;
+            // what ReadFile() reads into, or what WriteFile() writes from.
+            std::vector<char> buffer;
+        };
+        
+        struct Io
+        {
+            Channel input;      // the child's standard input, we write.
+            Channel output;     // its standard output, we read.
+            Channel error;      // its standard error, with StderrMode::capture.
+            BasicProcess *owner = nullptr;
+            HANDLE port = nullptr;  // the completion port the handles are associated with, for good.
+        };
+        
+        ssize_t fill_()
+        {
+            if (!io_) return 0;
+            return collect_(io_->output, read_buffer_);
+        }
+        
+        ssize_t fill_stderr_()
+        {
+            if (!io_) return -1;
+            return collect_(io_->error, err_buffer_);
+        }
+        
+        // start a ReadFile() into the channel's buffer, unless there's one in flight already or the pipe is closed.
+        // It always completes through the event (and the completion port once the handle is associated with one),
+        // even when it's done right away.
+        void start_read_(Channel &channel)
+        {
+            if (channel.pending || channel.closed) return;
+            start_io_(channel);
+            if (!ReadFile(channel.handle, channel.buffer.data(), static_cast<DWORD>(channel.buffer.size()),
+                          nullptr, &channel.overlapped)) {
+                const DWORD error = GetLastError();
+                if (error == ERROR_BROKEN_PIPE) {
+                    channel.closed = true;
+                    return;
+                }
+                if (error != ERROR_IO_PENDING) throw std::runtime_error("Error: could not read from the process");
+            }
+            channel.pending = true;
+        }
+        
+        // append what the ReadFile() in flight got to into, without waiting, and start the next one right away,
+        // so that there's always one to wait for. Same return value as fill_().
+        ssize_t collect_(Channel &channel, LineBuffer &into)
+        {
+            for (;;)
+            {
+                start_read_(channel);
+                if (channel.closed) return 0;
+                DWORD bytes = 0;
+                if (!GetOverlappedResult(channel.handle, &channel.overlapped, &bytes, FALSE)) {
+                    const DWORD error = GetLastError();
+                    if (error == ERROR_IO_INCOMPLETE) return -1;
+                    channel.pending = false;
+                    if (error == ERROR_BROKEN_PIPE) {
+                        channel.closed = true;
+                        return 0;
+                    }
+                    // cancelled by settle_(), but the bytes that already arrived are still in the buffer.
+                    if (error != ERROR_OPERATION_ABORTED) throw std::runtime_error("Error: could not read from the process");
+                }
+                channel.pending = false;
+                if (&channel == &io_->output) {
+                    io_stats_.read_calls++;
+                    io_stats_.bytes_read += bytes;
+                }
+                // a read can complete with nothing, that's not the EOF.
+                if (bytes == 0) continue;
+                into.append(channel.buffer.data(), bytes);
+                start_read_(channel);
+                return static_cast<ssize_t>(bytes);
+            }
+        }
+        
+        // cancel the operation in flight on a channel, if any, and wait until the kernel is done with it:
+        // its buffer and OVERLAPPED are then ours again, and the next collect_() picks up its result.
+        void settle_(Channel &channel)
+        {
+            if (!channel.pending) return;
+            CancelIoEx(channel.handle, &channel.overlapped);
+            DWORD bytes;
+            GetOverlappedResult(channel.handle, &channel.overlapped, &bytes, TRUE);
+        }
+        
+        static void start_io_(Channel &channel)
+        {
+            ResetEvent(channel.event);
+            channel.overlapped = {};
+            channel.overlapped.hEvent = channel.event;
+        }
+        
+        // WaitForMultipleObjects() on the events of the operations in flight, instead of poll().
+        bool wait_(std::chrono::steady_clock::time_point deadline, bool writing, Ready &ready)
+        {
+            if (!io_) return false;
+            Channel &output = io_->output;
+            Channel &error = io_->error;
+            const bool capturing = stderr_mode_ == StderrMode::capture && !err_eof_;
+            HANDLE events[3];
+            DWORD count = 0;
+            // a closed pipe has nothing to wait for: the next fill_() finds the EOF right away.
+            if (!read_eof_) {
+                start_read_(output);
+                ready.output = output.closed;
+                events[count++] = output.event;
+            }
+            if (writing) {
+                ready.input = !io_->input.pending;
+                events[count++] = io_->input.event;
+            }
+            if (capturing) {
+                start_read_(error);
+                ready.error = error.closed;
+                events[count++] = error.event;
+            }
+            if (ready.output || ready.input || ready.error) return true;
+            if (count == 0) return false;
+            
+            DWORD wait_ms = INFINITE;
+            if (deadline != std::chrono::steady_clock::time_point::max()) {
+                const auto left = std::chrono::ceil<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now()).count();
+                wait_ms = static_cast<DWORD>(std::max<decltype(left)>(left, 0));
+            }
+            const DWORD result = wait_ms == 0 ? WAIT_TIMEOUT : WaitForMultipleObjects(count, events, FALSE, wait_ms);
+            if (result == WAIT_FAILED)
+            {   Log::write(LogLevel::error, "WaitForMultipleObjects() failed for PID ", child_pid_, ": ", GetLastError());
+                throw std::runtime_error("Error: WaitForMultipleObjects() failed");
+            }
+            if (result == WAIT_TIMEOUT) return false;
+            // all the events may be set, not just the one WaitForMultipleObjects() returned.
+            ready.output = !read_eof_ && WaitForSingleObject(output.event, 0) == WAIT_OBJECT_0;
+            ready.input = writing && WaitForSingleObject(io_->input.event, 0) == WAIT_OBJECT_0;
+            ready.error = capturing && WaitForSingleObject(error.event, 0) == WAIT_OBJECT_0;
+            return true;
+        }
+        
+        // collect the WriteFile() in flight, waiting for it with `wait`: false if it's still in flight.
+        // What the pipe didn't take goes back in front of the queue.
+        bool finish_write_(bool wait)
+        {
+            Channel &input = io_->input;
+            if (!input.pending) return true;
+            DWORD written = 0;
+            if (!GetOverlappedResult(input.handle, &input.overlapped, &written, wait ? TRUE : FALSE)) {
+                const DWORD error = GetLastError();
+                if (error == ERROR_IO_INCOMPLETE) return false;
+                input.pending = false;
+                input.buffer.clear();
+                write_queue_.clear();
+                write_queue_head_ = 0;
+                if (error == ERROR_BROKEN_PIPE || error == ERROR_NO_DATA)
+                    throw std::runtime_error("Error: the process is not running");
+                throw std::runtime_error("Error: could not send command to the process");
+            }
+            input.pending = false;
+            io_stats_.bytes_written += written;
+            if (written < input.buffer.size())
+                write_queue_.insert(write_queue_.begin() + static_cast<std::ptrdiff_t>(write_queue_head_),
+                                    input.buffer.begin() + written, input.buffer.end());
+            input.buffer.clear();
+            return true;
+        }
+        
+        // write the input channel's buffer.
+        void start_write_()
+        {
+            Channel &input = io_->input;
+            start_io_(input);
+            io_stats_.write_calls++;
+            if (!WriteFile(input.handle, input.buffer.data(), static_cast<DWORD>(input.buffer.size()),
+                           nullptr, &input.overlapped)) {
+                const DWORD error = GetLastError();
+                if (error != ERROR_IO_PENDING) {
+                    input.buffer.clear();
+                    if (error == ERROR_BROKEN_PIPE || error == ERROR_NO_DATA)
+                        throw std::runtime_error("Error: the process is not running");
+                    throw std::runtime_error("Error: could not send command to the process");
+                }
+            }
+            input.pending = true;
+        }
+        
+        // there is no writev() for an overlapped pipe: iov is gathered in the buffer of the input channel,
+        // and goes out in a single WriteFile(). Then it's all written as far as iov is concerned (queued_bytes()
+        // counts it until it completes), false if the write before is still in flight.
+        bool write_some_(iovec *&iov, size_t &count)
+        {
+            if (!flush()) return false;
+            if (count == 0) return true;
+            Channel &input = io_->input;
+            input.buffer.clear();
+            for (; count > 0; iov++, count--) {
+                const char *data = static_cast<const char *>(iov->iov_base);
+                input.buffer.insert(input.buffer.end(), data, data + iov->iov_len);
+            }
+            start_write_();
+            // with set_nonblocking(false), the send returns once the child took the lines.
+            if (!nonblocking_) flush();
+            return true;
+        }
+        
+        bool input_open_() const { return io_ && io_->input.handle != INVALID_HANDLE_VALUE; }
+        void close_input_channel_() { close_channel_(io_->input); }
+        
+        bool running_() const { return forked_ && WaitForSingleObject(process_, 0) == WAIT_TIMEOUT; }
+        
+        // the terminate or the kill step of a shutdown.
+        void signal_(ShutdownStep step)
+        {
+            if (step == ShutdownStep::terminate) GenerateConsoleCtrlEvent(CTRL_BREAK_EVENT, child_pid_);
+            else TerminateProcess(process_, 1);
+        }
+        
+        // wait until the pending processes exited, at most timeout.
+        static void wait_for_exit_(std::span<BasicProcess * const> processes, const std::vector<bool> &pending,
+                                   std::chrono::milliseconds timeout)
+        {
+            using clock = std::chrono::steady_clock;
+            const auto deadline = timeout == std::chrono::milliseconds::max() ? clock::time_point::max()
+                                                                              : clock::now() + timeout;
+            for (size_t i = 0; i < processes.size(); i++) {
+                if (!pending[i]) continue;
+                DWORD wait_ms = INFINITE;
+                if (deadline != clock::time_point::max()) {
+                    const auto left = std::chrono::ceil<std::chrono::milliseconds>(deadline - clock::now()).count();
+                    wait_ms = static_cast<DWORD>(std::max<decltype(left)>(left, 0));
+                }
+                WaitForSingleObject(processes[i]->process_, wait_ms);
+            }
+        }
+        
+        void kill_()
+        {
+            if (!process_) return;
+            if (running_()) TerminateProcess(process_, 1);
+            WaitForSingleObject(process_, INFINITE);
+        }
+        
+        pid_t start_(const char * const argv[])
+        {
+            if (forked_ && is_alive()) throw std::runtime_error("Error: the process is already running");
+            if (reactor_) throw std::runtime_error("Error: remove the process from its reactor before starting it");
+            open_pipes_();
+            
+            std::vector<HANDLE> inherited;
+            const auto close_inherited = [&inherited] {
+                for (HANDLE handle : inherited) CloseHandle(handle);
+                inherited.clear();
+            };
+            STARTUPINFOEXA startup {};
+            startup.StartupInfo.cb = sizeof(startup);
+            startup.StartupInfo.dwFlags = STARTF_USESTDHANDLES;
+            try {
+                startup.StartupInfo.hStdInput = open_child_end_(io_->input, false, inherited);
+                startup.StartupInfo.hStdOutput = open_child_end_(io_->output, true, inherited);
+                startup.StartupInfo.hStdError = stderr_handle_(inherited);
+            } catch (...) {
+                close_inherited();
+                close_pipes_();
+                throw;
+            }
+            
+            // exactly these handles go to the child, whatever else of ours happens to be inheritable.
+            SIZE_T list_size = 0;
+            InitializeProcThreadAttributeList(nullptr, 1, 0, &list_size);
+            std::vector<char> list_storage(list_size);
+            auto *attributes = reinterpret_cast<LPPROC_THREAD_ATTRIBUTE_LIST>(list_storage.data());
+            if (!InitializeProcThreadAttributeList(attributes, 1, 0, &list_size) ||
+                !UpdateProcThreadAttribute(attributes, 0, PROC_THREAD_ATTRIBUTE_HANDLE_LIST, inherited.data(),
+                                           inherited.size() * sizeof(HANDLE), nullptr, nullptr)) {
+                close_inherited();
+                close_pipes_();
+                throw std::runtime_error("Error: could not set up the handles of the child");
+            }
+            startup.lpAttributeList = attributes;
+            
+            std::string command_line;
+            for (const char * const *arg = argv; *arg != nullptr; arg++) {
+                if (!command_line.empty()) command_line += ' ';
+                append_argument_(command_line, *arg);
+            }
+            
+            // suspended until its placement is applied. In its own process group the child doesn't receive
+            // our console's ^C, only the CTRL_BREAK_EVENT of shutdown().
+            PROCESS_INFORMATION info {};
+            const BOOL created = CreateProcessA(command_.c_str(), command_line.data(), nullptr, nullptr, TRUE,
+                                                EXTENDED_STARTUPINFO_PRESENT | CREATE_SUSPENDED | CREATE_NEW_PROCESS_GROUP,
+                                                nullptr, nullptr, &startup.StartupInfo, &info);
+            const DWORD error = GetLastError();
+            DeleteProcThreadAttributeList(attributes);
+            // the child has its copies now.
+            close_inherited();
+            if (!created) {
+                close_pipes_();
+                throw std::runtime_error("Error: failed to start process with error code: " + std::to_string(error));
+            }
+            if (process_) CloseHandle(process_);
+            process_ = info.hProcess;
+            
+            if (!apply_placement_(info.hProcess)) {
+                TerminateProcess(info.hProcess, 1);
+                CloseHandle(info.hThread);
+                WaitForSingleObject(process_, INFINITE);
+                throw std::runtime_error("Error: could not apply the placement of the child");
+            }
+            ResumeThread(info.hThread);
+            CloseHandle(info.hThread);
+            Log::write(LogLevel::info, "Starting process with PID: ", info.dwProcessId);
+            
+            child_pid_ = info.dwProcessId;
+            forked_ = true;
+            keep_argv_(argv);
+            // see send_commands() for how the writes work with the write queue.
+            set_nonblocking();
+            return child_pid_;
+        }
+        
+        // fresh pipes for a new child, and a clean slate for everything that was about the last one.
+        void open_pipes_()
+        {
+            close_pipes_();
+            io_ = std::make_unique<Io>();
+            io_->owner = this;
+            for (Channel *channel : { &io_->input, &io_->output, &io_->error }) {
+                if (channel == &io_->error && stderr_mode_ != StderrMode::capture) continue;
+                channel->event = CreateEventA(nullptr, TRUE, FALSE, nullptr);
+                if (!channel->event) {
+                    close_pipes_();
+                    throw std::runtime_error("Error: failed to create the pipes");
+                }
+                if (channel != &io_->input) channel->buffer.resize(channel == &io_->output ? chunk_size_ : 4096);
+            }
+            read_buffer_.clear();
+            line_spans_.clear();
+            write_queue_.clear();
+            write_queue_head_ = 0;
+            read_eof_ = false;
+            err_buffer_.clear();
+            err_eof_ = false;
+            last_read_status_ = ReadStatus::matched;
+            nonblocking_ = false;
+        }
+        
+        // a named pipe for channel: our end overlapped, and the child's end, synchronous and inheritable,
+        // added to inherited and returned.
+        HANDLE open_child_end_(Channel &channel, bool inbound, std::vector<HANDLE> &inherited)
+        {
+            static std::atomic<unsigned> counter { 0 };
+            const std::string name = "\\\\.\\pipe\\sys_process." + std::to_string(GetCurrentProcessId()) + "." +
+                                     std::to_string(counter.fetch_add(1, std::memory_order_relaxed));
+            const DWORD size = pipe_size_ > 0 ? static_cast<DWORD>(pipe_size_) : 64 * 1024;
+            channel.handle = CreateNamedPipeA(name.c_str(),
+                                              (inbound ? PIPE_ACCESS_INBOUND : PIPE_ACCESS_OUTBOUND) |
+                                              FILE_FLAG_OVERLAPPED | FILE_FLAG_FIRST_PIPE_INSTANCE,
+                                              PIPE_TYPE_BYTE | PIPE_READMODE_BYTE | PIPE_WAIT | PIPE_REJECT_REMOTE_CLIENTS,
+                                              1, size, size, 0, nullptr);
+            if (channel.handle == INVALID_HANDLE_VALUE) throw std::runtime_error("Error: failed to create the pipes");
+            
+            SECURITY_ATTRIBUTES inheritable { sizeof(SECURITY_ATTRIBUTES), nullptr, TRUE };
+            const HANDLE theirs = CreateFileA(name.c_str(), inbound ? GENERIC_WRITE : GENERIC_READ, 0, &inheritable,
+                                              OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+            if (theirs == INVALID_HANDLE_VALUE) throw std::runtime_error("Error: failed to create the pipes");
+            inherited.push_back(theirs);
+            return theirs;
+        }
+        
+        HANDLE stderr_handle_(std::vector<HANDLE> &inherited)
+        {
+            if (stderr_mode_ == StderrMode::capture) return open_child_end_(io_->error, true, inherited);
+            
+            HANDLE handle = INVALID_HANDLE_VALUE;
+            if (stderr_mode_ == StderrMode::discard) {
+                SECURITY_ATTRIBUTES inheritable { sizeof(SECURITY_ATTRIBUTES), nullptr, TRUE };
+                handle = CreateFileA("NUL", GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE, &inheritable,
+                                     OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+            } else {
+                // ours, through an inheritable copy: the handle list only takes inheritable handles.
+                const HANDLE ours = GetStdHandle(STD_ERROR_HANDLE);
+                if (ours == nullptr || ours == INVALID_HANDLE_VALUE ||
+                    !DuplicateHandle(GetCurrentProcess(), ours, GetCurrentProcess(), &handle, 0, TRUE, DUPLICATE_SAME_ACCESS))
+                    return nullptr;  // we have no standard error, neither will the child.
+            }
+            if (handle == INVALID_HANDLE_VALUE) throw std::runtime_error("Error: could not open the standard error of the child");
+            inherited.push_back(handle);
+            return handle;
+        }
+        
+        void close_channel_(Channel &channel)
+        {
+            settle_(channel);
+            if (channel.handle != INVALID_HANDLE_VALUE) CloseHandle(channel.handle);
+            if (channel.event) CloseHandle(channel.event);
+            channel.handle = INVALID_HANDLE_VALUE;
+            channel.event = nullptr;
+            channel.pending = false;
+            channel.closed = true;
+            channel.buffer.clear();
+        }
+        
+        void close_pipes_()
+        {
+            if (!io_) return;
+            for (Channel *channel : { &io_->input, &io_->output, &io_->error }) close_channel_(*channel);
+            io_.reset();
+        }
+        
+        // quoted for CommandLineToArgvW(): backslashes are literal, but before a quote, where they escape.
+        static void append_argument_(std::string &line, std::string_view arg)
+        {
+            if (!arg.empty() && arg.find_first_of(" \t\n\v\"") == std::string_view::npos) {
+                line += arg;
+                return;
+            }
+            line += '"';
+            size_t backslashes = 0;
+            for (const char c : arg) {
+                if (c == '\\') {
+                    backslashes++;
+                    continue;
+                }
+                // doubled before a quote (which is escaped too), as they are.
+                line.append(c == '"' ? 2 * backslashes + 1 : backslashes, '\\');
+                line += c;
+                backslashes = 0;
+            }
+            // and before the closing quote.
+            line.append(2 * backslashes, '\\');
+            line += '"';
+        }
+        
+        // the CPUs (or those of the NUMA node) and the priority class of the suspended child.
+        bool apply_placement_(HANDLE process)
+        {
+            std::vector<int> cpus = placement_.cpus;
+            if (cpus.empty() && placement_.numa_node >= 0) cpus = CpuTopology::cpus_of_node(placement_.numa_node);
+            if (!cpus.empty()) {
+                DWORD_PTR mask = 0;
+                for (int cpu : cpus)
+                    if (cpu >= 0 && cpu < static_cast<int>(8 * sizeof(DWORD_PTR))) mask |= DWORD_PTR(1) << cpu;
+                if (mask == 0 || !SetProcessAffinityMask(process, mask)) return false;
+            }
+            if (placement_.nice) {
+                const int nice = *placement_.nice;
+                const DWORD priority = nice >= 10 ? IDLE_PRIORITY_CLASS
+                                     : nice > 0   ? BELOW_NORMAL_PRIORITY_CLASS
+                                     : nice == 0  ? NORMAL_PRIORITY_CLASS
+                                     : nice > -10 ? ABOVE_NORMAL_PRIORITY_CLASS
+                                                  : HIGH_PRIORITY_CLASS;
+                if (!SetPriorityClass(process, priority)) return false;
+            }
+            return true;
+        }
+        
+#else
+        // read a chunk of the child's output into read_buffer_, mirroring it if mirror_output() was called.
+        ssize_t fill_()
+        {
+            ssize_t bytes_read = fill_chunk_();
+            // a pty master doesn't return 0 once the child closed the slave, but EIO: it's the same EOF.
+            if (bytes_read == -1 && errno == EIO && pseudo_terminal_) bytes_read = 0;
+            io_stats_.read_calls++;
+            if (bytes_read > 0) io_stats_.bytes_read += static_cast<uint64_t>(bytes_read);
+            if (bytes_read == -1 && errno != EAGAIN && errno != EWOULDBLOCK)
+                throw std::runtime_error("Error: could not read from the process");
+            return bytes_read;
+        }
+        
+        ssize_t fill_chunk_()
+        {
+            if (mirror_fd_ == -1) return read_buffer_.fill(in_pipe_[0]);
+            
+            size_t limit = read_buffer_.reserve();
+#if defined(__linux__)
+            if (mirror_pipe_[0] != -1)
+            {   // duplicate (without consuming) at most what we are going to read.
+                ssize_t teed;
+                do {
+                    teed = tee(in_pipe_[0], mirror_pipe_[1], limit, nonblocking_ ? SPLICE_F_NONBLOCK : 0);
+                } while (teed == -1 && errno == EINTR);
+                
+                if (teed == 0) return 0; // EOF, nothing left to read either.
+                if (teed == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) return -1;
+                if (teed > 0 && splice_to_mirror_(static_cast<size_t>(teed)))
+                    return read_buffer_.fill(in_pipe_[0], static_cast<size_t>(teed));
+                // log_fd can't be spliced into (or tee failed): from now on go through user space.
+                // If some bytes were teed already they are dropped with the pipe, and we get them below.
+                close_mirror_pipe_();
+            }
+#endif
+            const ssize_t bytes_read = read_buffer_.fill(in_pipe_[0], limit);
+            if (bytes_read > 0)
+            {
+                const std::string_view chunk = read_buffer_.view(read_buffer_.size() - bytes_read, bytes_read);
+                for (size_t written = 0; written < chunk.size();) {
+                    const ssize_t w = ::write(mirror_fd_, chunk.data() + written, chunk.size() - written);
+                    if (w == -1 && errno == EINTR) continue;
+                    if (w == -1) throw std::runtime_error("Error: could not mirror the process output");
+                    written += w;
+                }
+            }
+            return bytes_read;
+        }
+        
+#if defined(__linux__)
+        // move exactly `bytes` from the mirror pipe to mirror_fd_, false if mirror_fd_ doesn't support splice.
+        bool splice_to_mirror_(size_t bytes)
+        {
+            size_t left = bytes;
+            while (left > 0)
+            {
+                const ssize_t moved = splice(mirror_pipe_[0], nullptr, mirror_fd_, nullptr, left, SPLICE_F_MOVE);
+                if (moved == -1)
+                {
+                    if (errno == EINTR) continue;
+                    if (errno == EAGAIN) {
+                        pollfd fds { .fd = mirror_fd_, .events = POLLOUT, .revents = 0 };
+                        while (poll(&fds, 1, -1) == -1 && errno == EINTR) {}
+                        continue;
+                    }
+                    if (errno == EINVAL && left == bytes) return false;
+                    throw std::runtime_error("Error: could not mirror the process output");
+                }
+                left -= moved;
+            }
+            return true;
+        }
+#endif
+        
+        // start() with the child's standard input and output connected to stdin_fd and stdout_fd instead of
+        // pipes to us, when they're not -1: see Pipeline. The fds stay ours, the child gets a copy.
+        pid_t start_(const char * const argv[], int stdin_fd = -1, int stdout_fd = -1)
+        {
+            /*
+             *   |------- p_parent space -----------|        |-------------- p_child space ---------|
+             *   |       any  -> | out[1] (write)   |   ->   |    out[0] (read)  | (dup2) -> STDIN  |
+             *   |       any  <- | in[0] (read)     |   <-   |    in[1] (write)  | (dup2) <- STDOUT |
+             *                                        pipe's
+             *                   | out[0] (unused)    space       out[1] (unused)|
+             *                   | in[1] (unused)                 in[0] (unused) |
+             *                   |_______________________________________________|
+             * Each process has it's own copy of file descriptors which point to the same underlaying
+             * object! But the parent and the child only use some of those file descriptors. So:
+             * -In the parent, close out[0] and in[1] (the child space's fds)
+             * -In the child, close out[1] and in[0] (the parent space's fd)
+             *
+             * We don't fork() ourselves: fork copies the page tables of the whole parent, which takes
+             * tens of milliseconds once the parent is a few GBs large. posix_spawn is implemented with
+             * a vfork-like clone on both glibc and macOS, the child borrows our address space until it
+             * execs, so the cost doesn't depend on how big we are.
+             * The dup2/close sequence the child needs is recorded upfront as spawn file actions.
+             */
+            if (forked_ && is_alive()) throw std::runtime_error("Error: the process is already running");
+            if (reactor_) throw std::runtime_error("Error: remove the process from its reactor before starting it");
+            open_pipes_(stdin_fd == -1, stdout_fd == -1);
+            // the CPUs and memory of the child, through our own thread (first, it's the one that can throw).
+            PlacementScope placement_scope(placement_);
+            
+            posix_spawn_file_actions_t actions;
+            if (posix_spawn_file_actions_init(&actions) != 0)
+                throw std::runtime_error("Error: posix_spawn_file_actions_init() failed");
+            
+            // close the copy of the fds used by the parent, but held by the child.
+            if (stdin_fd == -1) posix_spawn_file_actions_addclose(&actions, out_pipe_[1]);
+            if (stdout_fd == -1) posix_spawn_file_actions_addclose(&actions, in_pipe_[0]);
+            // redirect the child's stdinput to the read end of the output pipe
+            // the messages generated by the parent are passed on to the child as input.
+            // then close the matched fd, since STDIN now points to the file.
+            if (stdin_fd == -1) {
+                posix_spawn_file_actions_adddup2(&actions, out_pipe_[0], STDIN_FILENO);
+                posix_spawn_file_actions_addclose(&actions, out_pipe_[0]);
+            } else {
+                // dup2() clears close-on-exec on the copy, the original stays ours.
+                posix_spawn_file_actions_adddup2(&actions, stdin_fd, STDIN_FILENO);
+            }
+            // redirect the child's stdoutput to the write end of the input pipe.
+            // the messages generated by the child are mirrored to the parent's output.
+            if (stdout_fd == -1) {
+                posix_spawn_file_actions_adddup2(&actions, in_pipe_[1], STDOUT_FILENO);
+                posix_spawn_file_actions_addclose(&actions, in_pipe_[1]);
+            } else {
+                posix_spawn_file_actions_adddup2(&actions, stdout_fd, STDOUT_FILENO);
+            }
+            // and the standard error, if we don't leave it to whatever ours is.
+            if (stderr_mode_ == StderrMode::discard) {
+                posix_spawn_file_actions_addopen(&actions, STDERR_FILENO, "/dev/null", O_WRONLY, 0);
+            } else if (stderr_mode_ == StderrMode::capture) {
+                posix_spawn_file_actions_addclose(&actions, err_pipe_[0]);
+                posix_spawn_file_actions_adddup2(&actions, err_pipe_[1], STDERR_FILENO);
+                posix_spawn_file_actions_addclose(&actions, err_pipe_[1]);
+            }
+            // last, once the pipes are out of the way: the shared memory always gets the same fd in the child,
+            // and its size goes along in the environment.
+            std::vector<std::string> environment_storage;
+            std::vector<char *> environment;
+            if (shared_channel_) {
+                posix_spawn_file_actions_adddup2(&actions, shared_channel_->fd(), SharedChannel::child_fd);
+                // ours replaces any we inherited (e.g. we are the child of another Process): getenv() takes the first.
+                environment_storage.push_back(std::string(SharedChannel::environment_variable) + "=" +
+                                              std::to_string(shared_channel_->capacity()));
+                const std::string_view ours = environment_storage.back();
+                const std::string_view prefix = ours.substr(0, ours.find('=') + 1);
+                for (char **variable = environ; *variable != nullptr; variable++)
+                    if (!std::string_view(*variable).starts_with(prefix)) environment.push_back(*variable);
+                environment.push_back(environment_storage.back().data());
+                environment.push_back(nullptr);
+            }
+            
+            posix_spawnattr_t attr;
+            if (posix_spawnattr_init(&attr) != 0) {
+                posix_spawn_file_actions_destroy(&actions);
+                throw std::runtime_error("Error: posix_spawnattr_init() failed");
+            }
+            // the parent ignores SIGPIPE (see ignore_sigpipe_), don't pass that on to the child.
+            sigset_t default_signals;
+            sigemptyset(&default_signals);
+            sigaddset(&default_signals, SIGPIPE);
+            posix_spawnattr_setsigdefault(&attr, &default_signals);
+            // keep the interrupt signals away from the child, the parent process will handle them.
+            // In its own process group the child doesn't receive the terminal's ^C.
+            posix_spawnattr_setpgroup(&attr, 0);
+            short flags = POSIX_SPAWN_SETSIGDEF | POSIX_SPAWN_SETPGROUP;
+#if defined(__linux__)
+            // the policies posix_spawn applies itself, before the exec (a refused one fails the spawn).
+            if (placement_.scheduling_policy && spawn_sets_policy_(*placement_.scheduling_policy)) {
+                sched_param parameters {};
+                parameters.sched_priority = sched_get_priority_min(*placement_.scheduling_policy);
+                posix_spawnattr_setschedpolicy(&attr, *placement_.scheduling_policy);
+                posix_spawnattr_setschedparam(&attr, &parameters);
+                flags |= POSIX_SPAWN_SETSCHEDULER;
+            }
+#endif
+            posix_spawnattr_setflags(&attr, flags);
+            
+            /*
+             exec failures don't need to travel back through a status pipe: posix_spawn reports them
+             as its return value (glibc does exactly that internally, with a CLOEXEC pipe), so the
+             child never has to throw anything in a copy of our address space.
+             */
+            // the first argument is the path of the executable.
+            pid_t process_p = 0;
+            const int err = posix_spawn(&process_p, command_.c_str(), &actions, &attr,
+                                        const_cast<char * const *>(argv),
+                                        shared_channel_ ? environment.data() : environ);
+            placement_scope.restore();
+            posix_spawnattr_destroy(&attr);
+            posix_spawn_file_actions_destroy(&actions);
+            
+            if (err != 0)
+            {
+                std::string err_str {"Error: failed to start process with error code: "};
+                err_str.append(std::to_string(err)).append(" (").append(strerror(err)).append(")");
+                throw std::runtime_error(err_str);
+            }
+            
+            Log::write(LogLevel::info, "Starting process with PID: ", process_p);
+            
+            // close the copy of fds used by the child, but held by the parent.
+            if (out_pipe_[0] != -1) close(std::exchange(out_pipe_[0], -1));
+            if (in_pipe_[1] != -1) close(std::exchange(in_pipe_[1], -1));
+            if (stderr_mode_ == StderrMode::capture) {
+                close(std::exchange(err_pipe_[1], -1));
+                // only ever drained opportunistically, so it's always non-blocking.
+                fcntl(err_pipe_[0], F_SETFL, fcntl(err_pipe_[0], F_GETFL) | O_NONBLOCK);
+            }
+            
+            child_pid_ = process_p;
+            child_state_ = ChildRegistry::instance().track(process_p);
+            forked_ = true;
+            apply_placement_after_spawn_();
+            keep_argv_(argv);
+            // see send_commands() for how the writes work with non-blocking pipes.
+            set_nonblocking();
+            
+            return process_p;
+        }
+        
+        // fresh pipes for a new child, and a clean slate for everything that was about the last one.
+        // They are all close-on-exec: the child only gets the ends the spawn file actions dup2() onto 0, 1 and 2,
+        // and nothing leaks into the children that other Process objects start meanwhile on other threads.
+        // No input (output) pipe when the child's standard input (output) is connected somewhere else.
+        static bool open_pipe_(int pipe_fds[2])
+        {
+#if defined(__linux__)
+            return pipe2(pipe_fds, O_CLOEXEC) == 0;
+#else
+            // no pipe2() on macOS: there's a window where another thread's fork() inherits these.
+            if (pipe(pipe_fds) == -1) return false;
+            for (int i = 0; i < 2; i++) fcntl(pipe_fds[i], F_SETFD, FD_CLOEXEC);
+            return true;
+#endif
+        }
+        
+        void open_pipes_(bool input = true, bool output = true)
+        {
+            close_pipes_();
+            for (int *pipe_fds : { out_pipe_, in_pipe_, err_pipe_ }) {
+                if (pipe_fds == err_pipe_ && stderr_mode_ != StderrMode::capture) continue;
+                if ((pipe_fds == out_pipe_ && !input) || (pipe_fds == in_pipe_ && !output)) continue;
+                if (pipe_fds == in_pipe_ && pseudo_terminal_) {
+                    open_terminal_();
+                    continue;
+                }
+                if (!open_pipe_(pipe_fds)) {
+                    close_pipes_();
+                    throw std::runtime_error("Error: failed to create the pipes");
+                }
+            }
+#if defined(F_SETPIPE_SZ)
+            if (pipe_size_ > 0) {
+                // best effort: above /proc/sys/fs/pipe-max-size this fails for unprivileged users.
+                if (input) fcntl(out_pipe_[0], F_SETPIPE_SZ, static_cast<int>(pipe_size_));
+                if (output) fcntl(in_pipe_[0], F_SETPIPE_SZ, static_cast<int>(pipe_size_));
+            }
+#endif
+            // a new child starts from empty rings too.
+            if (shared_memory_size_ > 0) shared_channel_ = std::make_unique<SharedChannel>(shared_memory_size_);
+            
+            read_buffer_.clear();
+            line_spans_.clear();
+            write_queue_.clear();
+            write_queue_head_ = 0;
+            // nothing will ever come from a pipe we don't have.
+            read_eof_ = !output;
+            err_buffer_.clear();
+            err_eof_ = false;
+            last_read_status_ = ReadStatus::matched;
+            nonblocking_ = false;
+            child_state_.reset();
+        }
+        
+        /*
+         posix_spawn has no attribute for the CPU affinity or the memory policy, but the child inherits both from
+         the thread that spawns it, and keeps them across exec. So we set them on our own thread just for the spawn,
+         and put ours back right after: this thread hops to the child's CPUs for the duration of the call.
+         */
+        class PlacementScope
+        {
+        public:
+            explicit PlacementScope(const Placement &placement)
+            {
+#if defined(__linux__)
+                if (!placement.cpus.empty()) {
+                    cpu_set_t set;
+                    CPU_ZERO(&set);
+                    for (int cpu : placement.cpus)
+                        if (cpu >= 0 && cpu < CPU_SETSIZE) CPU_SET(cpu, &set);
+                    if (sched_getaffinity(0, sizeof(saved_cpus_), &saved_cpus_) == -1 ||
+                        sched_setaffinity(0, sizeof(set), &set) == -1)
+                        throw std::runtime_error("Error: could not set the CPU affinity of the child");
+                    restore_cpus_ = true;
+                }
+                if (placement.numa_node >= 0) {
+                    if (static_cast<size_t>(placement.numa_node) >= max_nodes_) 
+                        throw std::runtime_error("Error: no such NUMA node");
+                    unsigned long mask[max_nodes_ / (8 * sizeof(unsigned long))] {};
+                    mask[placement.numa_node / (8 * sizeof(unsigned long))] |= 1ul << (placement.numa_node % (8 * sizeof(unsigned long)));
+                    if (syscall(SYS_get_mempolicy, &saved_mode_, saved_nodes_, max_nodes_, nullptr, 0) == -1 ||
+                        syscall(SYS_set_mempolicy, mpol_bind_, mask, max_nodes_) == -1) {
+                        restore();
+                        throw std::runtime_error("Error: could not bind the memory of the child to its NUMA node");
+                    }
+                    restore_memory_ = true;
+                }
+#else
+                (void)placement;
+#endif
+            }
+            ~PlacementScope() { restore(); }
+            PlacementScope(const PlacementScope &) = delete;
+            PlacementScope& operator=(const PlacementScope &) = delete;
+            
+            void restore()
+            {
+#if defined(__linux__)
+                if (restore_cpus_) sched_setaffinity(0, sizeof(saved_cpus_), &saved_cpus_);
+                if (restore_memory_) syscall(SYS_set_mempolicy, saved_mode_, saved_nodes_, max_nodes_);
+                restore_cpus_ = restore_memory_ = false;
+#endif
+            }
+            
+        private:
+#if defined(__linux__)
+            // from numaif.h, which is in libnuma's headers rather than the system ones.
+            static constexpr int mpol_bind_ = 2;
+            static constexpr size_t max_nodes_ = 1024;
+            cpu_set_t saved_cpus_ {};
+            int saved_mode_ = 0;
+            unsigned long saved_nodes_[max_nodes_ / (8 * sizeof(unsigned long))] {};
+            bool restore_cpus_ = false;
+            bool restore_memory_ = false;
+#endif
+        };
+        
+#if defined(__linux__)
+        // glibc's posix_spawn applies these, but silently ignores SCHED_BATCH and SCHED_IDLE.
+        static bool spawn_sets_policy_(int policy)
+        {
+            return policy == SCHED_OTHER || policy == SCHED_FIFO || policy == SCHED_RR;
+        }
+#endif
+        
+        // what can only be done once the child exists: it runs with our scheduling policy, nice value and cgroup
+        // for the few microseconds in between. Any of them failing kills the child, see Placement.
+        void apply_placement_after_spawn_()
+        {
+#if defined(__linux__)
+            if (placement_.scheduling_policy && !spawn_sets_policy_(*placement_.scheduling_policy)) {
+                sched_param parameters {};
+                parameters.sched_priority = sched_get_priority_min(*placement_.scheduling_policy);
+                if (sched_setscheduler(child_pid_, *placement_.scheduling_policy, &parameters) == -1) {
+                    kill_();
+                    throw std::runtime_error("Error: could not set the scheduling policy of the child");
+                }
+            }
+#endif
+            if (placement_.nice && setpriority(PRIO_PROCESS, static_cast<id_t>(child_pid_), *placement_.nice) == -1) {
+                kill_();
+                throw std::runtime_error("Error: could not set the nice value of the child");
+            }
+#if defined(__linux__)
+            if (!placement_.cgroup.empty()) {
+                const int fd = open((placement_.cgroup + "/cgroup.procs").c_str(), O_WRONLY | O_CLOEXEC);
+                char text[24];
+                const size_t length = static_cast<size_t>(std::to_chars(text, text + sizeof(text), child_pid_).ptr - text);
+                const bool moved = fd != -1 && ::write(fd, text, length) == static_cast<ssize_t>(length);
+                if (fd != -1) close(fd);
+                if (!moved) {
+                    kill_();
+                    throw std::runtime_error("Error: could not move the child into " + placement_.cgroup);
+                }
+            }
+#endif
+        }
+        
+        // in_pipe_ is then the master side (which we read) and the slave side (the child's stdout) of a pty.
+        void open_terminal_()
+        {
+            const int master = posix_openpt(O_RDWR | O_NOCTTY);
+            if (master == -1 || grantpt(master) == -1 || unlockpt(master) == -1) {
+                if (master != -1) close(master);
+                close_pipes_();
+                throw std::runtime_error("Error: failed to open a pseudo-terminal");
+            }
+            fcntl(master, F_SETFD, FD_CLOEXEC);
+            in_pipe_[0] = master;
+            
+            char name[128];
+#if defined(__linux__)
+            const bool named = ptsname_r(master, name, sizeof(name)) == 0;
+#else
+            // ptsname() returns a static buffer.
+            static std::mutex ptsname_mutex;
+            bool named = false;
+            {
+                std::lock_guard lock(ptsname_mutex);
+                if (const char *slave_name = ptsname(master)) {
+                    named = strlen(slave_name) < sizeof(name);
+                    if (named) strcpy(name, slave_name);
+                }
+            }
+#endif
+            // O_NOCTTY: it's only somewhere to write to, never the controlling terminal of anybody.
+            const int slave = named ? open(name, O_RDWR | O_NOCTTY | O_CLOEXEC) : -1;
+            if (slave == -1) {
+                close_pipes_();
+                throw std::runtime_error("Error: failed to open the pseudo-terminal slave");
+            }
+            in_pipe_[1] = slave;
+            
+            termios attributes;
+            if (tcgetattr(slave, &attributes) == 0) {
+                cfmakeraw(&attributes);
+                tcsetattr(slave, TCSANOW, &attributes);
+            }
+        }
+        
+        void close_pipes_()
+        {
+            for (int *pipe_fds : { out_pipe_, in_pipe_, err_pipe_ }) {
+                for (int i = 0; i < 2; i++) {
+                    if (pipe_fds[i] != -1) close(pipe_fds[i]);
+                    pipe_fds[i] = -1;
+                }
+            }
+        }
+        
+        void close_mirror_pipe_()
+        {
+            for (int &fd : mirror_pipe_) {
+                if (fd != -1) close(fd);
+                fd = -1;
+            }
+        }
+        
+        // write as much of iov as the pipe takes without blocking, advancing iov/count past what was written.
+        // true once everything was written, false if the pipe is full (EAGAIN on a non-blocking fd).
+        bool write_some_(iovec *&iov, size_t &count)
+        {
+            while (count > 0)
+            {
+                const int batch = static_cast<int>(std::min<size_t>(count, IOV_MAX));
+                const ssize_t written = ::writev(out_pipe_[1], iov, batch);
+                io_stats_.write_calls++;
+                
+                if (written == -1)
+                {
+                    if (errno == EINTR) continue;
+                    if (errno == EAGAIN || errno == EWOULDBLOCK) return false;
+                    if (errno == EPIPE)
+                        throw std::runtime_error("Error: the process is not running");
+                    throw std::runtime_error("Error: could not send command to the process");
+                }
+                
+                io_stats_.bytes_written += static_cast<uint64_t>(written);
+                
+                // skip what was fully written, and advance into the first partially written buffer.
+                size_t left = static_cast<size_t>(written);
+                while (count > 0 && left >= iov->iov_len) {
+                    left -= iov->iov_len;
+                    iov++;
+                    count--;
+                }
+                if (count > 0) {
+                    iov->iov_base = static_cast<char *>(iov->iov_base) + left;
+                    iov->iov_len -= left;
+                }
+            }
+            return true;
+        }
+        
+        static void ignore_sigpipe_()
+        {
+            // writing to a child that died raises SIGPIPE, which by default terminates us as well.
+            // We'd rather get EPIPE from write(), so ignore it once, unless someone installed a handler.
+            static const bool ignored = [] {
+                struct sigaction current {};
+                if (sigaction(SIGPIPE, nullptr, &current) == 0 && current.sa_handler == SIG_DFL)
+                    signal(SIGPIPE, SIG_IGN);
+                return true;
+            }();
+            (void)ignored;
+        }
+        
+        ssize_t fill_stderr_() { return err_buffer_.fill(err_pipe_[0]); }
+        
+        bool wait_(std::chrono::steady_clock::time_point deadline, bool writing, Ready &ready)
+        {
+            // from the manual: POLLHUP is an output only flag, ignored in the .events bitmask
+            // the second one is the write end, and the third one the standard error, when it's captured.
+            pollfd fds[3] { { .fd = read_eof_ ? -1 : in_pipe_[0], .events = POLLIN, .revents = 0 },
+                            { .fd = writing ? out_pipe_[1] : -1, .events = POLLOUT, .revents = 0 },
+                            { .fd = stderr_fd(), .events = POLLIN, .revents = 0 } };
+            int poll_ret;
+            do {
+                int wait_ms = -1;
+                if (deadline != std::chrono::steady_clock::time_point::max()) {
+                    const auto left = std::chrono::ceil<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now()).count();
+                    wait_ms = static_cast<int>(std::max<decltype(left)>(left, 0));
+                }
+                poll_ret = wait_ms == 0 ? 0 : poll(fds, 3, wait_ms);
+            } while (poll_ret == -1 && errno == EINTR);
+            
+            if (poll_ret == -1)
+            {   Log::write(LogLevel::error, "poll() failed for PID ", child_pid_, ": ", strerror(errno));
+                throw std::runtime_error(std::string("poll() failed: ") + strerror(errno));
+            }
+            /*
+             When a pipe is closed from the other side (i.e. the child process terminates)
+             poll returns an revent of POLLIN/POLLHUP to signal "EOF".
+             highly OS specific: see http://www.greenend.org.uk/rjk/tech/poll.html.
+             
+             Linux/SunOS: POLLHUP   MacOS/FreeBSD: POLLIN|POLLHUP      OpenBSD/etc: POLLIN
+             We check for both POLLIN and POLLHUP, in case there is still data to read.
+             We rely on read to tell us if we reach the EOF.
+             */
+            ready.output = (fds[0].revents & (POLLIN | POLLHUP | POLLERR)) != 0;
+            ready.input = fds[1].revents != 0;
+            ready.error = fds[2].revents != 0;
+            return poll_ret > 0;
+        }
+        
+        bool input_open_() const { return out_pipe_[1] != -1; }
+        void close_input_channel_() { close(std::exchange(out_pipe_[1], -1)); }
+        
+        bool running_() const { return forked_ && child_state_->alive.load(std::memory_order_relaxed); }
+        
+        // the terminate or the kill step of a shutdown.
+        void signal_(ShutdownStep step)
+        {
+            ChildRegistry::instance().signal(*child_state_, step == ShutdownStep::terminate ? SIGTERM : SIGKILL);
+        }
+        
+        // wait until the pending processes exited, at most timeout.
+        static void wait_for_exit_(std::span<BasicProcess * const> processes, const std::vector<bool> &pending,
+                                   std::chrono::milliseconds timeout)
+        {
+            std::vector<const ChildState *> states;
+            for (size_t i = 0; i < processes.size(); i++)
+                if (pending[i]) states.push_back(processes[i]->child_state_.get());
+            if (timeout == std::chrono::milliseconds::max()) {
+                for (const ChildState *state : states) ChildRegistry::wait(*state);
+            } else {
+                ChildRegistry::instance().wait_until(states, std::chrono::steady_clock::now() + timeout);
+            }
+        }
+        
+        void kill_()
+        {
+            /*
+             Sometimes, child processes exit or are killed, but the kernel will hold on to their exit
+             code until some other process claims it with wait() or waitpid().
+             
+             We don't do that here: the ChildRegistry reaps every child we start, exactly once and by pid,
+             so there is nothing left hanging around, and we can't accidentally reap (or kill) a process
+             that isn't ours. All we do is make sure it's dead before we let go of it.
+             */
+            if (forked_ && child_state_)
+            {  // We actually have at least started the child. We don't care if it died right after
+                ChildRegistry::instance().signal(*child_state_, SIGKILL);
+                ChildRegistry::wait(*child_state_);
+            }
+        }
+#endif
+        
+#if defined(_WIN32)
+        std::unique_ptr<Io> io_;
+        HANDLE process_ = nullptr;
+        size_t chunk_size_ = 0;
+#else
+        int out_pipe_[2] = { -1, -1 };
+        int in_pipe_[2] = { -1, -1 };
+#endif
+        bool forked_ = false;
+        pid_t child_pid_ = 0;
+        
+        LineBuffer read_buffer_;
+        // (offset, length) of the lines framed by the current read, relative to the buffer start.
+        std::vector<std::pair<size_t, size_t>> line_spans_;
+        // see read_lines_()
+        std::vector<std::string> spare_lines_;
+        std::vector<iovec> write_iov_;
+        bool nonblocking_ = false;
+        // see send_commands()
+        std::vector<char> write_queue_;
+        size_t write_queue_head_ = 0;
+        size_t write_queue_limit_ = 0;
+        Backpressure backpressure_ = Backpressure::block;
+        size_t max_buffered_output_ = 0;
+        IoStats io_stats_ {};
+        [[no_unique_address]] Metrics metrics_ {};
+        bool read_eof_ = false;
+        // see StderrMode
+        StderrMode stderr_mode_ = StderrMode::inherit;
+#if !defined(_WIN32)
+        int err_pipe_[2] = { -1, -1 };
+#endif
+        bool err_eof_ = false;
+        LineBuffer err_buffer_;
+        std::function<void(std::string_view)> on_stderr_line_;
+        ReadStatus last_read_status_ = ReadStatus::matched;
+#if !defined(_WIN32)
+        // see mirror_output()
+        int mirror_fd_ = -1;
+        int mirror_pipe_[2] = { -1, -1 };
+#endif
+        // set while the process is registered with a reactor, see ProcessReactor::add()/attach().
+        ProcessReactor *reactor_ = nullptr;
+#if !defined(_WIN32)
+        std::unique_ptr<SharedChannel> shared_channel_;
+        // see ChildRegistry
+        std::shared_ptr<ChildState> child_state_;
+#endif
+        // what start() needs to make a new child, see restart().
+        size_t pipe_size_ = 0;
+        size_t shared_memory_size_ = 0;
+        bool pseudo_terminal_ = false;
+        Placement placement_;
+        std::vector<std::string> argv_;
+        std::vector<const char *> argv_ptrs_;
+    };
+    
+    using Process = BasicProcess<NoMetrics>;
+    
+    // Handshake run on a pooled child when it comes up and every time its lease is returned,
+    // to bring it back to a clean state. e.g. { { "ucinewgame", "isready" }, "readyok" }
+    struct ResetHandshake
+    {
+        std::vector<std::string> commands {};
+        // the line to wait for after sending the commands, if empty we don't wait for anything.
+        std::string expected {};
+        int timeout_ms = 1000;
+    };
+    
+    /*
+     Keeps a number of warm children around, so that getting hold of one doesn't cost a process startup.
+     
+     acquire() only pops an idle child from a list under a mutex. Everything slow happens on a
+     background thread instead: running the reset handshake on the children that come back,
+     checking that the idle ones are still alive, and spawning replacements for the ones that died.
+     The pool must outlive all the leases it handed out.
+     */
+    template <typename Metrics = NoMetrics>
+    class BasicProcessPool
+    {
+    public:
+        using Process = BasicProcess<Metrics>;
+        
+        // RAII handle on a child checked out of the pool, it goes back to the pool when destroyed.
+        class Lease
+        {
+        public:
+            Lease() = default;
+            Lease(Lease && other) noexcept
+                : pool_(std::exchange(other.pool_, nullptr)), process_(std::move(other.process_))
+            {
+                other.process_.reset();
+            }
+            Lease& operator=(Lease && other) noexcept
+            {
+                if (this != &other) {
+                    release();
+                    pool_ = std::exchange(other.pool_, nullptr);
+                    process_ = std::move(other.process_);
+                    other.process_.reset();
+                }
+                return *this;
+            }
+            Lease(const Lease & other)              = delete;
+            Lease& operator=(const Lease & other)   = delete;
+            ~Lease() { release(); }
+            
+            Process& operator*() { return *process_; }
+            Process* operator->() { return &*process_; }
+            explicit operator bool() const { return process_.has_value(); }
+            
+            // give the child back before the lease goes out of scope.
+            void release()
+            {
+                if (pool_ && process_) pool_->return_(std::move(*process_));
+                process_.reset();
+                pool_ = nullptr;
+            }
+            
+        private:
+            friend class BasicProcessPool;
+            Lease(BasicProcessPool *pool, Process &&process)
+                : pool_(pool), process_(std::move(process)) {}
+            
+            BasicProcessPool *pool_ = nullptr;
+            // held by value, like the idle children in the pool: a Process is cheap to move.
+            std::optional<Process> process_;
+        };
+        
+        // argv follows the same convention of Process::start: the first argument is the path of the executable.
+        // The constructor spawns all the children and waits for each one of them to complete the handshake.
+        BasicProcessPool(std::vector<std::string> argv, size_t size, ResetHandshake reset = {},
+                    std::chrono::milliseconds health_check_interval = std::chrono::milliseconds(100),
+                    ProcessOptions options = {})
+            : argv_(std::move(argv)), size_(size), reset_(std::move(reset)),
+              health_check_interval_(health_check_interval), options_(options)
+        {
+            if (argv_.empty()) throw std::runtime_error("Error: no command given to the process pool");
+            
+            for (const auto &arg : argv_) argv_ptrs_.push_back(arg.c_str());
+            argv_ptrs_.push_back(nullptr);
+            for (const auto &command : reset_.commands) reset_commands_.push_back(command);
+            if (options_.placement.spread) {
+                spread_cpus_ = CpuTopology::by_node(options_.placement.cpus.empty() ? CpuTopology::allowed_cpus()
+                                                                                    : options_.placement.cpus);
+                std::vector<int> nodes;
+                for (int cpu : spread_cpus_) nodes.push_back(CpuTopology::node_of(cpu));
+                spread_nodes_ = static_cast<size_t>(std::unique(nodes.begin(), nodes.end()) - nodes.begin());
+                if (!spread_cpus_.empty()) {
+                    per_slice_ = std::max<size_t>(1, spread_cpus_.size() / std::max<size_t>(size_, 1));
+                    slice_children_.assign(std::max<size_t>(1, spread_cpus_.size() / per_slice_), 0);
+                }
+            }
+            
+            idle_.reserve(size_);
+            for (size_t i = 0; i < size_; i++) idle_.push_back(spawn_());
+            
+            maintenance_ = std::thread([this] { maintain_(); });
+        }
+        ~BasicProcessPool()
+        {
+            {
+                std::lock_guard lock(mutex_);
+                stopping_ = true;
+            }
+            maintenance_cv_.notify_all();
+            maintenance_.join();
+            // all the children together, rather than one Process destructor after the other.
+            std::vector<Process *> children;
+            for (auto &process : idle_) children.push_back(&process);
+            for (auto &process : returned_) children.push_back(&process);
+            Process::shutdown_all(children, shutdown_policy_);
+        }
+        BasicProcessPool(const BasicProcessPool & other)              = delete;
+        BasicProcessPool& operator=(const BasicProcessPool & other)   = delete;
+        
+        // check out an idle child, waiting for one to be available if needed.
+        Lease acquire()
+        {
+            std::unique_lock lock(mutex_);
+            available_cv_.wait(lock, [this] { return !idle_.empty(); });
+            return pop_idle_();
+        }
+        
+        // check out an idle child if there is one, otherwise return an empty lease.
+        Lease try_acquire()
+        {
+            std::lock_guard lock(mutex_);
+            if (idle_.empty()) return {};
+            return pop_idle_();
+        }
+        
+        // how the destructor stops the children that are not leased, by default SIGTERM then SIGKILL right away.
+        void set_shutdown_policy(ShutdownPolicy policy)
+        {
+            std::lock_guard lock(mutex_);
+            shutdown_policy_ = std::move(policy);
+        }
+        
+        size_t size() const { return size_; }
+        size_t idle() const
+        {
+            std::lock_guard lock(mutex_);
+            return idle_.size();
+        }
+        
+    private:
+        Lease pop_idle_()
+        {   // LIFO, the most recently used child is the most likely to still be hot in the caches.
+            Lease lease(this, std::move(idle_.back()));
+            idle_.pop_back();
+            return lease;
+        }
+        
+        void return_(Process &&process)
+        {
+            {
+                std::lock_guard lock(mutex_);
+                returned_.push_back(std::move(process));
+            }
+            maintenance_cv_.notify_one();
+        }
+        
+        Process spawn_()
+        {
+            const size_t slice = take_slice_();
+            try {
+                Process process(argv_[0], options_for_slice_(slice));
+                process.start(argv_ptrs_.data());
+                if (!reset_child_(process))
+                    throw std::runtime_error("Error: the pooled process did not complete the handshake");
+                return process;
+            } catch (...) {
+                release_slice_(slice);
+                throw;
+            }
+        }
+        
+        /*
+         With Placement::spread, spread_cpus_ is cut in slices of per_slice_ cpus, and slice_children_ counts
+         the children on each one. A new child takes the slice with the fewest, so a replacement gets the
+         slice of the child that died rather than doubling up on one still in use.
+         Only the constructor and then the maintenance thread spawn and drop children, no lock needed.
+         */
+        size_t take_slice_()
+        {
+            if (slice_children_.empty()) return SIZE_MAX;
+            const auto slice = std::min_element(slice_children_.begin(), slice_children_.end());
+            (*slice)++;
+            return static_cast<size_t>(slice - slice_children_.begin());
+        }
+        
+        void release_slice_(size_t slice)
+        {
+            if (slice < slice_children_.size() && slice_children_[slice] > 0) slice_children_[slice]--;
+        }
+        
+        // a child is gone for good: its slice is free again.
+        void release_slice_(const Process &process)
+        {
+            const std::vector<int> &cpus = process.placement().cpus;
+            if (slice_children_.empty() || cpus.empty()) return;
+            const auto first = std::find(spread_cpus_.begin(), spread_cpus_.end(), cpus.front());
+            release_slice_(static_cast<size_t>(first - spread_cpus_.begin()) / per_slice_);
+        }
+        
+        // the options of the child on slice, and its node.
+        ProcessOptions options_for_slice_(size_t slice)
+        {
+            if (slice == SIZE_MAX) return options_;
+            
+            ProcessOptions options = options_;
+            const auto first = spread_cpus_.begin() + static_cast<std::ptrdiff_t>(slice * per_slice_);
+            options.placement.cpus.assign(first, first + static_cast<std::ptrdiff_t>(per_slice_));
+            if (options.placement.numa_node == -1 && spread_nodes_ > 1)
+                options.placement.numa_node = CpuTopology::node_of(options.placement.cpus.front());
+            return options;
+        }
+        
+        // true if the child is ready to be handed out again.
+        bool reset_child_(Process &process)
+        {
+            try {
+                if (!reset_commands_.empty()) process.send_commands(reset_commands_);
+                if (reset_.expected.empty()) return process.is_alive();
+                return process.read(reset_lines_, reset_.expected, reset_.timeout_ms);
+            } catch (const std::runtime_error &) {
+                return false;
+            }
+        }
+        
+        void maintain_()
+        {
+            std::vector<Process> returned;
+            size_t missing = 0;
+            
+            std::unique_lock lock(mutex_);
+            while (!stopping_)
+            {
+                const bool woken = maintenance_cv_.wait_for(lock, health_check_interval_,
+                                                            [this] { return stopping_ || !returned_.empty(); });
+                if (stopping_) break;
+                
+                if (!woken)
+                {   // periodic check: drop the idle children that died in the meantime.
+                    // (destroying a dead Process only reaps it, this is cheap enough to do under the lock)
+                    for (auto it = idle_.begin(); it != idle_.end();) {
+                        if (it->is_alive()) it++;
+                        else {
+                            release_slice_(*it);
+                            it = idle_.erase(it);
+                            missing++;
+                        }
+                    }
+                }
+                returned.swap(returned_);
+                lock.unlock();
+                
+                // the handshakes and the respawns happen without holding the lock, acquire() is never blocked on them.
+                std::vector<Process> ready;
+                for (auto &process : returned) {
+                    if (reset_child_(process)) ready.push_back(std::move(process));
+                    else {
+                        release_slice_(process);
+                        missing++;
+                    }
+                }
+                returned.clear();
+                
+                while (missing > 0) {
+                    try {
+                        ready.push_back(spawn_());
+                        missing--;
+                    } catch (const std::runtime_error &) {
+                        break; // try again at the next round.
+                    }
+                }
+                
+                lock.lock();
+                for (auto &process : ready) idle_.push_back(std::move(process));
+                if (!ready.empty()) available_cv_.notify_all();
+            }
+        }
+        
+        std::vector<std::string> argv_;
+        std::vector<const char *> argv_ptrs_;
+        size_t size_;
+        ResetHandshake reset_;
+        std::vector<std::string_view> reset_commands_;
+        std::vector<std::string_view> reset_lines_;
+        std::chrono::milliseconds health_check_interval_;
+        ProcessOptions options_;
+        // see take_slice_()
+        std::vector<int> spread_cpus_;
+        size_t spread_nodes_ = 0;
+        size_t per_slice_ = 1;
+        std::vector<size_t> slice_children_;
+        
+        mutable std::mutex mutex_;
+        std::condition_variable available_cv_;
+        std::condition_variable maintenance_cv_;
+        // contiguous, the children are moved in and out of the leases.
+        std::vector<Process> idle_;
+        std::vector<Process> returned_;
+        ShutdownPolicy shutdown_policy_ { .quit_command = {}, .quit_timeout = {}, .terminate_timeout = {} };
+        bool stopping_ = false;
+        std::thread maintenance_;
+    };
+    
+    using ProcessPool = BasicProcessPool<NoMetrics>;
+    
+    /*
+     The Chase-Lev work-stealing deque (with the memory orders of Le et al., "Correct and Efficient
+     Work-Stealing for Weak Memory Models"): its owner pushes and pops at the bottom without any
+     read-modify-write in the common case, while any other thread can steal from the top.
+     It holds pointers, the array grows when it's full, and the old arrays are only freed with
+     the deque, since a thief might still be reading from one.
+     */
+    template <typename T>
+    class WorkStealingDeque
+    {
+    public:
+        explicit WorkStealingDeque(size_t capacity = 256)
+        {
+            arrays_.push_back(std::make_unique<Array>(std::bit_ceil(std::max<size_t>(capacity, 2))));
+            array_.store(arrays_.back().get(), std::memory_order_relaxed);
+        }
+        
+        // owner only
+        void push(T *item)
+        {
+            const int64_t bottom = bottom_.load(std::memory_order_relaxed);
+            const int64_t top = top_.load(std::memory_order_acquire);
+            Array *array = array_.load(std::memory_order_relaxed);
+            if (bottom - top > static_cast<int64_t>(array->capacity) - 1) array = grow_(array, top, bottom);
+            array->put(bottom, item);
+            std::atomic_thread_fence(std::memory_order_release);
+            bottom_.store(bottom + 1, std::memory_order_relaxed);
+        }
+        
+        // owner only, the most recently pushed item, nullptr if empty.
+        T *pop()
+        {
+            const int64_t bottom = bottom_.load(std::memory_order_relaxed) - 1;
+            Array *array = array_.load(std::memory_order_relaxed);
+            bottom_.store(bottom, std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            int64_t top = top_.load(std::memory_order_relaxed);
+            
+            T *item = nullptr;
+            if (top <= bottom) {
+                item = array->get(bottom);
+                if (top == bottom) {
+                    // the last one: race the thieves for it.
+                    if (!top_.compare_exchange_strong(top, top + 1, std::memory_order_seq_cst, std::memory_order_relaxed))
+                        item = nullptr;
+                    bottom_.store(bottom + 1, std::memory_order_relaxed);
+                }
+            } else {
+                bottom_.store(bottom + 1, std::memory_order_relaxed);
+            }
+            return item;
+        }
+        
+        // any thread, the oldest item, nullptr if empty (or if another thief got it first).
+        T *steal()
+        {
+            int64_t top = top_.load(std::memory_order_acquire);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            const int64_t bottom = bottom_.load(std::memory_order_acquire);
+            if (top >= bottom) return nullptr;
+            
+            T *item = array_.load(std::memory_order_acquire)->get(top);
+            if (!top_.compare_exchange_strong(top, top + 1, std::memory_order_seq_cst, std::memory_order_relaxed))
+                return nullptr;
+            return item;
+        }
+        
+        bool empty() const
+        {
+            return bottom_.load(std::memory_order_relaxed) <= top_.load(std::memory_order_relaxed);
+        }
+        
+    private:
+        struct Array
+        {
+            explicit Array(size_t size) : capacity(size), slots(std::make_unique<std::atomic<T *>[]>(size)) {}
+            T *get(int64_t i) const { return slots[static_cast<size_t>(i) & (capacity - 1)].load(std::memory_order_relaxed); }
+            void put(int64_t i, T *item) { slots[static_cast<size_t>(i) & (capacity - 1)].store(item, std::memory_order_relaxed); }
+            
+            size_t capacity;
+            std::unique_ptr<std::atomic<T *>[]> slots;
+        };
+        
+        Array *grow_(Array *array, int64_t top, int64_t bottom)
+        {
+            arrays_.push_back(std::make_unique<Array>(array->capacity * 2));
+            Array *bigger = arrays_.back().get();
+            for (int64_t i = top; i < bottom; i++) bigger->put(i, array->get(i));
+            array_.store(bigger, std::memory_order_release);
+            return bigger;
+        }
+        
+        alignas(64) std::atomic<int64_t> top_ { 0 };
+        alignas(64) std::atomic<int64_t> bottom_ { 0 };
+        std::atomic<Array *> array_ { nullptr };
+        // owner only: all the arrays so far, the current one last.
+        std::vector<std::unique_ptr<Array>> arrays_;
+    };
+    
+    /*
+     Feeds a ProcessPool from any number of threads: every worker checks out one child for its whole life
+     and runs the jobs on it, one at a time, and the results come back as futures.
+     
+     There is no central queue. A job submitted from outside goes to the lock-free inbox of one worker
+     (round robin), the worker moves its inbox into its own WorkStealingDeque, and runs from there.
+     A worker without work steals, first from the other deques and then from the other inboxes, so a burst
+     that landed on an engine stuck in a long search is picked up by the idle ones instead of waiting.
+     An idle worker sleeps on an atomic epoch that every submission bumps.
+     
+     If a job leaves its child dead the worker restarts it before the next job, and if that fails, the next job
+     fails with the error of the restart. The jobs still queued when the scheduler is destroyed are dropped,
+     and their futures report a broken promise.
+     */
+    template <typename Metrics = NoMetrics>
+    class BasicProcessScheduler
+    {
+    public:
+        using Process = BasicProcess<Metrics>;
+        using ProcessPool = BasicProcessPool<Metrics>;
+        
+        // workers is how many children are checked out of the pool, at most its size. They have to be idle now:
+        // we throw rather than wait for children that somebody else leased, and might keep for good.
+        explicit BasicProcessScheduler(ProcessPool &pool, size_t workers = 0)
+        {
+            if (pool.size() == 0) throw std::runtime_error("Error: no process in the pool to schedule on");
+            if (workers == 0 || workers > pool.size()) workers = pool.size();
+            workers_.reserve(workers);
+            for (size_t i = 0; i < workers; i++) {
+                typename ProcessPool::Lease lease = pool.try_acquire();
+                if (!lease) throw std::runtime_error("Error: not enough idle processes in the pool for the scheduler");
+                workers_.push_back(std::make_unique<Worker>(std::move(lease)));
+            }
+            for (size_t i = 0; i < workers; i++)
+                workers_[i]->thread = std::thread([this, i] { work_(i); });
+        }
+        ~BasicProcessScheduler()
+        {
+            stopping_.store(true, std::memory_order_release);
+            epoch_.fetch_add(1, std::memory_order_release);
+            epoch_.notify_all();
+            for (auto &worker : workers_) worker->thread.join();
+            // what nobody got to: the promises are destroyed unfulfilled.
+            for (auto &worker : workers_) {
+                while (Job *job = worker->deque.pop()) delete job;
+                for (Job *job = worker->inbox.exchange(nullptr); job != nullptr;) delete std::exchange(job, job->next);
+            }
+        }
+        BasicProcessScheduler(const BasicProcessScheduler &) = delete;
+        BasicProcessScheduler& operator=(const BasicProcessScheduler &) = delete;
+        
+        // run work(Process &) on whichever child is free first, its result (or exception) goes to the future.
+        template <typename F>
+        auto submit(F &&work) -> std::future<std::invoke_result_t<F &, Process &>>
+        {
+            using Result = std::invoke_result_t<F &, Process &>;
+            auto *job = new TypedJob<std::decay_t<F>, Result>(std::forward<F>(work));
+            std::future<Result> future = job->promise.get_future();
+            
+            Worker &worker = *workers_[next_worker_.fetch_add(1, std::memory_order_relaxed) % workers_.size()];
+            job->next = worker.inbox.load(std::memory_order_relaxed);
+            while (!worker.inbox.compare_exchange_weak(job->next, job, std::memory_order_release,
+                                                       std::memory_order_relaxed)) {}
+            epoch_.fetch_add(1, std::memory_order_release);
+            epoch_.notify_all();
+            return future;
+        }
+        
+        // the usual analysis job: send the commands, and collect the output up to the line starting with expected
+        // (e.g. "bestmove"), within timeout_ms. Throws (through the future) if the line doesn't come.
+        std::future<std::vector<std::string>> submit(std::vector<std::string> commands, std::string expected,
+                                                     int timeout_ms = 0)
+        {
+            return submit([commands = std::move(commands), expected = std::move(expected), timeout_ms](Process &process) {
+                std::vector<std::string_view> views(commands.begin(), commands.end());
+                process.send_commands(views);
+                std::vector<std::string> lines;
+                if (!process.read(lines, expected, timeout_ms, TimeoutMode::deadline))
+                    throw std::runtime_error("Error: the process did not answer with " + expected);
+                return lines;
+            });
+        }
+        
+        size_t workers() const { return workers_.size(); }
+        // how many jobs were run by a worker other than the one they were submitted to.
+        uint64_t stolen() const { return stolen_.load(std::memory_order_relaxed); }
+        
+    private:
+        struct Job
+        {
+            virtual ~Job() = default;
+            virtual void run(Process &process) = 0;
+            // the job can't run, error goes to its future instead.
+            virtual void fail(std::exception_ptr error) = 0;
+            Job *next = nullptr; // in an inbox
+        };
+        
+        template <typename F, typename Result>
+        struct TypedJob final : Job
+        {
+            explicit TypedJob(F &&f) : work(std::move(f)) {}
+            explicit TypedJob(const F &f) : work(f) {}
+            
+            void run(Process &process) override
+            {
+                try {
+                    if constexpr (std::is_void_v<Result>) {
+                        work(process);
+                        promise.set_value();
+                    } else {
+                        promise.set_value(work(process));
+                    }
+                } catch (...) {
+                    promise.set_exception(std::current_exception());
+                }
+            }
+            
+            void fail(std::exception_ptr error) override { promise.set_exception(std::move(error)); }
+            
+            F work;
+            std::promise<Result> promise;
+        };
+        
+        struct Worker
+        {
+            explicit Worker(typename ProcessPool::Lease &&lease) : lease(std::move(lease)) {}
+            
+            typename ProcessPool::Lease lease;
+            WorkStealingDeque<Job> deque;
+            // a Treiber stack the submitters push to. It's only ever emptied as a whole, with an exchange,
+            // so any thread can take it (no ABA without a pop of a single node).
+            alignas(64) std::atomic<Job *> inbox { nullptr };
+            std::thread thread;
+        };
+        
+        // move everything in the inbox of from into the deque of worker (the calling thread's), oldest first.
+        // Returns false if there was nothing.
+        bool take_inbox_(Worker &worker, Worker &from)
+        {
+            Job *job = from.inbox.exchange(nullptr, std::memory_order_acquire);
+            if (!job) return false;
+            // the stack is newest first, and the owner pops from the bottom: push the newest first
+            // so that the oldest is popped first.
+            size_t count = 0;
+            while (job) {
+                Job *next = job->next;
+                worker.deque.push(job);
+                job = next;
+                count++;
+            }
+            if (&worker != &from) stolen_.fetch_add(count, std::memory_order_relaxed);
+            // more than one: the idle workers can steal the rest from our deque now.
+            if (count > 1) {
+                epoch_.fetch_add(1, std::memory_order_release);
+                epoch_.notify_all();
+            }
+            return true;
+        }
+        
+        Job *find_job_(size_t index)
+        {
+            Worker &self = *workers_[index];
+            if (Job *job = self.deque.pop()) return job;
+            if (take_inbox_(self, self)) return self.deque.pop();
+            
+            const size_t count = workers_.size();
+            for (size_t i = 1; i < count; i++) {
+                if (Job *job = workers_[(index + i) % count]->deque.steal()) {
+                    stolen_.fetch_add(1, std::memory_order_relaxed);
+                    return job;
+                }
+            }
+            for (size_t i = 1; i < count; i++) {
+                if (take_inbox_(self, *workers_[(index + i) % count])) return self.deque.pop();
+            }
+            return nullptr;
+        }
+        
+        void work_(size_t index)
+        {
+            Process &process = *workers_[index]->lease;
+            while (!stopping_.load(std::memory_order_acquire))
+            {
+                const uint64_t epoch = epoch_.load(std::memory_order_acquire);
+                Job *job = find_job_(index);
+                if (!job) {
+                    epoch_.wait(epoch, std::memory_order_acquire);
+                    continue;
+                }
+                
+                // a job that killed its child (or found it dead) doesn't take the next one down with it.
+                bool ready = true;
+                if (!process.is_alive()) {
+                    try {
+                        process.restart();
+                    } catch (const std::runtime_error &) {
+                        ready = false;
+                        job->fail(std::current_exception());
+                    }
+                }
+                if (ready) job->run(process);
+                delete job;
+            }
+        }
+        
+        std::vector<std::unique_ptr<Worker>> workers_;
+        std::atomic<size_t> next_worker_ { 0 };
+        std::atomic<uint64_t> epoch_ { 0 };
+        std::atomic<uint64_t> stolen_ { 0 };
+        std::atomic<bool> stopping_ { false };
+    };
+    
+    using ProcessScheduler = BasicProcessScheduler<NoMetrics>;
+    
+    /*
+     Memoizes the answers of deterministic children (a fixed depth search with Threads=1...): the same commands
+     sent to the same engine get the same lines back, without the round-trip.
+     
+     The key is a 128 bit hash of the engine identity (by default its command, plus whatever the caller adds,
+     e.g. the options it was set up with), of the normalized commands (blank runs collapsed, trailing blanks
+     and '\r' dropped) and of the expected line. In memory it's a bounded LRU, split in shards with a mutex
+     each so that the workers of a ProcessScheduler don't all queue on one lock.
+     With open_file() it's also backed by an mmap()ed append-only file, loaded back when it's opened again,
+     so that a restarted service doesn't search the known positions again. The file stops growing once full.
+     */
+    class ResultCache
+    {
+    public:
+        struct Key
+        {
+            uint64_t high = 0;
+            uint64_t low = 0;
+            bool operator==(const Key &) const = default;
+        };
+        
+        // no more shards than entries: each one holds at least one, and together they don't hold more than capacity.
+        explicit ResultCache(size_t capacity = 4096, size_t shards = 16)
+            : shards_(std::clamp<size_t>(shards, 1, std::max<size_t>(capacity, 1))),
+              shard_capacity_(std::max<size_t>(capacity / shards_.size(), 1)) {}
+        ~ResultCache() { close_file_(); }
+        ResultCache(const ResultCache &) = delete;
+        ResultCache& operator=(const ResultCache &) = delete;
+        
+        static Key key(std::string_view identity, std::span<const std::string_view> commands, std::string_view expected)
+        {
+            Hasher hasher;
+            hasher.add(identity);
+            hasher.separator();
+            for (const std::string_view command : commands) {
+                // normalized: what the child can't tell apart must hash the same.
+                // A '\n' inside a command ends a line, the child sees it as two commands.
+                bool blank = false;
+                bool empty = true;
+                for (size_t i = 0; i < command.size(); i++) {
+                    const char c = command[i];
+                    if (c == '\n' && i + 1 < command.size()) {
+                        hasher.separator();
+                        blank = false;
+                        empty = true;
+                        continue;
+                    }
+                    if (c == ' ' || c == '\t' || c == '\r' || c == '\n') {
+                        blank = true;
+                        continue;
+                    }
+                    if (blank && !empty) hasher.add(' ');
+                    hasher.add(c);
+                    blank = false;
+                    empty = false;
+                }
+                hasher.separator();
+            }
+            hasher.add(expected);
+            return hasher.key();
+        }
+        
+        std::optional<std::vector<std::string>> find(const Key &key)
+        {
+            Shard &shard = shard_of_(key);
+            std::lock_guard lock(shard.mutex);
+            auto it = shard.index.find(key);
+            if (it == shard.index.end()) {
+                shard.misses++;
+                return std::nullopt;
+            }
+            shard.hits++;
+            // most recently used at the front.
+            shard.entries.splice(shard.entries.begin(), shard.entries, it->second);
+            return it->second->lines;
+        }
+        
+        void insert(const Key &key, std::vector<std::string> lines)
+        {
+            append_to_file_(key, lines);
+            insert_(key, std::move(lines));
+        }
+        
+        // the lines the child answers commands with, up to the one starting with expected, or up to the end of
+        // its output: from the cache if we've seen these commands already, otherwise from the child (and then
+        // they are cached). The key is identity, by default the command and the argv the process was started with.
+        // Returns false, and caches nothing, if the child doesn't answer in time (with an empty expected too:
+        // a read that timed out can't tell a complete answer from a slow one) or closes its output before expected.
+        template <typename Metrics>
+        bool query(BasicProcess<Metrics> &process, std::span<const std::string_view> commands, std::string_view expected,
+                   std::vector<std::string> &out_lines, int timeout_ms = 0, std::string_view identity = {})
+        {
+            std::string command;
+            if (identity.empty()) {
+                command = process.get_command();
+                for (const std::string &arg : process.arguments()) {
+                    command += '\0';
+                    command += arg;
+                }
+            }
+            const Key k = key(identity.empty() ? std::string_view(command) : identity, commands, expected);
+            if (auto cached = find(k)) {
+                out_lines = std::move(*cached);
+                return true;
+            }
+            // read() assigns over the strings already in out_lines, so they aren't cleared up front.
+            const bool sent = process.send_commands(commands);
+            if (sent) process.read(out_lines, expected, timeout_ms, TimeoutMode::deadline);
+            // the end of the output only completes an answer that wasn't expected to end with a line.
+            const ReadStatus status = process.last_read_status();
+            if (!sent || !(status == ReadStatus::matched || (status == ReadStatus::eof && expected.empty()))) {
+                out_lines.clear();
+                return false;
+            }
+            insert(k, out_lines);
+            return true;
+        }
+        
+        /*
+         Back the cache with path, creating it with max_bytes if it doesn't exist or is empty, and load what it has
+         (the newest entries win if there are more than the cache holds). Returns false if the file can't be used,
+         the cache then just stays in memory. A file that isn't one of ours (a different magic or version, or too
+         short for the header) is refused rather than overwritten.
+         
+         Several processes can share the file: we hold an flock() on it while we load it and during each append.
+         On Windows we open it without FILE_SHARE_WRITE instead, so only one process at a time has it, and
+         open_file() fails in the others.
+         
+         Layout: a header (magic, version, bytes used), then records one after the other:
+         key (16 bytes), payload length (4 bytes), the lines joined with '\n'.
+         */
+        bool open_file(const std::string &path, size_t max_bytes = 64 << 20)
+        {
+            close_file_();
+            std::lock_guard lock(file_mutex_);
+#if defined(_WIN32)
+            const HANDLE file = CreateFileA(path.c_str(), GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, nullptr,
+                                            OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+            if (file == INVALID_HANDLE_VALUE) return false;
+            LARGE_INTEGER file_size;
+            if (!GetFileSizeEx(file, &file_size)) {
+                CloseHandle(file);
+                return false;
+            }
+            size_t size = static_cast<size_t>(file_size.QuadPart);
+            const bool created = size == 0;
+            if (created) size = std::max(max_bytes, sizeof(FileHeader) + 4096);
+            else if (size < sizeof(FileHeader)) {
+                CloseHandle(file);
+                return false;
+            }
+            // a mapping larger than the file grows it, zero filled.
+            const HANDLE file_mapping = CreateFileMappingA(file, nullptr, PAGE_READWRITE, static_cast<DWORD>(uint64_t(size) >> 32),
+                                                           static_cast<DWORD>(size), nullptr);
+            void *mapping = file_mapping ? MapViewOfFile(file_mapping, FILE_MAP_ALL_ACCESS, 0, 0, size) : nullptr;
+            if (file_mapping) CloseHandle(file_mapping); // the view keeps it.
+            if (!mapping) {
+                CloseHandle(file);
+                return false;
+            }
+            // kept open, it's what keeps the other writers out.
+            file_handle_ = file;
+#else
+            const int fd = open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+            if (fd == -1) return false;
+            // from here on nobody else creates, loads or appends to the file until we're done with it.
+            struct stat info;
+            if (flock(fd, LOCK_EX) == -1 || fstat(fd, &info) == -1) {
+                close(fd);
+                return false;
+            }
+            size_t size = static_cast<size_t>(info.st_size);
+            const bool created = size == 0;
+            if (created) size = std::max(max_bytes, sizeof(FileHeader) + 4096);
+            if ((!created && size < sizeof(FileHeader)) || (created && ftruncate(fd, static_cast<off_t>(size)) == -1)) {
+                close(fd);
+                return false;
+            }
+            void *mapping = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+            if (mapping == MAP_FAILED) {
+                close(fd);
+                return false;
+            }
+            // kept open for the flock() of the appends.
+            file_fd_ = fd;
+#endif
+            file_ = static_cast<char *>(mapping);
+            file_size_ = size;
+            FileHeader *header = reinterpret_cast<FileHeader *>(file_);
+            if (created) *header = FileHeader { file_magic_, file_version_, sizeof(FileHeader) };
+            else if (header->magic != file_magic_ || header->version != file_version_ || header->used > size ||
+                     header->used < sizeof(FileHeader)) {
+                // not ours, or not anymore: leave it alone.
+                unlock_file_();
+                unmap_file_();
+                return false;
+            }
+            
+            size_t at = sizeof(FileHeader);
+            while (at + record_header_size_ <= header->used) {
+                Key k;
+                uint32_t length;
+                std::memcpy(&k, file_ + at, sizeof(Key));
+                std::memcpy(&length, file_ + at + sizeof(Key), sizeof(length));
+                at += record_header_size_;
+                if (at + length > header->used) break;
+                
+                std::vector<std::string> lines;
+                std::string_view payload(file_ + at, length);
+                while (!payload.empty()) {
+                    const size_t nl = payload.find('\n');
+                    lines.emplace_back(payload.substr(0, nl));
+                    if (nl == std::string_view::npos) break;
+                    payload.remove_prefix(nl + 1);
+                }
+                file_keys_.insert(k);
+                insert_(k, std::move(lines));
+                at += length;
+            }
+            unlock_file_();
+            return true;
+        }
+        
+        uint64_t hits() const { return sum_(&Shard::hits); }
+        uint64_t misses() const { return sum_(&Shard::misses); }
+        
+    private:
+        // FNV-1a, twice with different bases and primes for the two halves of the key.
+        struct Hasher
+        {
+            void add(char c)
+            {
+                high = (high ^ static_cast<unsigned char>(c)) * 0x100000001b3ull;
+                low = (low ^ static_cast<unsigned char>(c)) * 0x00000100000001b3ull * 0x9e3779b97f4a7c15ull;
+            }
+            void add(std::string_view text) { for (const char c : text) add(c); }
+            // a byte that can't be in a line, so that ("ab", "c") and ("a", "bc") don't collide.
+            void separator() { add('\n'); }
+            Key key() const { return { high, low ^ (low >> 29) }; }
+            
+            uint64_t high = 0xcbf29ce484222325ull;
+            uint64_t low = 0x84222325cbf29ce4ull;
+        };
+        
+        struct KeyHash
+        {
+            size_t operator()(const Key &key) const { return static_cast<size_t>(key.low); }
+        };
+        
+        struct Entry
+        {
+            Key key;
+            std::vector<std::string> lines;
+        };
+        
+        struct alignas(64) Shard
+        {
+            mutable std::mutex mutex;
+            std::list<Entry> entries;
+            std::unordered_map<Key, std::list<Entry>::iterator, KeyHash> index;
+            uint64_t hits = 0;
+            uint64_t misses = 0;
+        };
+        
+        struct FileHeader
+        {
+            uint64_t magic;
+            uint32_t version;
+            uint64_t used;
+        };
+        static constexpr uint64_t file_magic_ = 0x6568636163737973ull; // "syscache"
+        static constexpr uint32_t file_version_ = 1;
+        static constexpr size_t record_header_size_ = sizeof(Key) + sizeof(uint32_t);
+        
+        Shard &shard_of_(const Key &key) { return shards_[key.high % shards_.size()]; }
+        
+        void insert_(const Key &key, std::vector<std::string> lines)
+        {
+            Shard &shard = shard_of_(key);
+            std::lock_guard lock(shard.mutex);
+            if (auto it = shard.index.find(key); it != shard.index.end()) {
+                it->second->lines = std::move(lines);
+                shard.entries.splice(shard.entries.begin(), shard.entries, it->second);
+                return;
+            }
+            shard.entries.push_front(Entry { key, std::move(lines) });
+            shard.index.emplace(key, shard.entries.begin());
+            if (shard.entries.size() > shard_capacity_) {
+                shard.index.erase(shard.entries.back().key);
+                shard.entries.pop_back();
+            }
+        }
+        
+        void append_to_file_(const Key &key, const std::vector<std::string> &lines)
+        {
+            std::lock_guard lock(file_mutex_);
+            // the same answer twice would only take room: the first one is what gets loaded anyway.
+            if (!file_ || file_keys_.contains(key)) return;
+            
+            size_t length = 0;
+            for (const auto &line : lines) length += line.size() + 1;
+            if (length > 0) length--; // no '\n' after the last one.
+            if (length > UINT32_MAX) return;
+            // header->used can have moved since the load, if another process appended too.
+            if (!lock_file_()) return;
+            FileHeader *header = reinterpret_cast<FileHeader *>(file_);
+            if (header->used + record_header_size_ + length > file_size_) { // full
+                unlock_file_();
+                return;
+            }
+            
+            char *at = file_ + header->used;
+            const uint32_t length32 = static_cast<uint32_t>(length);
+            std::memcpy(at, &key, sizeof(Key));
+            std::memcpy(at + sizeof(Key), &length32, sizeof(length32));
+            at += record_header_size_;
+            for (size_t i = 0; i < lines.size(); i++) {
+                std::memcpy(at, lines[i].data(), lines[i].size());
+                at += lines[i].size();
+                if (i + 1 < lines.size()) *at++ = '\n';
+            }
+            // only now the record is part of the file: a crash before this line leaves it out.
+            header->used += record_header_size_ + length;
+            unlock_file_();
+            file_keys_.insert(key);
+        }
+        
+        // under file_mutex_: the lock between the processes sharing the file (on Windows there's only ever us).
+        bool lock_file_()
+        {
+#if defined(_WIN32)
+            return true;
+#else
+            return flock(file_fd_, LOCK_EX) == 0;
+#endif
+        }
+        void unlock_file_()
+        {
+#if !defined(_WIN32)
+            flock(file_fd_, LOCK_UN);
+#endif
+        }
+        
+        // under file_mutex_
+        void unmap_file_()
+        {
+#if defined(_WIN32)
+            if (file_) UnmapViewOfFile(file_);
+            if (file_handle_) CloseHandle(file_handle_);
+            file_handle_ = nullptr;
+#else
+            if (file_) munmap(file_, file_size_);
+            if (file_fd_ != -1) close(file_fd_);
+            file_fd_ = -1;
+#endif
+            file_ = nullptr;
+            file_size_ = 0;
+            file_keys_.clear();
+        }
+        
+        void close_file_()
+        {
+            std::lock_guard lock(file_mutex_);
+            unmap_file_();
+        }
+        
+        uint64_t sum_(uint64_t Shard::*counter) const
+        {
+            uint64_t total = 0;
+            for (const Shard &shard : shards_) {
+                std::lock_guard lock(shard.mutex);
+                total += shard.*counter;
+            }
+            return total;
+        }
+        
+        std::vector<Shard> shards_;
+        size_t shard_capacity_;
+        std::mutex file_mutex_;
+#if defined(_WIN32)
+        HANDLE file_handle_ = nullptr;
+#else
+        int file_fd_ = -1;
+#endif
+        char *file_ = nullptr;
+        size_t file_size_ = 0;
+        // the keys in the file (as far as we know: we don't see what other processes append after the load).
+        std::unordered_set<Key, KeyHash> file_keys_;
+    };
+    
+#if !defined(_WIN32)
+    /*
+     Several children chained like a shell pipeline, `pgn-extract | filter | engine-batch`: the standard output
+     of each stage is a pipe straight into the standard input of the next one, so what goes from one stage
+     to the next never comes through us, not even through a splice(). We only hold the input of the first
+     stage and the output of the last one: front().send_command() and back().read() work as on any Process.
+     The stages in between can only be watched (is_alive(), exit_status()) and stopped.
+     As in a shell, the end of the input is what ends a pipeline, see close_input(). And as in a shell,
+     if nobody reads the last stage the pipes fill up, and sending to the first one eventually blocks:
+     read back() from another thread, or use Backpressure::fail and alternate.
+     */
+    class Pipeline
+    {
+    public:
+        // one argv per stage, starting with the path of its executable. Every stage gets the options,
+        // their pipe_size also applies to the pipes between the stages.
+        explicit Pipeline(std::vector<std::vector<std::string>> stages, const ProcessOptions &options = {})
+            : commands_(std::move(stages)), pipe_size_(options.pipe_size)
+        {
+            if (commands_.empty()) throw std::runtime_error("Error: a pipeline needs at least one stage");
+            stages_.reserve(commands_.size());
+            for (const auto &command : commands_) {
+                if (command.empty()) throw std::runtime_error("Error: a pipeline stage needs a command");
+                stages_.emplace_back(command.front(), options);
+            }
+        }
+        
+        // spawn the stages from the first one. If one of them fails to start, the others are killed.
+        void start()
+        {
+            if (is_alive()) throw std::runtime_error("Error: the pipeline is already running");
+            
+            int input = -1; // the read end of the pipe from the stage before.
+            try {
+                std::vector<const char *> argv;
+                for (size_t i = 0; i < stages_.size(); i++) {
+                    int link[2] = { -1, -1 };
+                    if (i + 1 < stages_.size()) {
+                        if (!Process::open_pipe_(link)) throw std::runtime_error("Error: failed to create the pipes");
+#if defined(F_SETPIPE_SZ)
+                        if (pipe_size_ > 0) fcntl(link[0], F_SETPIPE_SZ, static_cast<int>(pipe_size_));
+#endif
+                    }
+                    argv.clear();
+                    for (const auto &arg : commands_[i]) argv.push_back(arg.c_str());
+                    argv.push_back(nullptr);
+                    
+                    try {
+                        stages_[i].start_(argv.data(), input, link[1]);
+                    } catch (...) {
+                        for (int fd : link) if (fd != -1) close(fd);
+                        throw;
+                    }
+                    // the children have their copies now, ours would keep the pipes from ever reaching EOF.
+                    if (input != -1) close(input);
+                    if (link[1] != -1) close(link[1]);
+                    input = link[0];
+                }
+            } catch (...) {
+                if (input != -1) close(input);
+                for (Process &stage : stages_) stage.kill_();
+                throw;
+            }
+        }
+        
+        // a stage can't be respawned on its own, the stages around it hold the ends of the old pipes:
+        // after a crash, the whole pipeline starts over.
+        void restart(const ShutdownPolicy &policy = { .quit_command = {} })
+        {
+            shutdown(policy);
+            start();
+        }
+        
+        Process &front() { return stages_.front(); }
+        Process &back() { return stages_.back(); }
+        Process &operator[](size_t stage) { return stages_[stage]; }
+        size_t size() const { return stages_.size(); }
+        
+        // true while any of the stages is running.
+        bool is_alive()
+        {
+            return std::any_of(stages_.begin(), stages_.end(), [](Process &stage) { return stage.is_alive(); });
+        }
+        
+        // EOF for the first stage, see Process::close_input(). The others get theirs as the stages before them exit.
+        bool close_input(int timeout_ms = -1) { return front().close_input(timeout_ms); }
+        
+        /*
+         The quit step of a pipeline is the end of its input (after policy.quit_command, if any, was sent to
+         the first stage): within policy.quit_timeout the stages should wind down one after the other.
+         Then whichever stages are left get SIGTERM and SIGKILL, all at once, see Process::shutdown_all().
+         */
+        std::vector<ShutdownStep> shutdown(const ShutdownPolicy &policy = { .quit_command = {} })
+        {
+            std::vector<ShutdownStep> steps(stages_.size(), ShutdownStep::not_running);
+            std::vector<bool> running(stages_.size());
+            std::vector<const ChildState *> states;
+            for (size_t i = 0; i < stages_.size(); i++) {
+                running[i] = stages_[i].is_alive();
+                if (running[i]) states.push_back(stages_[i].child_state_.get());
+            }
+            if (states.empty()) return steps;
+            
+            // the queue gets the quit timeout too: we don't read the last stage meanwhile, and if it's stuck
+            // writing, the first stage might never take it all.
+            const auto deadline = std::chrono::steady_clock::now() + policy.quit_timeout;
+            Process &first = stages_.front();
+            // the quit command is queued, or dropped if it doesn't fit, but never waited for.
+            const Backpressure backpressure = std::exchange(first.backpressure_, Backpressure::fail);
+            try {
+                if (!policy.quit_command.empty() && running[0]) first.send_command(policy.quit_command);
+                first.close_input(static_cast<int>(policy.quit_timeout.count()));
+            } catch (const std::runtime_error &) {
+                // it can't read anymore: it still gets its EOF, and on to the signals.
+                first.write_queue_.clear();
+                first.write_queue_head_ = 0;
+                if (first.input_open_()) first.close_input_channel_();
+            }
+            first.backpressure_ = backpressure;
+            ChildRegistry::instance().wait_until(states, deadline);
+            
+            std::vector<Process *> left;
+            std::vector<size_t> left_index;
+            for (size_t i = 0; i < stages_.size(); i++) {
+                if (!running[i]) continue;
+                if (!stages_[i].is_alive()) {
+                    steps[i] = ShutdownStep::quit;
+                } else {
+                    left.push_back(&stages_[i]);
+                    left_index.push_back(i);
+                }
+            }
+            const ShutdownPolicy signals { .quit_command = {}, .quit_timeout = {}, .terminate_timeout = policy.terminate_timeout };
+            const std::vector<ShutdownStep> signalled = Process::shutdown_all(left, signals);
+            for (size_t j = 0; j < left.size(); j++) steps[left_index[j]] = signalled[j];
+            return steps;
+        }
+        
+    private:
+        std::vector<std::vector<std::string>> commands_;
+        std::vector<Process> stages_;
+        size_t pipe_size_;
+    };
+#endif
+    
+#if defined(_WIN32)
+    /*
+     The Windows ProcessReactor: the same add()/remove()/run() as with epoll or kqueue, on an I/O completion
+     port. Every process keeps a ReadFile() in flight on its output (and on its standard error), and the port
+     wakes the thread running the reactor up with whichever completed, however many children there are.
+     A completion is only a hint to look at its process: what was read is collected from the process' Io block,
+     so the completions still queued for a process that was removed meanwhile are simply dropped.
+     The writes don't go through the port: the queued ones are pushed on every wakeup, and while some are left
+     the reactor wakes up every millisecond to push the rest. There's no attach() and no awaitables on Windows.
+     */
+    class ProcessReactor
+    {
+    public:
+        using LineCallback = std::function<void(Process &, std::string_view)>;
+        using ExitCallback = std::function<void(Process &)>;
+        
+        ProcessReactor() : port_(CreateIoCompletionPort(INVALID_HANDLE_VALUE, nullptr, 0, 1))
+        {
+            if (!port_) throw std::runtime_error("Error: could not create the reactor");
+        }
+        ~ProcessReactor() noexcept
+        {
+            for (auto &[io, entry] : entries_) io->owner->reactor_ = nullptr;
+            CloseHandle(port_);
+        }
+        ProcessReactor(const ProcessReactor & other)              = delete;
+        ProcessReactor& operator=(const ProcessReactor & other)   = delete;
+        
+        // start dispatching the output of a started process. on_exit is called once the child closes
+        // its output, after the last line, and the process is then removed from the reactor.
+        // A handle can't leave its completion port: until it's restarted, a child can only ever be
+        // serviced by the first reactor it was added to.
+        void add(Process &process, LineCallback on_line, ExitCallback on_exit = {})
+        {
+            Process::Io *io = process.io_.get();
+            if (!io || io->output.handle == INVALID_HANDLE_VALUE)
+                throw std::runtime_error("Error: start the process before adding it to a reactor");
+            if (process.reactor_) throw std::runtime_error("Error: the process is already in a reactor");
+            if (io->port != port_) {
+                if (io->port) throw std::runtime_error("Error: the process was serviced by another reactor");
+                io->port = port_;
+                for (Process::Channel *channel : { &io->output, &io->error })
+                    if (channel->handle != INVALID_HANDLE_VALUE &&
+                        !CreateIoCompletionPort(channel->handle, port_, reinterpret_cast<ULONG_PTR>(io), 0))
+                        throw std::runtime_error("Error: could not register the process with the reactor");
+            }
+            // a read started by read() before the handle was associated might never reach the port: take it back,
+            // the next one (started by the drain below) will.
+            for (Process::Channel *channel : { &io->output, &io->error }) process.settle_(*channel);
+            
+            process.reactor_ = this;
+            entries_[io] = std::make_unique<Entry>(Entry { std::move(on_line), std::move(on_exit) });
+            process.drain_stderr();
+            dispatch_(io);
+        }
+        
+        void remove(Process &process)
+        {
+            Process::Io *io = process.io_.get();
+            auto it = entries_.find(io);
+            if (!io || it == entries_.end()) return;
+            
+            if (it->second->dispatching) {
+                // called from one of its own callbacks, which is still running: dispatch_() lets go of it.
+                it->second->removed = true;
+                retired_.push_back(std::move(it->second));
+            }
+            entries_.erase(it);
+            // the reads in flight can stay: read() waits for them on their events, and the port drops them.
+            process.reactor_ = nullptr;
+        }
+        
+        size_t size() const { return entries_.size(); }
+        
+        // wait at most timeout_ms (-1: forever) for some output and dispatch it.
+        // Returns the number of ready processes that were serviced.
+        size_t run_once(int timeout_ms = -1)
+        {
+            bool writing = false;
+            for (auto &[io, entry] : entries_) {
+                io->owner->flush_queue_quietly_();
+                writing = writing || io->owner->queued_bytes() > 0;
+            }
+            if (writing && (timeout_ms < 0 || timeout_ms > 1)) timeout_ms = 1;
+            
+            OVERLAPPED_ENTRY completions[64];
+            ULONG ready = 0;
+            if (!GetQueuedCompletionStatusEx(port_, completions, 64, &ready,
+                                             timeout_ms < 0 ? INFINITE : static_cast<DWORD>(timeout_ms), FALSE)) {
+                if (GetLastError() != WAIT_TIMEOUT) throw std::runtime_error("Error: the reactor failed to wait for events");
+                ready = 0;
+            }
+            
+            size_t serviced = 0;
+            for (ULONG i = 0; i < ready; i++)
+            {
+                auto *io = reinterpret_cast<Process::Io *>(completions[i].lpCompletionKey);
+                // nullptr is stop(), and the process may have been removed (or destroyed) since.
+                if (!io || entries_.find(io) == entries_.end()) continue;
+                if (completions[i].lpOverlapped == &io->error.overlapped) {
+                    io->owner->drain_stderr();
+                    serviced++;
+                }
+                else if (dispatch_(io)) serviced++;
+            }
+            return serviced;
+        }
+        
+        // dispatch until stop() is called or there is nothing left to service.
+        void run()
+        {
+            stopping_.store(false, std::memory_order_relaxed);
+            while (!stopping_.load(std::memory_order_relaxed) && !entries_.empty())
+                run_once();
+        }
+        
+        void stop()
+        {
+            stopping_.store(true, std::memory_order_relaxed);
+            PostQueuedCompletionStatus(port_, 0, 0, nullptr);
+        }
+    
+    private:
+        struct Entry
+        {
+            LineCallback on_line;
+            ExitCallback on_exit;
+            // on_line is running, and remove() was called meanwhile, see dispatch_().
+            bool dispatching = false;
+            bool removed = false;
+        };
+        
+        // hand out the complete lines. The process is found through its Io block, whose owner follows the moves.
+        bool dispatch_(Process::Io *io)
+        {
+            auto it = entries_.find(io);
+            if (it == entries_.end()) return false;
+            Entry *entry = it->second.get();
+            
+            /*
+             The callbacks are free to remove the process, to destroy it (which removes it, and frees io) or to
+             move it (io->owner follows it). So the drain stops right after the line the callback did it on,
+             without touching io anymore if it was removed. While we're in here remove() leaves the entry to us,
+             and we only let go of it (and of the callback that was running) at the end.
+             */
+            entry->dispatching = true;
+            try {
+                bool open = true;
+                for (Process *process = nullptr; !entry->removed && process != io->owner;) {
+                    process = io->owner;
+                    open = process->drain([entry, io, process](std::string_view line) {
+                        entry->on_line(*process, line);
+                        return entry->removed || io->owner != process;
+                    });
+                }
+                if (!open && !entry->removed) {
+                    Process &closed = *io->owner;
+                    // the child is gone, so is whatever it still had to say on its standard error.
+                    closed.drain_stderr();
+                    // out first: the exit callback is free to destroy the process.
+                    remove(closed);
+                    if (entry->on_exit) entry->on_exit(closed);
+                }
+            } catch (...) {
+                end_dispatch_(entry);
+                throw;
+            }
+            end_dispatch_(entry);
+            return true;
+        }
+        
+        void end_dispatch_(Entry *entry)
+        {
+            entry->dispatching = false;
+            if (!entry->removed) return;
+            const auto retired = std::find_if(retired_.begin(), retired_.end(), [entry](const auto &e) { return e.get() == entry; });
+            retired_.erase(retired);
+        }
+        
+        HANDLE port_ = nullptr;
+        std::atomic<bool> stopping_ = false;
+        // by the Io block of their process. On the heap, so that an entry outlives its removal during its own callback.
+        std::unordered_map<Process::Io *, std::unique_ptr<Entry>> entries_;
+        std::vector<std::unique_ptr<Entry>> retired_;
+    };
+#else
+    // An operation suspended in a ProcessReactor until its process' pipe is ready (or its timer fires).
+    class IoWaiter
+    {
+    public:
+        IoWaiter() = default;
+        virtual ~IoWaiter() = default;
+        // the reactor holds on to our address while we're suspended.
+        IoWaiter(const IoWaiter & other)              = delete;
+        IoWaiter& operator=(const IoWaiter & other)   = delete;
+        
+    protected:
+        friend class ProcessReactor;
+        
+        // try to complete the operation without blocking, true once it's done and the coroutine can resume.
+        virtual bool try_complete() = 0;
+        // the deadline passed before the operation could complete.
+        virtual void time_out() {}
+        
+        // errors raised while the reactor drives the operation travel back to the coroutine.
+        bool poll_() noexcept
+        {
+            try {
+                return try_complete();
+            } catch (...) {
+                error_ = std::current_exception();
+                return true;
+            }
+        }
+        void rethrow_if_failed_() const
+        {
+            if (error_) std::rethrow_exception(error_);
+        }
+        
+        std::coroutine_handle<> handle_ {};
+        std::exception_ptr error_ {};
+        bool has_timer_ = false;
+        std::multimap<std::chrono::steady_clock::time_point, IoWaiter *>::iterator timer_ {};
+    };
+    
+    /*
+     Services the output of many Process objects from a single thread, using epoll on Linux and
+     kqueue on macOS/BSD, instead of one thread blocked in read() per child.
+     
+     The pipes are switched to non-blocking mode and registered edge-triggered. A process can be
+     registered in two ways:
+     -add(): every time the output becomes readable we drain it completely and dispatch each
+      complete line to the callback registered for that process. Whenever the input becomes
+      writable again, the write queue of the process is flushed.
+      A captured standard error is drained into its own callback, see Process::set_stderr_callback().
+      The callbacks may remove their process, destroy it or move it, the next line then goes where it went.
+     -attach(): the process is driven by the awaitables returned by read_line()/read_until()/send(),
+      and the reactor resumes the suspended coroutine when the pipe it waits on is ready.
+     run()/run_once() are meant to be called from one thread at a time, and add()/attach()/remove()
+     either from that same thread (e.g. inside a callback or a coroutine) or while the reactor isn't
+     running. To use more cores, split the processes across several reactors. stop() can be called
+     from anywhere.
+     */
+    class ProcessReactor
+    {
+    public:
+        using LineCallback = std::function<void(Process &, std::string_view)>;
+        using ExitCallback = std::function<void(Process &)>;
+        
+        ProcessReactor()
+        {
+#if defined(__linux__)
+            poller_fd_ = epoll_create1(EPOLL_CLOEXEC);
+#else
+            poller_fd_ = kqueue();
+#endif
+            if (poller_fd_ == -1) throw std::runtime_error("Error: could not create the reactor");
+            
+            // self-pipe to wake up the reactor from other threads.
+            if (pipe(wake_pipe_) == -1) {
+                close(poller_fd_);
+                throw std::runtime_error("Error: could not create the reactor wake up pipe");
+            }
+            for (int fd : wake_pipe_) {
+                fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+                fcntl(fd, F_SETFD, FD_CLOEXEC);
+            }
+            watch_(wake_pipe_[0], false);
+        }
+        ~ProcessReactor() noexcept
+        {
+            for (auto &[fd, entry] : entries_) entry->process->reactor_ = nullptr;
+            close(poller_fd_);
+            close(wake_pipe_[0]);
+            close(wake_pipe_[1]);
+        }
+        ProcessReactor(const ProcessReactor & other)              = delete;
+        ProcessReactor& operator=(const ProcessReactor & other)   = delete;
+        
+        // start dispatching the output of a started process. on_exit is called once the child closes
+        // its output, after the last line, and the process is then removed from the reactor.
+        void add(Process &process, LineCallback on_line, ExitCallback on_exit = {})
+        {
+            const int fd = register_(process, std::make_unique<Entry>(Entry { &process, std::move(on_line), std::move(on_exit) }));
+            // the fd might have become readable before we registered it, and with edge-triggered
+            // notifications we'd never hear about that: drain it right away.
+            process.drain_stderr();
+            dispatch_(fd);
+        }
+        
+        // register a started process for the awaitable API (read_line/read_until/send).
+        // Unlike add(), the process stays registered after EOF, until remove().
+        void attach(Process &process)
+        {
+            register_(process, std::make_unique<Entry>(Entry { &process, {}, {} }));
+            // no need to look at the pipes now: an awaitable always tries first, and only waits on EAGAIN.
+            process.drain_stderr();
+        }
+        
+        void remove(Process &process)
+        {
+            const int fd = process.read_fd();
+            auto it = entries_.find(fd);
+            if (it == entries_.end()) return;
+            
+            // whoever is still suspended on this process will never be resumed.
+            for (IoWaiter *waiter : { it->second->reader, it->second->writer })
+                if (waiter) cancel_timer_(waiter);
+            
+            if (it->second->dispatching) {
+                // called from one of its own callbacks, which is still running: dispatch_() lets go of it.
+                it->second->removed = true;
+                retired_.push_back(std::move(it->second));
+            }
+            entries_.erase(it);
+            unwatch_(fd, false);
+            // by the read fd: the input may have been closed since, and its fd reused.
+            for (auto *fds : { &writers_, &errors_ }) {
+                for (auto other = fds->begin(); other != fds->end(); other++) {
+                    if (other->second != fd) continue;
+                    unwatch_(other->first, fds == &writers_);
+                    fds->erase(other);
+                    break;
+                }
+            }
+            process.reactor_ = nullptr;
+        }
+        
+        size_t size() const { return entries_.size(); }
+        
+        // wait at most timeout_ms (-1: forever) for some output and dispatch it, then fire the
+        // expired timers. Returns the number of ready processes that were serviced.
+        size_t run_once(int timeout_ms = -1)
+        {
+            using namespace std::chrono;
+            if (!timers_.empty())
+            {   // don't sleep past the next deadline.
+                const auto until_deadline = ceil<milliseconds>(timers_.begin()->first - steady_clock::now()).count();
+                const int wait = static_cast<int>(std::max<decltype(until_deadline)>(until_deadline, 0));
+                if (timeout_ms < 0 || wait < timeout_ms) timeout_ms = wait;
+            }
+            
+            int ready;
+#if defined(__linux__)
+            epoll_event events[64];
+            do {
+                ready = epoll_wait(poller_fd_, events, 64, timeout_ms);
+            } while (ready == -1 && errno == EINTR);
+#else
+            struct kevent events[64];
+            timespec timeout { timeout_ms / 1000, (timeout_ms % 1000) * 1000000L };
+            do {
+                ready = kevent(poller_fd_, nullptr, 0, events, 64, timeout_ms < 0 ? nullptr : &timeout);
+            } while (ready == -1 && errno == EINTR);
+#endif
+            if (ready == -1) throw std::runtime_error("Error: the reactor failed to wait for events");
+            
+            size_t serviced = 0;
+            for (int i = 0; i < ready; i++)
+            {
+#if defined(__linux__)
+                const int fd = events[i].data.fd;
+#else
+                const int fd = static_cast<int>(events[i].ident);
+#endif
+                if (fd == wake_pipe_[0]) {
+                    char drain[64];
+                    while (::read(fd, drain, sizeof(drain)) > 0) {}
+                    continue;
+                }
+                // looked up by fd every time, since a callback may have removed the process meanwhile.
+                if (auto writer = writers_.find(fd); writer != writers_.end()) {
+                    if (resume_writer_(writer->second)) serviced++;
+                }
+                else if (auto err = errors_.find(fd); err != errors_.end()) {
+                    if (auto entry = entries_.find(err->second); entry != entries_.end()) {
+                        entry->second->process->drain_stderr();
+                        serviced++;
+                    }
+                }
+                else if (dispatch_(fd)) serviced++;
+            }
+            
+            const auto now = steady_clock::now();
+            while (!timers_.empty() && timers_.begin()->first <= now)
+            {
+                IoWaiter *waiter = timers_.begin()->second;
+                cancel_timer_(waiter);
+                // take it out of its process first, then let the coroutine know.
+                for (auto &[fd, entry] : entries_) {
+                    if (entry->reader == waiter) entry->reader = nullptr;
+                    if (entry->writer == waiter) entry->writer = nullptr;
+                }
+                waiter->time_out();
+                waiter->handle_.resume();
+            }
+            return serviced;
+        }
+        
+        // dispatch until stop() is called or there is nothing left to service.
+        void run()
         {
-            // create pipes: populate the two out and in arrays[2] with "piped" fds.
-            if (pipe(out_pipe_) == -1) throw std::runtime_error("Failed to create output pipe");
-            if (pipe(in_pipe_)  == -1) throw std::runtime_error("Failed to create input pipe");
+            stopping_.store(false, std::memory_order_relaxed);
+            while (!stopping_.load(std::memory_order_relaxed) && (!entries_.empty() || !timers_.empty()))
+                run_once();
         }
-        ~Process() noexcept
+        
+        void stop()
         {
-            kill_(child_pid_);
+            stopping_.store(true, std::memory_order_relaxed);
+            const char wake = 1;
+            (void)!::write(wake_pipe_[1], &wake, 1);
         }
-        Process(const Process & other)              = default;
-        Process(Process && other)                   = default;
-        Process& operator=(const Process & other)   = default;
-        Process& operator=(Process && other)        = default;
         
-        std::string get_command() const { return command_; }
+    private:
+        template <typename> friend class BasicProcess;
+        friend class ReadLineAwaiter;
+        friend class ReadUntilAwaiter;
+        friend class SendAwaiter;
+        
+        struct Entry
+        {
+            Process *process;
+            LineCallback on_line;
+            ExitCallback on_exit;
+            // the coroutines suspended on this process, at most one per direction.
+            IoWaiter *reader = nullptr;
+            IoWaiter *writer = nullptr;
+            // on_line is running, and remove() was called meanwhile, see dispatch_().
+            bool dispatching = false;
+            bool removed = false;
+        };
+        
+        // from is now to (see the Process move constructor), or if swapped, they traded places.
+        void relocate_(Process &from, Process &to, bool swapped = false) noexcept
+        {
+            for (auto &[fd, entry] : entries_) {
+                if (entry->process == &from) entry->process = &to;
+                else if (swapped && entry->process == &to) entry->process = &from;
+            }
+        }
         
-        void kill_(pid_t pid)
+        // watch all the pipes of process, returns its read fd, which is the key of its entry.
+        int register_(Process &process, std::unique_ptr<Entry> entry)
         {
+            const int fd = process.read_fd();
+            if (fd == -1) throw std::runtime_error("Error: start the process before adding it to a reactor");
+            if (process.reactor_) throw std::runtime_error("Error: the process is already in a reactor");
+            
+            // the write end too, to flush the write queue (or resume a send) whenever the child makes room.
+            // Either end but the output may be closed already, e.g. after close_input() or for the last stage of a Pipeline.
+            const std::pair<int, bool> pipes[] = { { fd, false }, { process.write_fd(), true }, { process.stderr_fd(), false } };
+            size_t watched = 0;
+            try {
+                for (; watched < std::size(pipes); watched++)
+                    if (pipes[watched].first != -1) watch_(pipes[watched].first, pipes[watched].second);
+            } catch (...) {
+                // nothing of the process stays behind.
+                while (watched-- > 0)
+                    if (pipes[watched].first != -1) unwatch_(pipes[watched].first, pipes[watched].second);
+                throw;
+            }
+            
+            process.set_nonblocking();
+            entries_[fd] = std::move(entry);
+            if (pipes[1].first != -1) writers_[pipes[1].first] = fd;
+            if (pipes[2].first != -1) errors_[pipes[2].first] = fd;
+            process.reactor_ = this;
+            return fd;
+        }
+        
+        // suspend waiter until process is readable (for_write = false) or writable, or until timeout_ms passed.
+        void wait_(Process &process, IoWaiter *waiter, bool for_write, int timeout_ms = -1)
+        {
+            auto it = entries_.find(process.read_fd());
+            if (it == entries_.end()) throw std::runtime_error("Error: the process is not attached to this reactor");
+            
+            IoWaiter *&slot = for_write ? it->second->writer : it->second->reader;
+            if (slot) throw std::runtime_error("Error: there is already a coroutine waiting on this process");
+            slot = waiter;
+            
+            if (timeout_ms >= 0) {
+                waiter->timer_ = timers_.emplace(std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout_ms), waiter);
+                waiter->has_timer_ = true;
+            }
+        }
+        
+        void cancel_timer_(IoWaiter *waiter)
+        {
+            if (!waiter->has_timer_) return;
+            timers_.erase(waiter->timer_);
+            waiter->has_timer_ = false;
+        }
+        
+        // resume the coroutine waiting on `slot` if its operation can now complete.
+        bool resume_(IoWaiter *&slot)
+        {
+            IoWaiter *waiter = slot;
+            if (!waiter->poll_()) return false; // spurious, keep waiting.
+            
+            slot = nullptr;
+            cancel_timer_(waiter);
+            // from here on the coroutine may do anything, including removing the process.
+            waiter->handle_.resume();
+            return true;
+        }
+        
+        bool resume_writer_(int read_fd)
+        {
+            auto it = entries_.find(read_fd);
+            if (it == entries_.end()) return false;
+            if (it->second->writer) return resume_(it->second->writer);
+            
+            // nobody waiting, but there might be something in the write queue.
+            if (it->second->process->queued_bytes() == 0) return false;
+            it->second->process->flush_queue_quietly_();
+            return true;
+        }
+        
+        // drain the fd if it's still registered, true if it was.
+        bool dispatch_(int fd)
+        {
+            auto it = entries_.find(fd);
+            if (it == entries_.end()) return false;
+            
+            Entry *entry = it->second.get();
+            if (!entry->on_line)
+            {   // attached process: the data stays in the pipe until someone awaits it.
+                return entry->reader ? resume_(entry->reader) : false;
+            }
+            
             /*
-             fds will be cleaned up by the OS. And we are exiting, so we don't need to free slots
-             in the process table.
-             
-             Sometimes, child processes exit or are killed, but the kernel will hold on to their exit
-             code until some other process claims it with wait() or waitpid().
-             
-             Using WNOHANG will make wait()/waitpid() non blocking, and will return the child pid if it
-             died or 0 if it didn't.
+             The callbacks are free to remove the process, to destroy it (which removes it) or to move it.
+             So the drain stops right after the line the callback did it on, without touching the process
+             anymore, and carries on with the one it was moved to. While we're in here remove() leaves
+             the entry to us, and we only let go of it (and of the callback that was running) at the end.
              */
-            if (forked_)
-            {  // We actually have at least started the child. We don't care if it died right after
-                // If it crashed or errored out somehow, it will still hang around until another process
-                // waits for it and grabs the leftovers.
-                int status;
-                pid_t r;
-                do {
-                    r = waitpid(pid, &status, WNOHANG);
-                    // repeat if the process was interrupted somehow.
-                } while (r == -1 && errno == EINTR);
-                
-                // the child is still running, so kill it and wait for it to die.
-                if (r == 0) {
-                    kill(pid, SIGKILL);
-                    wait(NULL);
+            entry->dispatching = true;
+            try {
+                bool open = true;
+                for (Process *process = nullptr; !entry->removed && process != entry->process;) {
+                    process = entry->process;
+                    open = process->drain([entry, process](std::string_view line) {
+                        entry->on_line(*process, line);
+                        return entry->removed || entry->process != process;
+                    });
+                }
+                if (!open && !entry->removed) {
+                    // the child is gone, so is whatever it still had to say on its standard error.
+                    entry->process->drain_stderr();
+                    // out first: the exit callback is free to destroy the process.
+                    remove(*entry->process);
+                    if (entry->on_exit) entry->on_exit(*entry->process);
                 }
-                // if r != 0 and -1 the child already exited, we don't care how for now.
+            } catch (...) {
+                end_dispatch_(entry);
+                throw;
             }
+            end_dispatch_(entry);
+            return true;
         }
         
-        bool is_alive()
+        void end_dispatch_(Entry *entry)
         {
-            // If the child died, by calling waitpid on it, we'll clear any remain.
-            // So we need to make sure that if we destruct the process object, when calling
-            // kill we are not accidentally killing another process.
-            int status;
-            pid_t r;
-            do {
-                r = waitpid(child_pid_, &status, WNOHANG);
-                // repeat if the process was interrupted somehow.
-            } while (r == -1 && errno == EINTR);
-            
-            if (r == 0) return true; // child is still alive.
-            else if ( (r == -1 && errno == ECHILD ) || (r == child_pid_) )
+            entry->dispatching = false;
+            if (!entry->removed) return;
+            const auto retired = std::find_if(retired_.begin(), retired_.end(), [entry](const auto &e) { return e.get() == entry; });
+            retired_.erase(retired);
+        }
+        
+        void watch_(int fd, bool for_write)
+        {
+#if defined(__linux__)
+            epoll_event event {};
+            event.events = (for_write ? EPOLLOUT : EPOLLIN) | EPOLLET;
+            event.data.fd = fd;
+            const int r = epoll_ctl(poller_fd_, EPOLL_CTL_ADD, fd, &event);
+#else
+            struct kevent event;
+            EV_SET(&event, fd, for_write ? EVFILT_WRITE : EVFILT_READ, EV_ADD | EV_CLEAR, 0, 0, nullptr);
+            const int r = kevent(poller_fd_, &event, 1, nullptr, 0, nullptr);
+#endif
+            if (r == -1) throw std::runtime_error("Error: could not register the fd with the reactor");
+        }
+        
+        void unwatch_(int fd, bool for_write)
+        {
+#if defined(__linux__)
+            (void)for_write;
+            epoll_ctl(poller_fd_, EPOLL_CTL_DEL, fd, nullptr);
+#else
+            struct kevent event;
+            EV_SET(&event, fd, for_write ? EVFILT_WRITE : EVFILT_READ, EV_DELETE, 0, 0, nullptr);
+            kevent(poller_fd_, &event, 1, nullptr, 0, nullptr);
+#endif
+        }
+        
+        int poller_fd_ = -1;
+        int wake_pipe_[2];
+        std::atomic<bool> stopping_ = false;
+        // by the read fd of their process. On the heap, so that an entry outlives its removal during its own callback.
+        std::unordered_map<int, std::unique_ptr<Entry>> entries_;
+        std::vector<std::unique_ptr<Entry>> retired_;
+        // write fd -> read fd of the registered processes.
+        std::unordered_map<int, int> writers_;
+        // stderr fd -> read fd, for the processes that capture it.
+        std::unordered_map<int, int> errors_;
+        std::multimap<std::chrono::steady_clock::time_point, IoWaiter *> timers_;
+    };
+    
+    /*
+     Minimal coroutine type to run the awaitables below: it starts right away, runs until its first
+     suspension and from there on it's resumed by the reactor. Fire and forget, the frame destroys
+     itself once the coroutine returns.
+     ```
+     System::Task analyse(System::Process &engine)
+     {
+         co_await engine.send("go depth 20");
+         auto bestmove = co_await engine.read_until("bestmove", 10000);
+     }
+     ```
+     */
+    struct Task
+    {
+        struct promise_type
+        {
+            Task get_return_object() noexcept { return {}; }
+            std::suspend_never initial_suspend() noexcept { return {}; }
+            std::suspend_never final_suspend() noexcept { return {}; }
+            void return_void() noexcept {}
+            void unhandled_exception() noexcept { std::terminate(); }
+        };
+    };
+    
+    class ReadLineAwaiter : public IoWaiter
+    {
+    public:
+        explicit ReadLineAwaiter(Process &process) : process_(process) {}
+        
+        bool await_ready() { return try_complete(); }
+        void await_suspend(std::coroutine_handle<> handle)
+        {
+            handle_ = handle;
+            reactor_of_(process_).wait_(process_, this, false);
+        }
+        std::optional<std::string_view> await_resume() const
+        {
+            rethrow_if_failed_();
+            return line_;
+        }
+        
+    protected:
+        static ProcessReactor &reactor_of_(Process &process)
+        {
+            if (!process.reactor_) throw std::runtime_error("Error: the process is not attached to a reactor");
+            return *process.reactor_;
+        }
+        
+        bool try_complete() override
+        {
+            std::string_view line;
+            const int r = process_.try_next_line_(line);
+            if (r == 1) line_ = line;
+            return r != 0;
+        }
+        
+        Process &process_;
+        std::optional<std::string_view> line_ {};
+    };
+    
+    class ReadUntilAwaiter : public ReadLineAwaiter
+    {
+    public:
+        ReadUntilAwaiter(Process &process, std::string_view prefix, int timeout_ms)
+            : ReadLineAwaiter(process), prefix_(prefix), timeout_ms_(timeout_ms <= 0 ? MAX_TIMEOUT_MS : timeout_ms) {}
+        
+        void await_suspend(std::coroutine_handle<> handle)
+        {
+            handle_ = handle;
+            reactor_of_(process_).wait_(process_, this, false, timeout_ms_);
+        }
+        
+    protected:
+        bool try_complete() override
+        {
+            std::string_view line;
+            for (;;)
             {
-                // there is no child process to wait, or it crashed/exited/terminated otherwise.
-                // all it means is that we no longer have a forked process to talk to.
-                // so reset to the starting state.
-                // (no need to close the fd, since they will be used again on another eventual fork)
-                forked_ = false;
-                child_pid_ = 0;
-                return false;
+                const int r = process_.try_next_line_(line);
+                if (r == 0) return false;
+                if (r == -1) return true;
+                // check if the current line starts with the expected string. If it does, stop here.
+                if (line.starts_with(prefix_)) {
+                    line_ = line;
+                    return true;
+                }
+            }
+        }
+        void time_out() override { line_.reset(); }
+        
+        std::string_view prefix_;
+        int timeout_ms_;
+    };
+    
+    class SendAwaiter : public IoWaiter
+    {
+    public:
+        SendAwaiter(Process &process, std::string_view command) : process_(process)
+        {
+            static const char newline = '\n';
+            if (!command.empty()) iov_[count_++] = { const_cast<char *>(command.data()), command.size() };
+            if (command.empty() || command.back() != '\n') iov_[count_++] = { const_cast<char *>(&newline), 1 };
+        }
+        
+        bool await_ready() { return try_complete(); }
+        void await_suspend(std::coroutine_handle<> handle)
+        {
+            handle_ = handle;
+            if (!process_.reactor_) throw std::runtime_error("Error: the process is not attached to a reactor");
+            process_.reactor_->wait_(process_, this, true);
+        }
+        void await_resume() const { rethrow_if_failed_(); }
+        
+    protected:
+        // anything still in the write queue has to go out before we do.
+        bool try_complete() override { return process_.flush() && process_.write_some_(next_, count_); }
+        
+        Process &process_;
+        iovec iov_[2];
+        iovec *next_ = iov_;
+        size_t count_ = 0;
+    };
+    
+    template <typename Metrics>
+    ReadLineAwaiter BasicProcess<Metrics>::read_line() requires std::is_same_v<Metrics, NoMetrics>
+    {
+        return ReadLineAwaiter(*this);
+    }
+    template <typename Metrics>
+    ReadUntilAwaiter BasicProcess<Metrics>::read_until(std::string_view prefix, int timeout_ms)
+        requires std::is_same_v<Metrics, NoMetrics>
+    {
+        return ReadUntilAwaiter(*this, prefix, timeout_ms);
+    }
+    template <typename Metrics>
+    SendAwaiter BasicProcess<Metrics>::send(std::string_view command) requires std::is_same_v<Metrics, NoMetrics>
+    {
+        return SendAwaiter(*this, command);
+    }
+#endif
+    
+    template <typename Metrics>
+    BasicProcess<Metrics>::~BasicProcess() noexcept
+    {
+        // e.g. from one of the reactor's callbacks: it must forget about us first.
+        // (Only a Process can be in a reactor, the others never get a reactor_.)
+        if constexpr (std::is_same_v<Metrics, NoMetrics>) {
+            if (reactor_) reactor_->remove(*this);
+        }
+        kill_();
+#if defined(_WIN32)
+        close_pipes_();
+        if (process_) CloseHandle(process_);
+#else
+        close_mirror_pipe_();
+        close_pipes_();
+#endif
+    }
+    
+    // no allocation here: the buffers and queues are handed over, not copied, and the fds are swapped with -1.
+    template <typename Metrics>
+    BasicProcess<Metrics>::BasicProcess(BasicProcess &&other) noexcept
+        : command_(std::move(other.command_)),
+#if defined(_WIN32)
+          io_(std::move(other.io_)),
+          process_(std::exchange(other.process_, nullptr)),
+          chunk_size_(other.chunk_size_),
+#endif
+          forked_(std::exchange(other.forked_, false)),
+          child_pid_(std::exchange(other.child_pid_, 0)),
+          read_buffer_(std::move(other.read_buffer_)),
+          line_spans_(std::move(other.line_spans_)),
+          spare_lines_(std::move(other.spare_lines_)),
+          write_iov_(std::move(other.write_iov_)),
+          nonblocking_(other.nonblocking_),
+          write_queue_(std::move(other.write_queue_)),
+          write_queue_head_(std::exchange(other.write_queue_head_, 0)),
+          write_queue_limit_(other.write_queue_limit_),
+          backpressure_(other.backpressure_),
+          max_buffered_output_(other.max_buffered_output_),
+          io_stats_(other.io_stats_),
+          metrics_(other.metrics_),
+          read_eof_(other.read_eof_),
+          stderr_mode_(other.stderr_mode_),
+          err_eof_(other.err_eof_),
+          err_buffer_(std::move(other.err_buffer_)),
+          on_stderr_line_(std::move(other.on_stderr_line_)),
+          last_read_status_(other.last_read_status_),
+#if !defined(_WIN32)
+          mirror_fd_(std::exchange(other.mirror_fd_, -1)),
+#endif
+          reactor_(std::exchange(other.reactor_, nullptr)),
+#if !defined(_WIN32)
+          shared_channel_(std::move(other.shared_channel_)),
+          child_state_(std::move(other.child_state_)),
+#endif
+          pipe_size_(other.pipe_size_),
+          shared_memory_size_(other.shared_memory_size_),
+          pseudo_terminal_(other.pseudo_terminal_),
+          placement_(std::move(other.placement_)),
+          argv_(std::move(other.argv_)),
+          argv_ptrs_(std::move(other.argv_ptrs_))
+    {
+#if defined(_WIN32)
+        // the kernel only knows about the Io block, which stays where it is: only its owner changes.
+        if (io_) io_->owner = this;
+#else
+        for (int i = 0; i < 2; i++) {
+            out_pipe_[i] = std::exchange(other.out_pipe_[i], -1);
+            in_pipe_[i] = std::exchange(other.in_pipe_[i], -1);
+            err_pipe_[i] = std::exchange(other.err_pipe_[i], -1);
+            mirror_pipe_[i] = std::exchange(other.mirror_pipe_[i], -1);
+        }
+        if constexpr (std::is_same_v<Metrics, NoMetrics>) {
+            if (reactor_) reactor_->relocate_(other, *this);
+        }
+#endif
+    }
+    
+    template <typename Metrics>
+    void BasicProcess<Metrics>::swap(BasicProcess &other) noexcept
+    {
+        using std::swap;
+        swap(command_, other.command_);
+#if defined(_WIN32)
+        swap(io_, other.io_);
+        swap(process_, other.process_);
+        swap(chunk_size_, other.chunk_size_);
+#else
+        swap(out_pipe_, other.out_pipe_);
+        swap(in_pipe_, other.in_pipe_);
+#endif
+        swap(forked_, other.forked_);
+        swap(child_pid_, other.child_pid_);
+        swap(read_buffer_, other.read_buffer_);
+        swap(line_spans_, other.line_spans_);
+        swap(spare_lines_, other.spare_lines_);
+        swap(write_iov_, other.write_iov_);
+        swap(nonblocking_, other.nonblocking_);
+        swap(write_queue_, other.write_queue_);
+        swap(write_queue_head_, other.write_queue_head_);
+        swap(write_queue_limit_, other.write_queue_limit_);
+        swap(backpressure_, other.backpressure_);
+        swap(max_buffered_output_, other.max_buffered_output_);
+        swap(io_stats_, other.io_stats_);
+        swap(metrics_, other.metrics_);
+        swap(read_eof_, other.read_eof_);
+        swap(stderr_mode_, other.stderr_mode_);
+        swap(err_eof_, other.err_eof_);
+        swap(err_buffer_, other.err_buffer_);
+        swap(on_stderr_line_, other.on_stderr_line_);
+        swap(last_read_status_, other.last_read_status_);
+        swap(reactor_, other.reactor_);
+#if !defined(_WIN32)
+        swap(err_pipe_, other.err_pipe_);
+        swap(mirror_fd_, other.mirror_fd_);
+        swap(mirror_pipe_, other.mirror_pipe_);
+        swap(shared_channel_, other.shared_channel_);
+        swap(child_state_, other.child_state_);
+#endif
+        swap(pipe_size_, other.pipe_size_);
+        swap(shared_memory_size_, other.shared_memory_size_);
+        swap(pseudo_terminal_, other.pseudo_terminal_);
+        swap(placement_, other.placement_);
+        swap(argv_, other.argv_);
+        swap(argv_ptrs_, other.argv_ptrs_);
+#if defined(_WIN32)
+        if (io_) io_->owner = this;
+        if (other.io_) other.io_->owner = &other;
+#else
+        // each reactor now has to find the other object.
+        if constexpr (std::is_same_v<Metrics, NoMetrics>) {
+            if (reactor_ == other.reactor_) {
+                if (reactor_) reactor_->relocate_(other, *this, true);
             } else {
-                throw std::runtime_error("Error: waitpid() failed");
+                if (reactor_) reactor_->relocate_(other, *this);
+                if (other.reactor_) other.reactor_->relocate_(*this, other);
             }
         }
+#endif
+    }
+    
+    /*
+     UCI protocol layer.
+     
+     The parser works on the views handed out by read_each(): numbers go through std::from_chars,
+     moves are packed in 16 bits, and every field lands in a struct that is reused line after line.
+     Following a search doesn't allocate, however many info lines the engine prints.
+     */
+    
+    // A move in UCI long algebraic notation ("e2e4", "e7e8q"), packed as from (6) | to (6) | promotion (4).
+    struct UciMove
+    {
+        uint16_t data = 0; // 0 is the null move, "0000"
         
-        pid_t start(const char * const argv[])
+        static constexpr uint16_t make(int from, int to, int promotion = 0)
         {
+            return static_cast<uint16_t>(from | (to << 6) | (promotion << 12));
+        }
+        int from() const { return data & 0x3F; }
+        int to() const { return (data >> 6) & 0x3F; }
+        // 0: none, 1-4: knight, bishop, rook, queen.
+        int promotion() const { return data >> 12; }
+        bool is_null() const { return data == 0; }
+        bool operator==(const UciMove &other) const = default;
+        
+        // false if text is not a move, out is left untouched then.
+        static bool parse(std::string_view text, UciMove &out)
+        {
+            if (text == "0000") { out.data = 0; return true; }
+            if (text.size() != 4 && text.size() != 5) return false;
             
-            /*
-             * fork creates a new process, the process is an exact copy of the parent process, except:
-             * -child has unique PID, different from the parent
-             * -child has copy of parent descriptors, which reference the same objects
-             * when sucessfully completed fork() returns a value of 0 to the child and the pid to the parent
-             */
-            pid_t process_p = fork();
-            /*
-             *   |------- p_parent space -----------|        |-------------- p_child space ---------|
-             *   |       any  -> | out[1] (write)   |   ->   |    out[0] (read)  | (dup2) -> STDIN  |
-             *   |       any  <- | in[0] (read)     |   <-   |    in[1] (write)  | (dup2) <- STDOUT |
-             *                                        pipe's
-             *                   | out[0] (unused)    space       out[1] (unused)|
-             *                   | in[1] (unused)                 in[0] (unused) |
-             *                   |_______________________________________________|
-             * Each process has it's own copy of file descriptors which point to the same underlaying
-             * object! But the parent and the child only use some of those file descriptors. So:
-             * -In the parent, close out[0] and in[1] (the child space's fds)
-             * -In the child, close out[1] and in[0] (the parent space's fd)
-             */
+            const auto square = [](char file, char rank) {
+                return (file < 'a' || file > 'h' || rank < '1' || rank > '8') ? -1 : (rank - '1') * 8 + (file - 'a');
+            };
+            const int from = square(text[0], text[1]);
+            const int to = square(text[2], text[3]);
+            if (from < 0 || to < 0) return false;
             
-            if (process_p)
-            { // parent process
-                std::cout << "Starting process with PID: " << process_p << '\n';
-                
-                // close the copy of fds used by the child, but held by the parent.
-                close(out_pipe_[0]);
-                close(in_pipe_[1]);
-                
-                child_pid_ = process_p;
-                forked_ = true;
-                
-            }
-            else
-            { // child process
-                // ignore the interrupt signals in the child process, the parent process will handle it.
-                signal(SIGINT, SIG_IGN);
-                
-                // close the copy of the fds used by the parent, but held by the child
-                if (close(out_pipe_[1]) == -1)
-                    throw std::runtime_error("[child] failed to close outpipe");
-                if (close(in_pipe_[0]) == -1)
-                    throw std::runtime_error("[child] failed to close inpipe");
-                
-                // redirect the child's stdinput to the read end of the output pipe
-                // the messages generated by the parent are passed on to the child as input.
-                if (dup2(out_pipe_[0], STDIN_FILENO) == -1)
-                    throw std::runtime_error("[child] failed to map STDIN to parent's outpipe");
-                // then close the matched fd, since STDIN now points to the file.
-                if (close(out_pipe_[0]) == -1)
-                    throw std::runtime_error("[child] failed to close mapped outpipe");
-                
-                // redirect the child's stdoutput to the write end of the output pipe.
-                // the messages generated by the child are mirrored to the parent's output.
-                if (dup2(in_pipe_[1], STDOUT_FILENO) == -1)
-                    throw std::runtime_error("[child] failed to map STDOUT to parent's inpipe");
-                // then close the matched fd, since STDOUT now points to the file.
-                if (close(in_pipe_[1]) == -1)
-                    throw std::runtime_error("[child] failed to close mapped inpipe");
-                
-                /*
-                 See https://developer.apple.com/forums/thread/738796
-                 and https://developer.apple.com/forums/thread/737464?answerId=764686022#764686022
-                 
-                 exec*'ing proves to be quite a hairy ball in macOS. In this case
-                 the debugger complaints since `ls` is a platform binary (what is that?)
-                 and therefore can't be debugged.
-                 ```
-                 char *args[] = {"/bin/ls", "-r", "-t", "-l", (char *) 0 };
-                 execv(args[0], args);
-                 ```
-                 !! This code still works correctly when started from a regular shell !!
-                 !! It only has issue when running within the macOS developing framework !!
-                 */
-                
-                /*
-                 For now, hardcode the stockfish path for this machine, in the future
-                 it should be passed as an argument, like so: $> ./line_sharpness $(which engine) position_fen
-                 
-                 Alternatively it could be obtained from within the program itself:
-                 ```
-                 const char * args[] = {"/bin/sh", "-c", "which stockfish", NULL};
-                 execv(args[0], const_cast<char * const *>(args));
-                 ```
-                 */
-                
-                
-                // the first argument is the path of the executable.
-                if (execv(command_.c_str(), const_cast<char * const *>(argv)) == -1)
-                {
-                    std::string err_str {"[child] failed to start process with error code: "};
-                    err_str.append(std::to_string(errno));
-                    throw std::runtime_error(err_str);
+            int promotion = 0;
+            if (text.size() == 5) {
+                switch (text[4]) {
+                    case 'n': promotion = 1; break;
+                    case 'b': promotion = 2; break;
+                    case 'r': promotion = 3; break;
+                    case 'q': promotion = 4; break;
+                    default: return false;
                 }
-                
-                // _exit(0); // explicitly not using exit(0).
             }
+            out.data = make(from, to, promotion);
+            return true;
+        }
+        
+        // write the move in UCI notation to out, which needs room for 5 chars. returns the length.
+        size_t to_chars(char *out) const
+        {
+            if (is_null()) { std::memcpy(out, "0000", 4); return 4; }
             
-            return process_p;
+            out[0] = static_cast<char>('a' + from() % 8);
+            out[1] = static_cast<char>('1' + from() / 8);
+            out[2] = static_cast<char>('a' + to() % 8);
+            out[3] = static_cast<char>('1' + to() / 8);
+            if (promotion() == 0) return 4;
+            out[4] = " nbrq"[promotion()];
+            return 5;
         }
+    };
+    
+    struct UciScore
+    {
+        enum Kind : uint8_t { none, cp, mate };
+        Kind kind = none;
+        int value = 0; // centipawns, or moves to mate (negative when getting mated)
+        bool lowerbound = false;
+        bool upperbound = false;
+    };
+    
+    // The fields of one "info" line. Whatever the line doesn't mention is left at zero.
+    struct UciInfo
+    {
+        static constexpr size_t max_pv = 64;
         
-        // read the process output and put it back into a provided vector of strings.
-        // If the expected string is specified, the function will scan the output
-        // for the requested string, returning true if it finds it, or false if it times out.
-        // if left empty, the function will return true on timeout.
-        bool read(std::vector<std::string> &out_lines,
-                  const std::string &expected = "", int timeout_ms = 0)
+        int depth = 0;
+        int seldepth = 0;
+        int multipv = 0;
+        UciScore score {};
+        uint64_t nodes = 0;
+        uint64_t nps = 0;
+        uint64_t time_ms = 0;
+        uint64_t tbhits = 0;
+        int hashfull = 0;
+        UciMove currmove {};
+        int currmovenumber = 0;
+        std::array<UciMove, max_pv> pv {};
+        size_t pv_length = 0; // a longer pv is truncated to max_pv moves
+        // "info string ...": the rest of the line, only valid as long as the line it was parsed from.
+        std::string_view string {};
+    };
+    
+    struct UciBestMove
+    {
+        UciMove move {};
+        UciMove ponder {};
+        bool has_ponder = false;
+    };
+    
+    namespace uci
+    {
+        // split the next space separated token off rest.
+        inline std::string_view next_token(std::string_view &rest)
         {
-            out_lines.clear();
-            std::string curr_line {};
-            char buffer[1024];
+            const size_t begin = rest.find_first_not_of(' ');
+            if (begin == std::string_view::npos) { rest = {}; return {}; }
             
-            int poll_ret {};
-            if (timeout_ms <= 0) timeout_ms = MAX_TIMEOUT_MS;
-            // from the manual: POLLHUP is an output only flag, ignored in the .events bitmask
-            pollfd fds { .fd = in_pipe_[0], .events = POLLIN };
-            for(;;)
+            const size_t end = std::min(rest.find(' ', begin), rest.size());
+            const std::string_view token = rest.substr(begin, end - begin);
+            rest.remove_prefix(end);
+            return token;
+        }
+        
+        template <typename T>
+        inline bool parse_number(std::string_view token, T &out)
+        {
+            const auto [end, err] = std::from_chars(token.data(), token.data() + token.size(), out);
+            return err == std::errc() && end == token.data() + token.size();
+        }
+        
+        // parse an "info ..." line into info, false if it isn't one. Fields that don't parse are left at zero.
+        inline bool parse_info(std::string_view line, UciInfo &info)
+        {
+            std::string_view rest = line;
+            if (next_token(rest) != "info") return false;
+            info = UciInfo {};
+            
+            for (std::string_view token = next_token(rest); !token.empty();)
             {
-                // check that we have something to read.
-                do {
-                    poll_ret = poll(&fds, 1, timeout_ms);
-                } while (poll_ret == -1 && errno == EINTR);
-                
-                if (poll_ret == -1)
-                {   std::cout << "errno: " << strerror(errno) << " ";
-                    throw std::runtime_error("poll() failed: ");
-                }
-                // we timedout
-                if (poll_ret == 0) {
-                    if (!curr_line.empty())
-                        out_lines.push_back(curr_line);
-                    break;
-                }
-                
-                /*
-                 When a pipe is closed from the other side (i.e. the child process terminates)
-                 poll returns an revent of POLLIN/POLLHUP to signal "EOF".
-                 highly OS specific: see http://www.greenend.org.uk/rjk/tech/poll.html.
-                 
-                 Linux/SunOS: POLLHUP   MacOS/FreeBSD: POLLIN|POLLHUP      OpenBSD/etc: POLLIN
-                 We check for both POLLIN and POLLHUP, in case there is still data to read.
-                 We rely on read to tell us if we reach the EOF.
-                 */
-                size_t bytes_read = 0;
-                if ( (fds.revents & POLLIN) || (fds.events & POLLHUP))
+                std::string_view value = next_token(rest);
+                if      (token == "depth")          parse_number(value, info.depth);
+                else if (token == "seldepth")       parse_number(value, info.seldepth);
+                else if (token == "multipv")        parse_number(value, info.multipv);
+                else if (token == "nodes")          parse_number(value, info.nodes);
+                else if (token == "nps")            parse_number(value, info.nps);
+                else if (token == "time")           parse_number(value, info.time_ms);
+                else if (token == "tbhits")         parse_number(value, info.tbhits);
+                else if (token == "hashfull")       parse_number(value, info.hashfull);
+                else if (token == "currmovenumber") parse_number(value, info.currmovenumber);
+                else if (token == "currmove")       UciMove::parse(value, info.currmove);
+                else if (token == "score")
                 {
-                    bytes_read = ::read(fds.fd, buffer, sizeof(buffer));
-                    
-                    // reached EOF (pipe was closed)
-                    if (bytes_read == 0) {
-                        if (!curr_line.empty())
-                            out_lines.push_back(curr_line);
-                        return false;
+                    info.score.kind = value == "cp" ? UciScore::cp : value == "mate" ? UciScore::mate : UciScore::none;
+                    parse_number(next_token(rest), info.score.value);
+                    // the bound, if any, comes right after.
+                    token = next_token(rest);
+                    if (token == "lowerbound" || token == "upperbound") {
+                        (token == "lowerbound" ? info.score.lowerbound : info.score.upperbound) = true;
+                        token = next_token(rest);
                     }
-                    
-                    for (int i = 0; i < bytes_read; i++) {
-                        if (buffer[i] == '\n') {
-                            if (curr_line.empty()) continue;
-                            
-                            out_lines.push_back(curr_line);
-                            // check if the current line has the expected substring. If it does, stop here.
-                            if (!expected.empty()) {
-                                if (curr_line.rfind(expected, 0) != std::string::npos)
-                                    return true;
-                            }
-                            
-                            curr_line.clear();
-                        } else curr_line += buffer[i];
+                    continue;
+                }
+                else if (token == "pv")
+                {   // the moves go on until the first token that isn't one.
+                    UciMove move;
+                    while (!value.empty() && UciMove::parse(value, move)) {
+                        if (info.pv_length < UciInfo::max_pv) info.pv[info.pv_length++] = move;
+                        value = next_token(rest);
                     }
+                    token = value;
+                    continue;
+                }
+                else if (token == "string")
+                {   // everything up to the end of the line.
+                    if (!value.empty()) info.string = line.substr(static_cast<size_t>(value.data() - line.data()));
+                    break;
                 }
+                else
+                {   // a keyword we don't track (wdl, refutation, currline...): its values are skipped one
+                    // token at a time, until we get to a keyword we know.
+                    token = value;
+                    continue;
+                }
+                token = next_token(rest);
             }
-            // If we were looking for something specific we didn't find it.
-            // otherwise we read everything there was and we timedout successfully.
-            return expected.empty() ? true : false;
+            return true;
+        }
+        
+        // parse a "bestmove <move> [ponder <move>]" line, false if it isn't one.
+        inline bool parse_bestmove(std::string_view line, UciBestMove &best)
+        {
+            std::string_view rest = line;
+            if (next_token(rest) != "bestmove") return false;
+            
+            best = UciBestMove {};
+            UciMove::parse(next_token(rest), best.move);
+            if (next_token(rest) == "ponder")
+                best.has_ponder = UciMove::parse(next_token(rest), best.ponder);
+            return true;
         }
+    }
+    
+    /*
+     A UCI engine running in a child process.
+     
+     The constructor starts the engine and goes through the uci/uciok handshake, then a reader thread
+     takes over its output: info lines are parsed into a reused UciInfo and passed to the callback of
+     the current search, bestmove and readyok complete the futures returned by go() and is_ready().
+     Commands can be sent from any thread. The callbacks run on the reader thread, and they must not
+     call go() or is_ready().
+     */
+    class UciEngine
+    {
+    public:
+        using InfoCallback = std::function<void(const UciInfo &)>;
         
-        void send_command(std::string input)
+        // argv follows the same convention of Process::start: the first argument is the path of the executable.
+        explicit UciEngine(std::vector<std::string> argv, int handshake_timeout_ms = 5000,
+                           const ProcessOptions &options = {})
+            : argv_(std::move(argv)), process_(argv_.empty() ? std::string {} : argv_[0], options)
         {
-            if (!is_alive())
-                throw std::runtime_error("Error: the process is not running");
+            if (argv_.empty()) throw std::runtime_error("Error: no command given to the engine");
             
-            // ensure we are sending a '\n' character.
-            if (input[input.size()] != '\n')
-                input.append("\n");
+            std::vector<const char *> argv_ptrs;
+            for (const auto &arg : argv_) argv_ptrs.push_back(arg.c_str());
+            argv_ptrs.push_back(nullptr);
+            process_.start(argv_ptrs.data());
+            // we write from the caller threads while the reader thread reads: with blocking writes nothing ever
+            // waits in the write queue, and the reader thread never touches it.
+            process_.set_nonblocking(false);
             
-            //            std::cout << ">> " << input;
-            if ( write(out_pipe_[1], input.c_str(), input.size()) == -1 )
-                throw std::runtime_error("Error: could not send command to the process");
+            process_.send_command("uci");
+            const bool ok = process_.read_each([this](std::string_view line) {
+                if (line.starts_with("id name ")) name_ = line.substr(8);
+                return line.starts_with("uciok");
+            }, handshake_timeout_ms, TimeoutMode::deadline);
+            if (!ok) throw std::runtime_error("Error: the engine did not complete the uci handshake");
+            
+            reader_ = std::thread([this] { read_loop_(); });
         }
+        ~UciEngine()
+        {
+            // the reader notices within one of its short reads, and only then the process is ours alone:
+            // quit, and if the engine doesn't, the signals.
+            stopping_.store(true, std::memory_order_relaxed);
+            reader_.join();
+            std::lock_guard lock(write_mutex_);
+            process_.shutdown();
+        }
+        UciEngine(const UciEngine & other)              = delete;
+        UciEngine& operator=(const UciEngine & other)   = delete;
         
-        // the mirror logic needs to be reworked. when the mirror reads from the in pipe, it steals
-        // the data from pipe for the parent process. we need to duplicate it somehow.
-        //        void stop_mirror()
-        //        {
-        //            kill_(mirror_pid_);
-        //        }
-        //
-        //        void mirror_output()
-        //        {
-        //
-        //            pid_t mirror_p = fork();
-        //            if (mirror_p) {
-        //                mirror_pid_ = mirror_p;
-        //            } else {
-        //                // make a fd non-blocking (only useful if we use a tight read loop, not when polling).
-        //                // fcntl(in_pipe_[0], F_SETFL, fcntl(in_pipe_[0], F_GETFL) | O_NONBLOCK);
-        //
-        //                char buffer[2048];
-        //                std::string curr_line {};
-        //
-        //                while (true)
-        //                {
-        //                    // we use pread instead of read, so that we can use the same data again in subsequent reads.
-        //                    const int bytes_read = ::read(in_pipe_[0], buffer, sizeof(buffer));
-        //
-        //                    if (bytes_read == -1 && errno == EAGAIN) continue;
-        //                    if (bytes_read == -1 && errno != EAGAIN)
-        //                    {
-        //                        std::cout << "errno: " << strerror(errno) << " ";
-        //                        throw std::runtime_error("read() failed");
-        //                    }
-        //                    if (bytes_read == 0)
-        //                    {
-        //                        std::cout << ">> " << curr_line << std::endl;
-        //                        break;
-        //                    }
-        //
-        //                    for (int i = 0; i < bytes_read; i++) {
-        //                        if (buffer[i] == '\n') {
-        //                            std::cout << ">> " << curr_line << std::endl;
-        //                            curr_line += '\n';
-        //                            write(in_pipe_[1], curr_line.c_str(), curr_line.size());
-        //                            curr_line.clear();
-        //                        } else {
-        //                            curr_line += buffer[i];
-        //                        }
-        //                    }
-        //                }
-        //            }
-        //        }
+        // the "id name" the engine reported during the handshake.
+        const std::string &name() const { return name_; }
+        Process &process() { return process_; }
+        
+        // any command that doesn't get an answer: position, setoption, ucinewgame...
+        void send(std::string_view command)
+        {
+            std::lock_guard lock(write_mutex_);
+            process_.send_command(command);
+        }
+        
+        // start a search, params is what follows "go" (e.g. "depth 20", "movetime 1000", "infinite").
+        // on_info is called for every info line of this search.
+        std::future<UciBestMove> go(std::string_view params, InfoCallback on_info = {})
+        {
+            std::future<UciBestMove> result;
+            {
+                std::lock_guard lock(state_mutex_);
+                if (searching_) throw std::runtime_error("Error: the engine is already searching");
+                bestmove_ = std::promise<UciBestMove>();
+                result = bestmove_.get_future();
+                on_info_ = std::move(on_info);
+                searching_ = true;
+            }
+            std::lock_guard lock(write_mutex_);
+            // reuses its capacity, after the first search this doesn't allocate anymore.
+            go_command_.assign("go ").append(params);
+            process_.send_command(go_command_);
+            return result;
+        }
+        
+        // end the current search early, the future of go() then gets the best move found so far.
+        void stop() { send("stop"); }
+        
+        // completes once the engine answers readyok.
+        std::future<void> is_ready()
+        {
+            std::future<void> result;
+            {
+                std::lock_guard lock(state_mutex_);
+                ready_.emplace_back();
+                result = ready_.back().get_future();
+            }
+            send("isready");
+            return result;
+        }
         
-    public:
-        std::string command_;
     private:
-        int out_pipe_[2];
-        int in_pipe_[2];
-        bool forked_ = false;
-        pid_t child_pid_ = 0;
+        void read_loop_()
+        {
+            while (!stopping_.load(std::memory_order_relaxed))
+            {
+                // short timeouts, so that we notice when we are asked to stop.
+                process_.read_each([this](std::string_view line) { handle_line_(line); }, 100);
+                if (process_.last_read_status() == ReadStatus::eof) break;
+            }
+            
+            // the engine is gone, don't leave anyone waiting for an answer that isn't coming.
+            std::lock_guard lock(state_mutex_);
+            if (searching_) {
+                bestmove_.set_exception(std::make_exception_ptr(std::runtime_error("Error: the engine exited")));
+                searching_ = false;
+            }
+            ready_.clear(); // std::future_error (broken promise) for whoever is still waiting.
+        }
+        
+        void handle_line_(std::string_view line)
+        {
+            if (line.starts_with("info"))
+            {
+                std::lock_guard lock(state_mutex_);
+                // don't even parse the line if nobody is listening.
+                if (on_info_ && uci::parse_info(line, info_)) on_info_(info_);
+            }
+            else if (UciBestMove best; uci::parse_bestmove(line, best))
+            {
+                std::lock_guard lock(state_mutex_);
+                if (!searching_) return;
+                searching_ = false;
+                on_info_ = nullptr;
+                bestmove_.set_value(best);
+            }
+            else if (line.starts_with("readyok"))
+            {
+                std::lock_guard lock(state_mutex_);
+                if (ready_.empty()) return;
+                ready_.front().set_value();
+                ready_.pop_front();
+            }
+        }
+        
+        std::vector<std::string> argv_;
+        Process process_;
+        std::string name_;
+        std::string go_command_;
+        
+        std::mutex write_mutex_;
+        std::mutex state_mutex_;
+        bool searching_ = false;
+        std::promise<UciBestMove> bestmove_;
+        std::deque<std::promise<void>> ready_;
+        InfoCallback on_info_;
+        UciInfo info_;
+        
+        std::atomic<bool> stopping_ = false;
+        std::thread reader_;
     };
 }
 
@@ -0,0 +1,183 @@
+#include "sys_process.h"
+
+#include <gtest/gtest.h>
+
+#include <cstdio>
+#include <string>
+#include <string_view>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
+
+namespace
+{
+    const char *cat_argv[] = { "/bin/cat", nullptr };
+
+    std::string temporary_path(const char *name)
+    {
+        return "/tmp/" + std::string(name) + "." + std::to_string(getpid());
+    }
+}
+
+TEST(ResultCache, KeysIgnoreBlanks)
+{
+    const std::string_view spaced[] = { "  go   depth\t10 " };
+    const std::string_view tight[] = { "go depth 10" };
+    const std::string_view other[] = { "go depth 11" };
+    EXPECT_EQ(System::ResultCache::key("engine", spaced, "bestmove"), System::ResultCache::key("engine", tight, "bestmove"));
+    EXPECT_NE(System::ResultCache::key("engine", tight, "bestmove"), System::ResultCache::key("engine", other, "bestmove"));
+    EXPECT_NE(System::ResultCache::key("engine", tight, "bestmove"), System::ResultCache::key("other", tight, "bestmove"));
+
+    // the separators keep the commands apart.
+    const std::string_view split[] = { "ab", "c" };
+    const std::string_view joined[] = { "a", "bc" };
+    EXPECT_NE(System::ResultCache::key("", split, ""), System::ResultCache::key("", joined, ""));
+
+    // so does a newline inside a command, as the child sees two.
+    const std::string_view two_lines[] = { "a\nb" };
+    const std::string_view one_line[] = { "a b" };
+    const std::string_view two_commands[] = { "a", "b" };
+    EXPECT_NE(System::ResultCache::key("", two_lines, ""), System::ResultCache::key("", one_line, ""));
+    EXPECT_EQ(System::ResultCache::key("", two_lines, ""), System::ResultCache::key("", two_commands, ""));
+}
+
+TEST(ResultCache, EvictsTheLeastRecentlyUsed)
+{
+    System::ResultCache cache(2, 1);
+    const std::string_view a[] = { "a" }, b[] = { "b" }, c[] = { "c" };
+    cache.insert(System::ResultCache::key("", a, ""), { "A" });
+    cache.insert(System::ResultCache::key("", b, ""), { "B" });
+    EXPECT_TRUE(cache.find(System::ResultCache::key("", a, "")));
+    cache.insert(System::ResultCache::key("", c, ""), { "C" });
+
+    EXPECT_FALSE(cache.find(System::ResultCache::key("", b, "")));
+    ASSERT_TRUE(cache.find(System::ResultCache::key("", a, "")));
+    EXPECT_EQ(*cache.find(System::ResultCache::key("", c, "")), std::vector<std::string> { "C" });
+    EXPECT_EQ(cache.hits(), 3u);
+    EXPECT_EQ(cache.misses(), 1u);
+}
+
+TEST(ResultCache, QueryAsksTheChildOnce)
+{
+    System::Process process("/bin/cat");
+    process.start(cat_argv);
+    System::ResultCache cache;
+    const std::string_view commands[] = { "position startpos", "go depth 1" };
+
+    std::vector<std::string> lines;
+    ASSERT_TRUE(cache.query(process, commands, "go", lines, 1000));
+    EXPECT_EQ(lines, (std::vector<std::string> { "position startpos", "go depth 1" }));
+    ASSERT_TRUE(cache.query(process, commands, "go", lines, 1000));
+    EXPECT_EQ(lines.size(), 2u);
+    EXPECT_EQ(cache.hits(), 1u);
+    EXPECT_EQ(cache.misses(), 1u);
+}
+
+TEST(ResultCache, QueryCachesOnlyCompleteAnswers)
+{
+    System::ResultCache cache;
+    const std::string_view commands[] = { "go" };
+    std::vector<std::string> lines;
+
+    // cat never closes its output: without an expected line, the read can only time out.
+    System::Process quiet("/bin/cat");
+    quiet.start(cat_argv);
+    EXPECT_FALSE(cache.query(quiet, commands, "", lines, 50));
+    EXPECT_FALSE(cache.query(quiet, commands, "", lines, 50));
+    EXPECT_EQ(cache.hits(), 0u);
+
+    // the end of its output completes the answer of a child that exits.
+    System::Process once("/bin/sh");
+    const char *argv[] = { "/bin/sh", "-c", "read line; echo done", nullptr };
+    once.start(argv);
+    ASSERT_TRUE(cache.query(once, commands, "", lines, 1000));
+    EXPECT_EQ(lines, std::vector<std::string> { "done" });
+
+    // the same command with another argv is another child.
+    System::Process other("/bin/sh");
+    const char *other_argv[] = { "/bin/sh", "-c", "read line; echo other", nullptr };
+    other.start(other_argv);
+    ASSERT_TRUE(cache.query(other, commands, "", lines, 1000));
+    EXPECT_EQ(lines, std::vector<std::string> { "other" });
+    EXPECT_EQ(cache.hits(), 0u);
+}
+
+TEST(ResultCache, ShardsHoldTheCapacity)
+{
+    // more shards than entries: one shard, and the capacity holds.
+    System::ResultCache cache(2, 16);
+    const std::string_view a[] = { "a" }, b[] = { "b" }, c[] = { "c" };
+    for (auto commands : { std::span<const std::string_view>(a), std::span<const std::string_view>(b),
+                           std::span<const std::string_view>(c) })
+        cache.insert(System::ResultCache::key("", commands, ""), { "x" });
+    int kept = 0;
+    for (auto commands : { std::span<const std::string_view>(a), std::span<const std::string_view>(b),
+                           std::span<const std::string_view>(c) })
+        kept += cache.find(System::ResultCache::key("", commands, "")).has_value();
+    EXPECT_EQ(kept, 2);
+}
+
+TEST(ResultCache, FileOutlivesTheCache)
+{
+    const std::string path = temporary_path("sys_process_cache");
+    std::remove(path.c_str());
+    const std::string_view commands[] = { "go depth 20" };
+    const auto key = System::ResultCache::key("engine", commands, "bestmove");
+    {
+        System::ResultCache cache;
+        ASSERT_TRUE(cache.open_file(path, 1 << 16));
+        cache.insert(key, { "info depth 20", "bestmove e2e4" });
+    }
+    System::ResultCache reopened;
+    ASSERT_TRUE(reopened.open_file(path, 1 << 16));
+    const auto lines = reopened.find(key);
+    ASSERT_TRUE(lines);
+    EXPECT_EQ(*lines, (std::vector<std::string> { "info depth 20", "bestmove e2e4" }));
+    std::remove(path.c_str());
+}
+
+TEST(ResultCache, FileRefusesForeignFiles)
+{
+    const std::string path = temporary_path("sys_process_foreign");
+    for (const std::string &contents : { std::string("short"), std::string(4096, 'x') }) {
+        std::FILE *file = std::fopen(path.c_str(), "w");
+        ASSERT_TRUE(file);
+        std::fwrite(contents.data(), 1, contents.size(), file);
+        std::fclose(file);
+
+        System::ResultCache cache;
+        EXPECT_FALSE(cache.open_file(path, 1 << 16));
+        // and it's left as it was.
+        struct stat info;
+        ASSERT_EQ(stat(path.c_str(), &info), 0);
+        EXPECT_EQ(static_cast<size_t>(info.st_size), contents.size());
+    }
+    std::remove(path.c_str());
+}
+
+TEST(ResultCache, FileKeepsOneRecordPerKey)
+{
+    const std::string path = temporary_path("sys_process_dedup");
+    std::remove(path.c_str());
+    const std::string_view commands[] = { "go depth 20" };
+    const auto key = System::ResultCache::key("engine", commands, "bestmove");
+    System::ResultCache reopened(1);
+    {
+        System::ResultCache cache;
+        ASSERT_TRUE(cache.open_file(path, 1 << 16));
+        cache.insert(key, { "bestmove e2e4" });
+        cache.insert(key, { "bestmove d2d4" });
+    }
+    {
+        // loaded back, and then inserted again.
+        System::ResultCache cache;
+        ASSERT_TRUE(cache.open_file(path, 1 << 16));
+        cache.insert(key, { "bestmove c2c4" });
+    }
+    // one entry of capacity: anything after the first record would replace it.
+    ASSERT_TRUE(reopened.open_file(path, 1 << 16));
+    const auto lines = reopened.find(key);
+    ASSERT_TRUE(lines);
+    EXPECT_EQ(*lines, (std::vector<std::string> { "bestmove e2e4" }));
+    std::remove(path.c_str());
+}
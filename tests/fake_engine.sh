@@ -0,0 +1,12 @@
+#!/bin/sh
+while read -r cmd rest; do
+  case "$cmd" in
+    uci) echo "id name FakeFish 1.0"; echo "id author x"; echo "uciok";;
+    isready) echo readyok;;
+    go) echo "info depth 1 seldepth 2 multipv 1 score cp 23 nodes 20 nps 2000 tbhits 0 time 1 pv e2e4 e7e5"
+        echo "info depth 2 seldepth 3 multipv 1 score mate -3 upperbound nodes 400 wdl 1 2 3 time 3 pv e2e4 e7e5 g1f3 hashfull 5"
+        echo "info string NNUE evaluation using nn.nnue"
+        echo "bestmove e7e8q ponder a7a8n";;
+    quit) exit 0;;
+  esac
+done
@@ -0,0 +1,104 @@
+#include "sys_process.h"
+
+#include <gtest/gtest.h>
+
+#include <string>
+#include <string_view>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+namespace
+{
+    void capture(void *context, System::LogLevel, std::string_view message)
+    {
+        static_cast<std::vector<std::string> *>(context)->emplace_back(message);
+    }
+
+    // read fd until its EOF, on a thread of its own so that the writer never blocks on a full pipe.
+    std::thread drain(int fd, std::string &data)
+    {
+        return std::thread([fd, &data] {
+            char chunk[4096];
+            for (ssize_t n; (n = read(fd, chunk, sizeof(chunk))) > 0;) data.append(chunk, static_cast<size_t>(n));
+        });
+    }
+
+    size_t count_lines(const std::string &data, std::string_view line)
+    {
+        size_t count = 0;
+        for (size_t at = 0; (at = data.find(line, at)) != std::string::npos; at += line.size()) count++;
+        return count;
+    }
+}
+
+TEST(Log, WritesThroughTheSink)
+{
+    EXPECT_FALSE(System::Log::enabled());
+    std::vector<std::string> messages;
+    System::Log::set_sink(&capture, &messages);
+    System::Log::write(System::LogLevel::info, "pid ", 42, " exited with ", -1);
+    System::Log::write(System::LogLevel::error, std::string(300, 'x'));
+    ASSERT_EQ(messages.size(), 2u);
+    EXPECT_EQ(messages[0], "pid 42 exited with -1");
+    // cut at the size of the buffer.
+    EXPECT_EQ(messages[1].size(), 256u);
+
+    // only the sink that is set can be cleared.
+    std::vector<std::string> other;
+    System::Log::clear_sink(&capture, &other);
+    EXPECT_TRUE(System::Log::enabled());
+    System::Log::clear_sink(&capture, &messages);
+    EXPECT_FALSE(System::Log::enabled());
+    System::Log::write(System::LogLevel::info, "nobody hears this");
+    EXPECT_EQ(messages.size(), 2u);
+}
+
+TEST(AsyncLogSink, WritesEveryMessageFromEveryThread)
+{
+    int fds[2];
+    ASSERT_EQ(pipe(fds), 0);
+    std::string data;
+    std::thread reader = drain(fds[0], data);
+    {
+        System::AsyncLogSink sink(fds[1]);
+        System::Log::set_sink(&System::AsyncLogSink::sink, &sink);
+        std::vector<std::thread> producers;
+        for (int t = 0; t < 4; t++)
+            producers.emplace_back([] {
+                for (int i = 0; i < 100; i++) System::Log::write(System::LogLevel::info, "message");
+            });
+        for (std::thread &producer : producers) producer.join();
+        // fewer messages than slots: none can have been dropped.
+        EXPECT_EQ(sink.dropped(), 0u);
+    }
+    // the destructor wrote out what was left, and unset the sink.
+    EXPECT_FALSE(System::Log::enabled());
+    close(fds[1]);
+    reader.join();
+    close(fds[0]);
+    EXPECT_EQ(count_lines(data, "message\n"), 400u);
+}
+
+TEST(AsyncLogSink, DropsWhenTheRingIsFull)
+{
+    int fds[2];
+    ASSERT_EQ(pipe(fds), 0);
+    const std::string message(200, 'm');
+    std::string data;
+    std::thread reader;
+    size_t pushed = 0;
+    {
+        // nobody reads the pipe yet: the writer is soon stuck, and a ring of two slots fills up.
+        System::AsyncLogSink sink(fds[1], 2);
+        for (int i = 0; i < 2000; i++) pushed += sink.push(System::LogLevel::info, message);
+        EXPECT_GT(sink.dropped(), 0u);
+        EXPECT_EQ(pushed + sink.dropped(), 2000u);
+        reader = drain(fds[0], data);
+    }
+    close(fds[1]);
+    reader.join();
+    close(fds[0]);
+    // what wasn't dropped was written.
+    EXPECT_EQ(count_lines(data, message + "\n"), pushed);
+}
@@ -0,0 +1,45 @@
+#include "sys_process.h"
+
+#include <gtest/gtest.h>
+
+#include <chrono>
+#include <string>
+#include <vector>
+
+TEST(Pipeline, ChainsTheStages)
+{
+    // tr buffers what it writes to a pipe: nothing comes out of the last stage before the EOF.
+    System::Pipeline pipeline({ { "/bin/cat" }, { "/usr/bin/tr", "a-z", "A-Z" } });
+    pipeline.start();
+    ASSERT_TRUE(pipeline.is_alive());
+    pipeline.front().send_command("hello");
+    pipeline.front().send_command("world");
+    ASSERT_TRUE(pipeline.close_input(1000));
+
+    std::vector<std::string> lines;
+    EXPECT_FALSE(pipeline.back().read(lines, "never", 1000));
+    EXPECT_EQ(pipeline.back().last_read_status(), System::ReadStatus::eof);
+    EXPECT_EQ(lines, (std::vector<std::string> { "HELLO", "WORLD" }));
+
+    // the stages wound down on their own, the last one might just not be reaped yet.
+    for (const System::ShutdownStep step : pipeline.shutdown())
+        EXPECT_TRUE(step == System::ShutdownStep::not_running || step == System::ShutdownStep::quit);
+    EXPECT_FALSE(pipeline.is_alive());
+}
+
+TEST(Pipeline, ShutdownSignalsTheStuckStages)
+{
+    // the second stage outlives its input.
+    System::Pipeline pipeline({ { "/bin/cat" }, { "/bin/sh", "-c", "cat; exec sleep 5" } });
+    pipeline.start();
+    pipeline.front().send_command("line");
+    std::vector<std::string> lines;
+    ASSERT_TRUE(pipeline.back().read(lines, "line", 1000));
+
+    const auto steps = pipeline.shutdown({ .quit_command = {}, .quit_timeout = std::chrono::milliseconds(100),
+                                           .terminate_timeout = std::chrono::milliseconds(1000) });
+    ASSERT_EQ(steps.size(), 2u);
+    EXPECT_EQ(steps[0], System::ShutdownStep::quit);
+    EXPECT_EQ(steps[1], System::ShutdownStep::terminate);
+    EXPECT_FALSE(pipeline.is_alive());
+}
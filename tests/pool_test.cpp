@@ -0,0 +1,163 @@
+#include "sys_process.h"
+
+#include <gtest/gtest.h>
+
+#include <chrono>
+#include <future>
+#include <stdexcept>
+#include <string>
+#include <signal.h>
+#include <string_view>
+#include <unistd.h>
+#include <vector>
+
+namespace
+{
+    // the pool does its work on a background thread: wait a while for it to be done.
+    template <typename F>
+    bool eventually(F &&done)
+    {
+        for (int i = 0; i < 200; i++) {
+            if (done()) return true;
+            usleep(10000);
+        }
+        return done();
+    }
+}
+
+TEST(ProcessPool, LeasesGoBackToThePool)
+{
+    System::ProcessPool pool({ "/bin/cat" }, 2);
+    EXPECT_EQ(pool.idle(), 2u);
+    {
+        System::ProcessPool::Lease lease = pool.try_acquire();
+        ASSERT_TRUE(lease);
+        EXPECT_EQ(pool.idle(), 1u);
+        std::vector<std::string> lines;
+        lease->send_command("leased");
+        EXPECT_TRUE(lease->read(lines, "leased", 1000));
+    }
+    EXPECT_TRUE(eventually([&pool] { return pool.idle() == 2; }));
+}
+
+TEST(ProcessPool, ResetsReturnedChildren)
+{
+    // cat echoes the handshake back, after whatever the last lease left unread.
+    System::ProcessPool pool({ "/bin/cat" }, 1, { { "reset" }, "reset" });
+    pid_t pid;
+    {
+        System::ProcessPool::Lease lease = pool.try_acquire();
+        ASSERT_TRUE(lease);
+        pid = lease->pid();
+        lease->send_command("left over");
+    }
+    ASSERT_TRUE(eventually([&pool] { return pool.idle() == 1; }));
+    System::ProcessPool::Lease lease = pool.try_acquire();
+    ASSERT_TRUE(lease);
+    EXPECT_EQ(lease->pid(), pid);
+    std::vector<std::string> lines;
+    lease->send_command("ping");
+    EXPECT_TRUE(lease->read(lines, "ping", 1000));
+    EXPECT_EQ(lines, std::vector<std::string> { "ping" });
+}
+
+TEST(ProcessPool, RespawnsKilledChildren)
+{
+    System::ProcessPool pool({ "/bin/cat" }, 1, {}, std::chrono::milliseconds(10));
+    pid_t pid;
+    {   // killed while leased: the handshake finds out when it comes back.
+        System::ProcessPool::Lease lease = pool.try_acquire();
+        ASSERT_TRUE(lease);
+        pid = lease->pid();
+        lease->shutdown({ .quit_command = "" });
+    }
+    pid_t replacement = 0;
+    ASSERT_TRUE(eventually([&] {
+        System::ProcessPool::Lease lease = pool.try_acquire();
+        if (lease) replacement = lease->pid();
+        return lease && lease->is_alive();
+    }));
+    EXPECT_NE(replacement, pid);
+
+    // killed while idle: the health check finds out.
+    ASSERT_TRUE(eventually([&pool] { return pool.idle() == 1; }));
+    kill(replacement, SIGKILL);
+    ASSERT_TRUE(eventually([&] {
+        System::ProcessPool::Lease lease = pool.try_acquire();
+        return lease && lease->pid() != replacement && lease->is_alive();
+    }));
+}
+
+TEST(ProcessPool, ReplacementTakesTheFreedSlice)
+{
+    const std::vector<int> cpus = System::CpuTopology::allowed_cpus();
+    if (cpus.size() < 2) GTEST_SKIP() << "needs two CPUs to tell the slices apart";
+    System::ProcessPool pool({ "/bin/cat" }, 2, {}, std::chrono::milliseconds(10),
+                             { .placement = { .cpus = { cpus[0], cpus[1] }, .spread = true } });
+    System::ProcessPool::Lease dying = pool.try_acquire();
+    System::ProcessPool::Lease kept = pool.try_acquire();
+    ASSERT_TRUE(dying && kept);
+    EXPECT_NE(dying->placement().cpus, kept->placement().cpus);
+
+    const std::vector<int> freed = dying->placement().cpus;
+    dying->shutdown({ .quit_command = "" });
+    dying.release();
+    for (int i = 0; i < 200 && pool.idle() == 0; i++) usleep(10000);
+    System::ProcessPool::Lease replacement = pool.try_acquire();
+    ASSERT_TRUE(replacement);
+    EXPECT_EQ(replacement->placement().cpus, freed);
+}
+
+TEST(ProcessScheduler, NeedsIdleChildren)
+{
+    System::ProcessPool empty({ "/bin/cat" }, 0);
+    EXPECT_THROW(System::ProcessScheduler scheduler(empty), std::runtime_error);
+
+    // the one child is leased elsewhere: the scheduler doesn't wait for it.
+    System::ProcessPool pool({ "/bin/cat" }, 1);
+    System::ProcessPool::Lease lease = pool.try_acquire();
+    ASSERT_TRUE(lease);
+    EXPECT_THROW(System::ProcessScheduler scheduler(pool), std::runtime_error);
+}
+
+TEST(ProcessScheduler, FailedRestartFailsTheNextJob)
+{
+    // a cat of our own, which we can take away once the pool is up.
+    const std::string path = "/tmp/sys_process_cat." + std::to_string(getpid());
+    unlink(path.c_str());
+    ASSERT_EQ(symlink("/bin/cat", path.c_str()), 0);
+    System::ProcessPool pool({ path }, 1);
+    System::ProcessScheduler scheduler(pool);
+
+    auto killed = scheduler.submit([&path](System::Process &process) {
+        process.shutdown({ .quit_command = "" });
+        unlink(path.c_str());
+    });
+    killed.get();
+    auto next = scheduler.submit([](System::Process &process) { return process.is_alive(); });
+    EXPECT_THROW(next.get(), std::runtime_error);
+}
+
+TEST(ProcessScheduler, RunsOnMeasuredChildren)
+{
+    System::BasicProcessPool<System::RecordingMetrics> pool({ "/bin/cat" }, 2);
+    System::BasicProcessScheduler<System::RecordingMetrics> scheduler(pool);
+    std::vector<std::future<uint64_t>> futures;
+    for (int i = 0; i < 4; i++) {
+        futures.push_back(scheduler.submit([](System::BasicProcess<System::RecordingMetrics> &process) {
+            std::vector<std::string> lines;
+            process.send_command("ping");
+            if (!process.read(lines, "ping", 1000)) throw std::runtime_error("no echo");
+            return process.metrics().lines_framed;
+        }));
+    }
+    for (auto &future : futures) EXPECT_GE(future.get(), 1u);
+
+    System::ResultCache cache;
+    System::BasicProcess<System::RecordingMetrics> process("/bin/cat");
+    const char *argv[] = { "/bin/cat", nullptr };
+    process.start(argv);
+    const std::string_view commands[] = { "go" };
+    std::vector<std::string> lines;
+    EXPECT_TRUE(cache.query(process, commands, "go", lines, 1000));
+}
@@ -0,0 +1,496 @@
+#include "sys_process.h"
+
+#include <gtest/gtest.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <fcntl.h>
+#include <memory_resource>
+#include <span>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+namespace
+{
+    const char *cat_argv[] = { "/bin/cat", nullptr };
+
+    // a shell child running script, e.g. to write some lines and exit.
+    System::Process start_shell(const char *script, const System::ProcessOptions &options = {})
+    {
+        System::Process process("/bin/sh", options);
+        const char *argv[] = { "/bin/sh", "-c", script, nullptr };
+        process.start(argv);
+        return process;
+    }
+
+    // everything left to read from fd, up to its end.
+    std::string read_all(int fd)
+    {
+        std::string data;
+        char chunk[4096];
+        for (ssize_t n; (n = read(fd, chunk, sizeof(chunk))) > 0;) data.append(chunk, static_cast<size_t>(n));
+        return data;
+    }
+
+    // mirror the output of a child into log_fd, and check that read() still gets all of it.
+    void read_mirrored(int log_fd)
+    {
+        System::Process process("/bin/sh");
+        process.mirror_output(log_fd);
+        const char *argv[] = { "/bin/sh", "-c", "echo one; echo two; printf three", nullptr };
+        process.start(argv);
+        std::vector<std::string> lines;
+        EXPECT_FALSE(process.read(lines, "never", 1000));
+        EXPECT_EQ(lines, (std::vector<std::string> { "one", "two", "three" }));
+    }
+}
+
+TEST(Process, EchoesIntoEveryKindOfLines)
+{
+    System::Process process("/bin/cat");
+    process.start(cat_argv);
+    ASSERT_TRUE(process.is_alive());
+
+    std::vector<std::string> strings;
+    process.send_command("one");
+    process.send_command("two");
+    ASSERT_TRUE(process.read(strings, "two", 1000));
+    EXPECT_EQ(strings, (std::vector<std::string> { "one", "two" }));
+
+    std::vector<std::string_view> views;
+    const std::string_view commands[] = { "three", "four" };
+    ASSERT_TRUE(process.send_commands(commands));
+    ASSERT_TRUE(process.read(views, "four", 1000));
+    ASSERT_EQ(views.size(), 2u);
+    EXPECT_EQ(views[0], "three");
+    EXPECT_EQ(views[1], "four");
+
+    std::pmr::monotonic_buffer_resource arena;
+    std::pmr::vector<std::pmr::string> pmr_lines(&arena);
+    const std::string_view parts[] = { "go", " depth ", "10" };
+    ASSERT_TRUE(process.send_line(parts));
+    ASSERT_TRUE(process.read(pmr_lines, "go", 1000));
+    ASSERT_EQ(pmr_lines.size(), 1u);
+    EXPECT_EQ(pmr_lines[0], "go depth 10");
+    EXPECT_EQ(pmr_lines[0].get_allocator().resource(), &arena);
+    EXPECT_EQ(process.last_read_status(), System::ReadStatus::matched);
+}
+
+TEST(Process, ShorterReadsKeepTheStrings)
+{
+    System::Process process("/bin/cat");
+    process.start(cat_argv);
+    const std::string line(200, 'x');
+
+    std::vector<std::string> lines;
+    for (int i = 0; i < 3; i++) process.send_command(line + std::to_string(i));
+    ASSERT_TRUE(process.read(lines, line + "2", 1000));
+    process.send_command("short");
+    ASSERT_TRUE(process.read(lines, "short", 1000));
+    ASSERT_EQ(lines.size(), 1u);
+
+    // the two strings the short read didn't need come back, with their room.
+    for (int i = 0; i < 3; i++) process.send_command(std::to_string(i));
+    ASSERT_TRUE(process.read(lines, "2", 1000));
+    ASSERT_EQ(lines, (std::vector<std::string> { "0", "1", "2" }));
+    EXPECT_GE(lines[1].capacity(), line.size());
+    EXPECT_GE(lines[2].capacity(), line.size());
+}
+
+TEST(Process, ReadStopsAtAnyPrefix)
+{
+    static constexpr System::PrefixMatcher terminators { "bestmove", "readyok", "error" };
+    static_assert(terminators.size() == 3);
+
+    System::Process process("/bin/cat");
+    process.start(cat_argv);
+
+    std::vector<std::string> lines;
+    process.send_command("info depth 1");
+    process.send_command("readyok");
+    EXPECT_EQ(process.read(lines, terminators, 1000), 1u);
+    EXPECT_EQ(lines.back(), "readyok");
+
+    std::vector<std::string_view> views;
+    process.send_command("error: no such option");
+    EXPECT_EQ(process.read(views, terminators, 1000), 2u);
+
+    // a prefix of a terminator isn't one.
+    process.send_command("best");
+    EXPECT_EQ(process.read(views, terminators, 100), System::PrefixMatcher<3>::npos);
+    EXPECT_EQ(process.last_read_status(), System::ReadStatus::idle_timeout);
+}
+
+TEST(Process, ReadReportsHowItEnded)
+{
+    System::Process quiet("/bin/cat");
+    quiet.start(cat_argv);
+    std::vector<std::string> lines;
+    // nothing expected: the timeout is how a read without a terminator ends.
+    EXPECT_TRUE(quiet.read(lines, {}, 50));
+    EXPECT_EQ(quiet.last_read_status(), System::ReadStatus::idle_timeout);
+    EXPECT_FALSE(quiet.read(lines, "never", 50, System::TimeoutMode::deadline));
+    EXPECT_EQ(quiet.last_read_status(), System::ReadStatus::deadline_expired);
+
+    System::Process done = start_shell("echo one; printf two");
+    EXPECT_FALSE(done.read(lines, "three", 1000));
+    EXPECT_EQ(done.last_read_status(), System::ReadStatus::eof);
+    // the last line doesn't need its newline.
+    EXPECT_EQ(lines, (std::vector<std::string> { "one", "two" }));
+}
+
+TEST(Process, DeadlineHoldsAgainstAFlood)
+{
+    // yes never stops writing, so no poll would ever time out: the deadline is checked between lines.
+    System::Process process = start_shell("exec yes");
+    const auto start = std::chrono::steady_clock::now();
+    EXPECT_FALSE(process.read_each([](std::string_view) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }, 50, System::TimeoutMode::deadline));
+    EXPECT_EQ(process.last_read_status(), System::ReadStatus::deadline_expired);
+    EXPECT_LT(std::chrono::steady_clock::now() - start, std::chrono::milliseconds(500));
+
+    // and what a read keeps until its expected line is bounded.
+    System::Process flood = start_shell("exec yes", { .max_buffered_output = 1 << 20 });
+    std::vector<std::string_view> lines;
+    EXPECT_THROW(flood.read(lines, "never", 200, System::TimeoutMode::deadline), std::runtime_error);
+}
+
+TEST(Process, ReadEachStreamsAndStops)
+{
+    System::Process process = start_shell("for i in 1 2 3 4 5; do echo line $i; done; sleep 5");
+    std::vector<std::string> seen;
+    EXPECT_TRUE(process.read_each([&seen](std::string_view line) {
+        seen.emplace_back(line);
+        return line == "line 3";
+    }, 1000));
+    EXPECT_EQ(seen.size(), 3u);
+
+    // the rest is still there for the next read, and a void callback reads until the timeout.
+    size_t more = 0;
+    EXPECT_FALSE(process.read_each([&more](std::string_view) { more++; }, 100));
+    EXPECT_EQ(more, 2u);
+}
+
+TEST(Process, MirrorsTheOutput)
+{
+    // a pipe and a regular file take the splice path.
+    int fds[2];
+    ASSERT_EQ(pipe(fds), 0);
+    read_mirrored(fds[1]);
+    close(fds[1]);
+    EXPECT_EQ(read_all(fds[0]), "one\ntwo\nthree");
+    close(fds[0]);
+
+    const std::string path = "/tmp/sys_process_mirror." + std::to_string(getpid());
+    const int file = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    ASSERT_NE(file, -1);
+    read_mirrored(file);
+    lseek(file, 0, SEEK_SET);
+    EXPECT_EQ(read_all(file), "one\ntwo\nthree");
+    close(file);
+
+    // splice() refuses a file opened with O_APPEND: the chunks are written from the read buffer instead.
+    const int log = open(path.c_str(), O_RDWR | O_TRUNC | O_APPEND);
+    ASSERT_NE(log, -1);
+    read_mirrored(log);
+    lseek(log, 0, SEEK_SET);
+    EXPECT_EQ(read_all(log), "one\ntwo\nthree");
+    close(log);
+    unlink(path.c_str());
+}
+
+TEST(Process, PseudoTerminalFramesLines)
+{
+    System::Process process = start_shell("if [ -t 1 ]; then echo tty; else echo pipe; fi; printf 'one\\ntwo\\n'",
+                                          { .pseudo_terminal = true });
+    std::vector<std::string> lines;
+    // the terminal is raw: no "\r\n", and the EIO once the child is gone reads as the end of the output.
+    EXPECT_FALSE(process.read(lines, "never", 1000));
+    EXPECT_EQ(process.last_read_status(), System::ReadStatus::eof);
+    EXPECT_EQ(lines, (std::vector<std::string> { "tty", "one", "two" }));
+
+    // a stdio that sees a terminal flushes every line, where on a pipe tr would hold it until the EOF.
+    System::Process tr("/usr/bin/tr", { .pseudo_terminal = true });
+    const char *argv[] = { "/usr/bin/tr", "a-z", "A-Z", nullptr };
+    tr.start(argv);
+    tr.send_command("hello");
+    EXPECT_TRUE(tr.read(lines, "HELLO", 1000));
+}
+
+TEST(Process, PipelineRoutesRepliesInOrder)
+{
+    System::Process process("/bin/cat");
+    process.start(cat_argv);
+
+    const System::PipelinedRequest requests[] = {
+        { "setoption name Hash value 16", "" },
+        { "isready", "isready" },
+        { "go depth 1", "go" },
+    };
+    std::vector<std::pair<size_t, std::string>> replies;
+    EXPECT_EQ(process.pipeline(requests, [&replies](size_t index, std::string_view line) {
+        replies.emplace_back(index, line);
+    }, 1000), 3u);
+    // cat echoes the silent request too, which then belongs to the next one.
+    ASSERT_EQ(replies.size(), 3u);
+    EXPECT_EQ(replies[0].first, 1u);
+    EXPECT_EQ(replies[1], (std::pair<size_t, std::string> { 1, "isready" }));
+    EXPECT_EQ(replies[2], (std::pair<size_t, std::string> { 2, "go depth 1" }));
+}
+
+TEST(Process, BackpressureFailSendsNothing)
+{
+    // a child that never reads its input: the pipe fills up, then the queue.
+    System::Process process = start_shell("exec sleep 5");
+    process.set_write_queue(1024, System::Backpressure::fail);
+
+    const std::string line(4096, 'x');
+    bool refused = false;
+    for (int i = 0; i < 1000 && !refused; i++) refused = !process.send_command(line);
+    ASSERT_TRUE(refused);
+    EXPECT_LE(process.queued_bytes(), 1024u);
+}
+
+TEST(Process, CloseInputGivesUpAfterTheTimeout)
+{
+    System::Process process = start_shell("exec sleep 5");
+    const std::string line(4096, 'x');
+    // a pipe full, and some more in the queue.
+    while (process.queued_bytes() == 0) process.send_command(line);
+
+    const auto begin = std::chrono::steady_clock::now();
+    EXPECT_FALSE(process.close_input(50));
+    EXPECT_LT(std::chrono::steady_clock::now() - begin, std::chrono::seconds(1));
+    EXPECT_EQ(process.queued_bytes(), 0u);
+    EXPECT_THROW(process.send_command("more"), std::runtime_error);
+}
+
+TEST(Process, BlockedSendBoundsTheOutput)
+{
+    // a child that floods us and never reads: a blocking send buffers the output until the limit.
+    System::Process process = start_shell("exec yes flood", { .write_queue_limit = 1024,
+                                                              .max_buffered_output = 1 << 20 });
+    const std::string line(4096, 'x');
+    EXPECT_THROW({
+        for (int i = 0; i < 100000; i++) process.send_command(line);
+    }, std::runtime_error);
+}
+
+TEST(Process, SharedChannelReplacesTheInheritedVariable)
+{
+    // as if we were the child of another Process with a shared channel. env(1), since a shell would dedupe it.
+    setenv("SYS_PROCESS_SHM", "1", 1);
+    System::Process process("/usr/bin/env", { .shared_memory_size = 4096 });
+    const char *argv[] = { "/usr/bin/env", nullptr };
+    process.start(argv);
+    unsetenv("SYS_PROCESS_SHM");
+
+    std::vector<std::string> lines;
+    process.read(lines, "never", 1000);
+    std::vector<std::string> ours;
+    for (const std::string &line : lines)
+        if (line.starts_with("SYS_PROCESS_SHM=")) ours.push_back(line);
+    ASSERT_EQ(ours.size(), 1u);
+    EXPECT_NE(ours[0], "SYS_PROCESS_SHM=1");
+}
+
+TEST(Process, BulkPayloadsGoThroughTheSharedMemory)
+{
+    // the child reads the payload straight from the shared memory file, after the header page of the ring,
+    // and echoes it back through the pipe.
+    System::Process process = start_shell("while read command offset length; do "
+                                          "dd if=/proc/self/fd/3 bs=1 skip=$(($(getconf PAGESIZE) + offset)) "
+                                          "count=$length 2>/dev/null; echo \" $command\"; done",
+                                          { .shared_memory_size = 4096 });
+    ASSERT_NE(process.shared_channel(), nullptr);
+    const size_t capacity = process.shared_channel()->capacity();
+
+    const std::string payload = "a payload";
+    ASSERT_TRUE(process.copy_bulk("copied", std::as_bytes(std::span(payload))));
+    std::vector<std::string> lines;
+    ASSERT_TRUE(process.read(lines, "a payload copied", 1000));
+
+    // written in place: the ring has room up to its end, then nothing until the child releases.
+    const std::span<std::byte> reserved = process.shared_channel()->reserve(capacity - payload.size());
+    ASSERT_EQ(reserved.size(), capacity - payload.size());
+    std::fill(reserved.begin(), reserved.end(), std::byte { 'x' });
+    ASSERT_TRUE(process.send_bulk("placed", reserved.first(3)));
+    ASSERT_TRUE(process.read(lines, "xxx placed", 1000));
+
+    // the child never releases anything: a full ring refuses the next payload, and sends nothing.
+    EXPECT_TRUE(process.shared_channel()->reserve(capacity).empty());
+    const std::string large(capacity, 'y');
+    EXPECT_FALSE(process.copy_bulk("refused", std::as_bytes(std::span(large))));
+    EXPECT_TRUE(process.read(lines, {}, 100));
+    EXPECT_TRUE(lines.empty());
+}
+
+TEST(Process, DoorbellsParse)
+{
+    std::string_view command;
+    size_t offset = 0, length = 0;
+    ASSERT_TRUE(System::SharedChannel::parse_doorbell("go infinite 4096 123\r\n", command, offset, length));
+    EXPECT_EQ(command, "go infinite");
+    EXPECT_EQ(offset, 4096u);
+    EXPECT_EQ(length, 123u);
+
+    char buffer[48];
+    const size_t size = System::SharedChannel::format_doorbell(buffer, 18446744073709551615ull, 7);
+    const std::string line = "eval" + std::string(buffer, size);
+    ASSERT_TRUE(System::SharedChannel::parse_doorbell(line, command, offset, length));
+    EXPECT_EQ(command, "eval");
+    EXPECT_EQ(offset, 18446744073709551615ull);
+    EXPECT_EQ(length, 7u);
+
+    EXPECT_FALSE(System::SharedChannel::parse_doorbell("eval 12", command, offset, length));
+    EXPECT_FALSE(System::SharedChannel::parse_doorbell("eval x 12", command, offset, length));
+    EXPECT_FALSE(System::SharedChannel::parse_doorbell("eval 12 -3", command, offset, length));
+    EXPECT_FALSE(System::SharedChannel::parse_doorbell("bestmove e2e4", command, offset, length));
+}
+
+TEST(Process, CapturesStandardError)
+{
+    System::Process process = start_shell("echo out; echo err >&2; echo done",
+                                          { .stderr_mode = System::StderrMode::capture });
+    std::vector<std::string> errors;
+    process.set_stderr_callback([&errors](std::string_view line) { errors.emplace_back(line); });
+
+    std::vector<std::string> lines;
+    process.read(lines, "never", 1000);
+    process.drain_stderr();
+    EXPECT_EQ(lines, (std::vector<std::string> { "out", "done" }));
+    EXPECT_EQ(errors, (std::vector<std::string> { "err" }));
+}
+
+TEST(Process, StandardErrorDoesNotResetTheIdleTimeout)
+{
+    // two seconds of standard error, and nothing on the output.
+    System::Process process = start_shell("for i in $(seq 40); do echo err >&2; sleep 0.05; done; exec sleep 5",
+                                          { .stderr_mode = System::StderrMode::capture });
+    size_t errors = 0;
+    process.set_stderr_callback([&errors](std::string_view) { errors++; });
+
+    const auto start = std::chrono::steady_clock::now();
+    std::vector<std::string> lines;
+    EXPECT_FALSE(process.read(lines, "never", 200));
+    EXPECT_EQ(process.last_read_status(), System::ReadStatus::idle_timeout);
+    EXPECT_LT(std::chrono::steady_clock::now() - start, std::chrono::seconds(1));
+    EXPECT_GT(errors, 0u);
+}
+
+TEST(Process, ShutdownEscalates)
+{
+    System::Process polite = start_shell("read line; exit 3");
+    EXPECT_EQ(polite.shutdown({ .quit_command = "quit" }), System::ShutdownStep::quit);
+    EXPECT_FALSE(polite.is_alive());
+    ASSERT_TRUE(polite.exit_status());
+    EXPECT_EQ(WEXITSTATUS(*polite.exit_status()), 3);
+
+    System::Process stubborn = start_shell("trap '' TERM; echo ready; while :; do sleep 1; done");
+    std::vector<std::string> lines;
+    // SIGTERM has to come after the trap.
+    ASSERT_TRUE(stubborn.read(lines, "ready", 1000));
+    const System::ShutdownPolicy policy { .quit_command = "", .quit_timeout = std::chrono::milliseconds(10),
+                                          .terminate_timeout = std::chrono::milliseconds(50) };
+    EXPECT_EQ(stubborn.shutdown(policy), System::ShutdownStep::kill);
+    EXPECT_EQ(stubborn.shutdown(policy), System::ShutdownStep::not_running);
+}
+
+TEST(Process, ShutdownAllReportsEveryChild)
+{
+    System::Process first("/bin/cat");
+    System::Process second("/bin/cat");
+    first.start(cat_argv);
+    second.start(cat_argv);
+    System::Process *fleet[] = { &first, &second };
+
+    // without a quit command, SIGTERM is what ends cat.
+    const auto steps = System::Process::shutdown_all(fleet, { .quit_command = "" });
+    ASSERT_EQ(steps.size(), 2u);
+    for (const System::ShutdownStep step : steps) EXPECT_EQ(step, System::ShutdownStep::terminate);
+    EXPECT_FALSE(first.is_alive());
+    EXPECT_FALSE(second.is_alive());
+}
+
+TEST(Process, RestartSpawnsTheSameCommand)
+{
+    System::Process process("/bin/cat");
+    EXPECT_THROW(process.restart(), std::runtime_error);
+
+    const pid_t first = process.start(cat_argv);
+    EXPECT_THROW(process.start(cat_argv), std::runtime_error);
+    const pid_t second = process.restart({ .quit_command = "" });
+    EXPECT_NE(first, second);
+
+    std::vector<std::string> lines;
+    process.send_command("again");
+    EXPECT_TRUE(process.read(lines, "again", 1000));
+}
+
+TEST(Process, MissingExecutableThrows)
+{
+    System::Process process("/nonexistent/child");
+    const char *argv[] = { "/nonexistent/child", nullptr };
+    EXPECT_THROW(process.start(argv), std::runtime_error);
+    EXPECT_FALSE(process.is_alive());
+}
+
+TEST(Process, FailedPlacementKillsTheChild)
+{
+    // no such policy: sched_setscheduler() refuses it once the child runs.
+    System::Process process("/bin/cat", { .placement = { .scheduling_policy = 12345 } });
+    EXPECT_THROW(process.start(cat_argv), std::runtime_error);
+    EXPECT_FALSE(process.is_alive());
+}
+
+TEST(Process, RecordingMetricsCountTheRoundTrips)
+{
+    System::BasicProcess<System::RecordingMetrics> process("/bin/cat");
+    process.start(cat_argv);
+    std::vector<std::string> lines;
+    for (int i = 0; i < 3; i++) {
+        process.send_command("ping");
+        ASSERT_TRUE(process.read(lines, "ping", 1000));
+    }
+    const System::ProcessMetrics metrics = process.metrics();
+    EXPECT_EQ(metrics.lines_framed, 3u);
+    EXPECT_EQ(metrics.command_latency.count(), 3u);
+    EXPECT_GE(metrics.poll_calls, 3u);
+
+    // a refused send doesn't start the clock: the latency is the one of the send that went out.
+    process.set_write_queue(8, System::Backpressure::fail);
+    ASSERT_FALSE(process.send_command(std::string(100, 'x')));
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    process.send_command("ping");
+    ASSERT_TRUE(process.read(lines, "ping", 1000));
+    const System::ProcessMetrics refused = process.metrics();
+    EXPECT_EQ(refused.command_latency.count(), 4u);
+    EXPECT_LT(refused.command_latency.max(), std::chrono::milliseconds(100));
+
+    // and a plain Process has nothing to count them in.
+    static_assert(sizeof(System::Process) < sizeof(process));
+    System::Process plain("/bin/cat");
+    plain.start(cat_argv);
+    plain.send_command("ping");
+    ASSERT_TRUE(plain.read(lines, "ping", 1000));
+    EXPECT_EQ(plain.metrics().lines_framed, 0u);
+}
+
+TEST(Process, MovedProcessKeepsItsChild)
+{
+    System::Process process("/bin/cat");
+    process.start(cat_argv);
+    std::vector<System::Process> processes;
+    processes.push_back(std::move(process));
+
+    EXPECT_FALSE(process.is_alive());
+    std::vector<std::string> lines;
+    processes.back().send_command("moved");
+    EXPECT_TRUE(processes.back().read(lines, "moved", 1000));
+}
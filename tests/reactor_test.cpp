@@ -0,0 +1,221 @@
+#include "sys_process.h"
+
+#include <gtest/gtest.h>
+
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace
+{
+    // three lines at once, then nothing until we're done with it.
+    std::unique_ptr<System::Process> start_three_lines()
+    {
+        auto process = std::make_unique<System::Process>("/bin/sh");
+        const char *argv[] = { "/bin/sh", "-c", "printf 'one\\ntwo\\nthree\\n'; exec sleep 5", nullptr };
+        process->start(argv);
+        return process;
+    }
+
+    void run_for(System::ProcessReactor &reactor, int rounds)
+    {
+        for (int i = 0; i < rounds && reactor.size() > 0; i++) reactor.run_once(50);
+    }
+
+    struct Conversation
+    {
+        std::vector<std::string> lines;
+        bool timed_out = false;
+        bool ended = false;
+        bool done = false;
+    };
+
+    // talk to a cat: every line comes back, until we close its input.
+    System::Task converse(System::Process &process, Conversation &conversation)
+    {
+        co_await process.send("hello");
+        if (auto line = co_await process.read_line()) conversation.lines.emplace_back(*line);
+        co_await process.send("info depth 1");
+        co_await process.send("bestmove e2e4");
+        if (auto line = co_await process.read_until("bestmove", 1000)) conversation.lines.emplace_back(*line);
+        // nothing else is coming.
+        conversation.timed_out = !co_await process.read_until("bestmove", 50);
+        process.close_input();
+        conversation.ended = !co_await process.read_line();
+        conversation.done = true;
+    }
+
+    // a line larger than the pipe: the send waits for the child to make room.
+    System::Task send_large(System::Process &process, const std::string &line, Conversation &conversation)
+    {
+        co_await process.send(line);
+        process.close_input();
+        if (auto reply = co_await process.read_line()) conversation.lines.emplace_back(*reply);
+        conversation.done = true;
+    }
+
+    void run_until(System::ProcessReactor &reactor, const Conversation &conversation)
+    {
+        for (int i = 0; i < 100 && !conversation.done; i++) reactor.run_once(50);
+    }
+}
+
+TEST(ProcessReactor, DispatchesLinesThenExit)
+{
+    System::ProcessReactor reactor;
+    System::Process process("/bin/sh");
+    const char *argv[] = { "/bin/sh", "-c", "echo one; echo two; printf three", nullptr };
+    process.start(argv);
+
+    std::vector<std::string> lines;
+    bool exited = false;
+    reactor.add(process, [&lines](System::Process &, std::string_view line) { lines.emplace_back(line); },
+                [&exited, &lines](System::Process &) { exited = lines.size() == 3; });
+    run_for(reactor, 20);
+    EXPECT_EQ(lines, (std::vector<std::string> { "one", "two", "three" }));
+    EXPECT_TRUE(exited);
+    EXPECT_EQ(reactor.size(), 0u);
+}
+
+TEST(ProcessReactor, RemoveFromInsideOnLine)
+{
+    System::ProcessReactor reactor;
+    auto process = start_three_lines();
+
+    int calls = 0;
+    reactor.add(*process, [&reactor, &calls](System::Process &p, std::string_view) {
+        calls++;
+        reactor.remove(p);
+    });
+    run_for(reactor, 20);
+    EXPECT_EQ(calls, 1);
+    EXPECT_EQ(reactor.size(), 0u);
+
+    // the rest of the output is still there for whoever reads it next.
+    std::vector<std::string> lines;
+    EXPECT_TRUE(process->read(lines, "three", 1000));
+    EXPECT_EQ(lines, (std::vector<std::string> { "two", "three" }));
+}
+
+TEST(ProcessReactor, DestroyFromInsideOnLine)
+{
+    System::ProcessReactor reactor;
+    auto process = start_three_lines();
+
+    int calls = 0;
+    reactor.add(*process, [&process, &calls](System::Process &, std::string_view) {
+        calls++;
+        process.reset();
+    });
+    run_for(reactor, 20);
+    EXPECT_EQ(calls, 1);
+    EXPECT_FALSE(process);
+    EXPECT_EQ(reactor.size(), 0u);
+}
+
+TEST(ProcessReactor, DestroyFromInsideOnExit)
+{
+    System::ProcessReactor reactor;
+    auto process = std::make_unique<System::Process>("/bin/sh");
+    const char *argv[] = { "/bin/sh", "-c", "echo bye", nullptr };
+    process->start(argv);
+
+    int lines = 0;
+    reactor.add(*process, [&lines](System::Process &, std::string_view) { lines++; },
+                [&process](System::Process &) { process.reset(); });
+    run_for(reactor, 20);
+    EXPECT_EQ(lines, 1);
+    EXPECT_FALSE(process);
+}
+
+TEST(ProcessReactor, MoveFromInsideOnLine)
+{
+    System::ProcessReactor reactor;
+    std::vector<System::Process> processes;
+    processes.push_back(std::move(*start_three_lines()));
+
+    std::vector<std::string> lines;
+    reactor.add(processes.front(), [&processes, &lines](System::Process &p, std::string_view line) {
+        lines.emplace_back(line);
+        // the one the callback gets is always the live one.
+        EXPECT_EQ(&p, &processes.front());
+        // grow the vector: the process moves to new storage.
+        if (lines.size() == 1) processes.emplace_back("/bin/cat");
+    });
+    run_for(reactor, 5);
+    EXPECT_EQ(lines, (std::vector<std::string> { "one", "two", "three" }));
+    EXPECT_EQ(reactor.size(), 1u);
+}
+
+TEST(ProcessReactor, RefusesAProcessInAnotherReactor)
+{
+    System::ProcessReactor first;
+    System::ProcessReactor second;
+    {
+        auto process = start_three_lines();
+        first.add(*process, [](System::Process &, std::string_view) {});
+        EXPECT_THROW(second.add(*process, [](System::Process &, std::string_view) {}), std::runtime_error);
+        EXPECT_THROW(second.attach(*process), std::runtime_error);
+        EXPECT_EQ(second.size(), 0u);
+        EXPECT_EQ(first.size(), 1u);
+    }
+    // destroying the process took it out of the only reactor that had it.
+    EXPECT_EQ(first.size(), 0u);
+}
+
+TEST(ProcessReactor, AddsAProcessWithItsInputClosed)
+{
+    System::ProcessReactor reactor;
+    System::Process process("/bin/sh");
+    const char *argv[] = { "/bin/sh", "-c", "cat; echo done", nullptr };
+    process.start(argv);
+    process.send_command("one");
+    ASSERT_TRUE(process.close_input(1000));
+
+    std::vector<std::string> lines;
+    reactor.add(process, [&lines](System::Process &, std::string_view line) { lines.emplace_back(line); });
+    run_for(reactor, 20);
+    EXPECT_EQ(lines, (std::vector<std::string> { "one", "done" }));
+    EXPECT_EQ(reactor.size(), 0u);
+}
+
+TEST(ProcessReactor, AwaitsLinesAndSends)
+{
+    System::ProcessReactor reactor;
+    System::Process process("/bin/cat");
+    const char *argv[] = { "/bin/cat", nullptr };
+    process.start(argv);
+    reactor.attach(process);
+
+    Conversation conversation;
+    converse(process, conversation);
+    run_until(reactor, conversation);
+    ASSERT_TRUE(conversation.done);
+    EXPECT_EQ(conversation.lines, (std::vector<std::string> { "hello", "bestmove e2e4" }));
+    EXPECT_TRUE(conversation.timed_out);
+    EXPECT_TRUE(conversation.ended);
+    // unlike add(), attach() keeps the process after EOF.
+    EXPECT_EQ(reactor.size(), 1u);
+    reactor.remove(process);
+}
+
+TEST(ProcessReactor, AwaitedSendWaitsForRoom)
+{
+    System::ProcessReactor reactor;
+    System::Process process("/bin/sh");
+    const char *argv[] = { "/bin/sh", "-c", "wc -c", nullptr };
+    process.start(argv);
+    reactor.attach(process);
+
+    const std::string line(1 << 20, 'x');
+    Conversation conversation;
+    send_large(process, line, conversation);
+    // the pipe took only part of it.
+    EXPECT_FALSE(conversation.done);
+    run_until(reactor, conversation);
+    ASSERT_TRUE(conversation.done);
+    ASSERT_EQ(conversation.lines.size(), 1u);
+    EXPECT_EQ(std::stoul(conversation.lines[0]), line.size() + 1);
+}
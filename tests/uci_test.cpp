@@ -0,0 +1,75 @@
+#include "sys_process.h"
+
+#include <gtest/gtest.h>
+
+#include <chrono>
+#include <string>
+#include <vector>
+
+namespace
+{
+    System::UciMove move_of(std::string_view text)
+    {
+        System::UciMove move;
+        System::UciMove::parse(text, move);
+        return move;
+    }
+}
+
+TEST(Uci, ParsesInfoLines)
+{
+    System::UciInfo info;
+    ASSERT_TRUE(System::uci::parse_info("info depth 12 seldepth 18 multipv 2 score cp -35 lowerbound nodes 123456 "
+                                        "nps 987654 hashfull 321 tbhits 7 time 125 pv e2e4 e7e5 g1f3", info));
+    EXPECT_EQ(info.depth, 12);
+    EXPECT_EQ(info.seldepth, 18);
+    EXPECT_EQ(info.multipv, 2);
+    EXPECT_EQ(info.score.kind, System::UciScore::cp);
+    EXPECT_EQ(info.score.value, -35);
+    EXPECT_TRUE(info.score.lowerbound);
+    EXPECT_EQ(info.nodes, 123456u);
+    EXPECT_EQ(info.hashfull, 321);
+    EXPECT_EQ(info.time_ms, 125u);
+    ASSERT_EQ(info.pv_length, 3u);
+    EXPECT_EQ(info.pv[2], move_of("g1f3"));
+
+    ASSERT_TRUE(System::uci::parse_info("info string NNUE evaluation using nn.nnue", info));
+    EXPECT_EQ(info.string, "NNUE evaluation using nn.nnue");
+    EXPECT_FALSE(System::uci::parse_info("bestmove e2e4", info));
+}
+
+TEST(Uci, ParsesMoves)
+{
+    System::UciMove move;
+    ASSERT_TRUE(System::UciMove::parse("e7e8q", move));
+    char text[5];
+    EXPECT_EQ(std::string(text, move.to_chars(text)), "e7e8q");
+    EXPECT_FALSE(System::UciMove::parse("e7e9", move));
+    EXPECT_FALSE(System::UciMove::parse("e7e8k", move));
+
+    System::UciBestMove best;
+    ASSERT_TRUE(System::uci::parse_bestmove("bestmove e2e4 ponder e7e5", best));
+    EXPECT_TRUE(best.has_ponder);
+    EXPECT_EQ(best.ponder, move_of("e7e5"));
+}
+
+TEST(Uci, EngineSearchesAndAnswers)
+{
+    System::UciEngine engine({ "/bin/sh", SYS_PROCESS_TEST_DIR "/fake_engine.sh" });
+    EXPECT_EQ(engine.name(), "FakeFish 1.0");
+
+    int infos = 0;
+    auto best = engine.go("depth 2", [&infos](const System::UciInfo &) { infos++; });
+    ASSERT_EQ(best.wait_for(std::chrono::seconds(5)), std::future_status::ready);
+    EXPECT_EQ(best.get().move, move_of("e7e8q"));
+    EXPECT_EQ(infos, 3);
+
+    auto ready = engine.is_ready();
+    EXPECT_EQ(ready.wait_for(std::chrono::seconds(5)), std::future_status::ready);
+}
+
+TEST(Uci, MissingEngineThrows)
+{
+    EXPECT_THROW(System::UciEngine({}), std::runtime_error);
+    EXPECT_THROW(System::UciEngine({ "/bin/true" }, 200), std::runtime_error);
+}